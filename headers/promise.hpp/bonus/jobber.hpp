@@ -7,8 +7,30 @@
 #pragma once
 
 #include "../promise.hpp"
+#include "task_queue.hpp"
 
+#include <array>
+#include <deque>
+#include <string>
+#include <fstream>
+#include <optional>
 #include <algorithm>
+#include <unordered_map>
+
+#include <cmath>
+#include <cstdlib>
+
+#if defined(__linux__) || defined(__APPLE__)
+#  include <time.h>
+#endif
+
+#if defined(__linux__)
+#  include <pthread.h>
+#  include <sched.h>
+#  include <sys/resource.h>
+#  include <sys/syscall.h>
+#  include <unistd.h>
+#endif
 
 namespace jobber_hpp
 {
@@ -22,10 +44,18 @@ namespace jobber_hpp
         highest
     };
 
+    enum class jobber_thread_priority {
+        normal,
+        raised,
+        realtime,
+        idle
+    };
+
     enum class jobber_wait_status {
         no_timeout,
         cancelled,
-        timeout
+        timeout,
+        pinned_pending
     };
 
     class jobber_cancelled_exception final : public std::runtime_error {
@@ -34,10 +64,131 @@ namespace jobber_hpp
         : std::runtime_error("jobber has stopped working") {}
     };
 
-    class jobber final : private detail::noncopyable {
+    class jobber_task_cancelled_exception final : public std::runtime_error {
+    public:
+        jobber_task_cancelled_exception()
+        : std::runtime_error("jobber task has been cancelled") {}
+    };
+
+    class jobber_task_handle final {
+    public:
+        jobber_task_handle() = default;
+
+        bool valid() const noexcept {
+            return !!state_;
+        }
+
+        bool cancel() noexcept {
+            return state_ && state_->revoke(
+                std::make_exception_ptr(jobber_task_cancelled_exception()));
+        }
+    private:
+        template < typename QueuePolicy >
+        friend class basic_jobber;
+
+        explicit jobber_task_handle(std::shared_ptr<task_queue_hpp::revocable_state> state) noexcept
+        : state_(std::move(state)) {}
+    private:
+        std::shared_ptr<task_queue_hpp::revocable_state> state_;
+    };
+
+    class jobber_group final {
+    public:
+        jobber_group() = default;
+
+        std::size_t index() const noexcept {
+            return index_;
+        }
+    private:
+        template < typename QueuePolicy >
+        friend class basic_jobber;
+
+        explicit jobber_group(std::size_t index) noexcept
+        : index_(index) {}
+    private:
+        std::size_t index_{0};
+    };
+
+    template < typename Key, typename R, typename Hash = std::hash<Key> >
+    class jobber_unique_tasks final : private detail::noncopyable {
+    public:
+        explicit jobber_unique_tasks(std::size_t shards = 16);
+        std::size_t size() const noexcept;
+    private:
+        template < typename QueuePolicy >
+        friend class basic_jobber;
+
+        struct shard {
+            std::mutex mutex;
+            std::unordered_map<Key, promise<R>, Hash> tasks;
+        };
+
+        shard& shard_(const Key& key) const noexcept;
+    private:
+        std::vector<std::unique_ptr<shard>> shards_;
+    };
+
+    using jobber_cpu_times = std::unordered_map<
+        std::uint32_t,
+        std::chrono::nanoseconds>;
+
+    struct jobber_submit_stats {
+        std::size_t queued_tasks{0};
+        std::size_t caller_runs_tasks{0};
+        std::chrono::nanoseconds average_task_time{0};
+    };
+
+    struct jobber_group_stats {
+        std::size_t weight{0};
+        std::size_t max_concurrency{0};
+        std::size_t queued_tasks{0};
+        std::size_t running_tasks{0};
+        std::size_t processed_tasks{0};
+        std::chrono::nanoseconds busy_time{0};
+    };
+
+    struct jobber_cpu_sources {
+        std::string cgroup_root{"/sys/fs/cgroup"};
+        std::string proc_cgroup{"/proc/self/cgroup"};
+    };
+
+    std::size_t affinity_cpu_count() noexcept;
+    std::optional<double> cgroup_cpu_quota(const jobber_cpu_sources& sources = jobber_cpu_sources());
+    std::size_t available_concurrency(const jobber_cpu_sources& sources = jobber_cpu_sources());
+
+    struct jobber_hung_task {
+        std::size_t worker{0};
+        const char* label{nullptr};
+        std::chrono::nanoseconds running_time{0};
+    };
+
+    struct jobber_options {
+        std::size_t reserved_threads{0};
+        jobber_priority reserved_priority{jobber_priority::highest};
+        jobber_thread_priority reserved_thread_priority{jobber_thread_priority::normal};
+        std::size_t idle_threads{0};
+        jobber_thread_priority idle_thread_priority{jobber_thread_priority::idle};
+        std::size_t caller_runs_depth{0};
+        std::chrono::nanoseconds caller_runs_wait{0};
+        std::chrono::nanoseconds watchdog_threshold{0};
+        std::chrono::nanoseconds watchdog_interval{std::chrono::milliseconds(100)};
+        std::function<void(const jobber_hung_task&)> watchdog_callback;
+        bool watchdog_replace{false};
+        bool elastic{false};
+        std::chrono::milliseconds elastic_interval{std::chrono::seconds(1)};
+        jobber_cpu_sources cpu_sources;
+        // samples the thread CPU clock around the tasks for `cpu_times` and
+        // the busy time of the groups, which are wall times without it
+        bool cpu_accounting{false};
+    };
+
+    template < typename QueuePolicy = task_queue_hpp::priority_heap_policy >
+    class basic_jobber final : private detail::noncopyable {
     public:
-        explicit jobber(std::size_t threads);
-        ~jobber() noexcept;
+        explicit basic_jobber(std::size_t threads);
+        explicit basic_jobber(const jobber_options& options);
+        basic_jobber(std::size_t threads, const jobber_options& options);
+        ~basic_jobber() noexcept;
 
         using active_wait_result_t = std::pair<
             jobber_wait_status,
@@ -56,19 +207,115 @@ namespace jobber_hpp
                  , typename R = async_invoke_result_t<F, Args...> >
         promise<R> async(jobber_priority priority, F&& f, Args&&... args);
 
+        template < typename F, typename... Args
+                 , typename R = async_invoke_result_t<F, Args...> >
+        promise<R> async(jobber_group group, F&& f, Args&&... args);
+
+        template < typename F, typename... Args
+                 , typename R = async_invoke_result_t<F, Args...> >
+        promise<R> async(jobber_group group, jobber_priority priority, F&& f, Args&&... args);
+
+        template < typename R >
+        using revocable_result_t = std::pair<
+            promise<R>,
+            jobber_task_handle>;
+
+        template < typename F, typename... Args
+                 , typename R = async_invoke_result_t<F, Args...> >
+        revocable_result_t<R> async_revocable(F&& f, Args&&... args);
+
+        template < typename F, typename... Args
+                 , typename R = async_invoke_result_t<F, Args...> >
+        revocable_result_t<R> async_revocable(jobber_priority priority, F&& f, Args&&... args);
+
+        template < typename Key, typename R, typename Hash, typename F, typename... Args >
+        promise<R> async_unique(jobber_unique_tasks<Key, R, Hash>& tasks, const Key& key, F&& f, Args&&... args);
+
+        template < typename F, typename... Args
+                 , typename R = async_invoke_result_t<F, Args...> >
+        promise<R> async_on(std::size_t worker, F&& f, Args&&... args);
+
+        template < typename F, typename... Args
+                 , typename R = async_invoke_result_t<F, Args...> >
+        promise<R> async_on(std::size_t worker, jobber_priority priority, F&& f, Args&&... args);
+
+        template < typename F, typename... Args
+                 , typename R = async_invoke_result_t<F, Args...> >
+        promise<R> async_prefer(std::size_t worker, F&& f, Args&&... args);
+
+        template < typename F, typename... Args
+                 , typename R = async_invoke_result_t<F, Args...> >
+        promise<R> async_prefer(std::size_t worker, jobber_priority priority, F&& f, Args&&... args);
+
+        template < typename F >
+        using resumable_invoke_result_t = std::invoke_result_t<
+            std::decay_t<F>&>;
+
+        template < typename F >
+        using resumable_result_t = typename std::conditional_t<
+            std::is_same_v<resumable_invoke_result_t<F>, bool>,
+            promise<void>,
+            resumable_invoke_result_t<F>>::value_type;
+
+        template < typename F
+                 , typename R = resumable_result_t<F> >
+        promise<R> async_resumable(F&& f);
+
+        template < typename F
+                 , typename R = resumable_result_t<F> >
+        promise<R> async_resumable(jobber_priority priority, F&& f);
+
+        bool should_yield() const noexcept;
+
+        template < typename Rep, typename Period >
+        void set_time_slice(const std::chrono::duration<Rep, Period>& time_slice) noexcept;
+        std::chrono::nanoseconds time_slice() const noexcept;
+
+        template < typename F, typename... Fs >
+        void invoke(F&& f, Fs&&... fs);
+
+        jobber_group make_group(std::size_t weight, std::size_t max_concurrency = 0);
+        jobber_group_stats group_stats(jobber_group group) const;
+        std::size_t group_count() const noexcept;
+
+        static jobber_priority current_priority() noexcept;
+
+        class label_scope;
+        static const char* current_label() noexcept;
+        std::size_t hung_worker_count() const noexcept;
+
+        class tag_scope;
+        static std::uint32_t current_tag() noexcept;
+        jobber_cpu_times cpu_times() const;
+        jobber_cpu_times cpu_times(std::size_t worker) const;
+
+        jobber_submit_stats submit_stats() const noexcept;
+
         void pause() noexcept;
         void resume() noexcept;
         bool is_paused() const noexcept;
 
         std::size_t thread_count() const noexcept;
+        std::size_t active_thread_count() const noexcept;
         std::thread::id thread_id(std::size_t i) const;
         std::vector<std::thread::id> thread_ids() const;
+        std::size_t worker_index() const noexcept;
+
+        template < typename T >
+        class local;
 
+        template < typename T, typename... Args >
+        local<T> make_local(Args&&... args);
+
+        // Helping threads can't run the tasks pinned with `async_on`, so the
+        // active waits return `pinned_pending` once only those are left.
         jobber_wait_status wait_all() const noexcept;
         active_wait_result_t active_wait_all() noexcept;
         active_wait_result_t active_wait_one() noexcept;
 
-        template < typename Rep, typename Period >
+        // The relative waits count the timeout on the given clock, so
+        // `wait_all_for<virtual_clock<Tag>>(1h)` moves virtual time.
+        template < typename Clock = std::chrono::steady_clock, typename Rep, typename Period >
         jobber_wait_status wait_all_for(
             const std::chrono::duration<Rep, Period>& timeout_duration) const;
 
@@ -76,7 +323,7 @@ namespace jobber_hpp
         jobber_wait_status wait_all_until(
             const std::chrono::time_point<Clock, Duration>& timeout_time) const;
 
-        template < typename Rep, typename Period >
+        template < typename Clock = std::chrono::steady_clock, typename Rep, typename Period >
         active_wait_result_t active_wait_all_for(
             const std::chrono::duration<Rep, Period>& timeout_duration);
 
@@ -84,67 +331,480 @@ namespace jobber_hpp
         active_wait_result_t active_wait_all_until(
             const std::chrono::time_point<Clock, Duration>& timeout_time);
     private:
-        class task;
-        using task_ptr = std::unique_ptr<task>;
-        template < typename R, typename F, typename... Args >
-        class concrete_task;
+        using task_ptr = task_queue_hpp::task_ptr;
+        using task_queue = typename QueuePolicy::template queue<
+            jobber_priority,
+            task_ptr>;
+        using ready_counts = std::array<
+            std::size_t,
+            task_queue_hpp::priority_count_v<jobber_priority>>;
+
+        struct group_state {
+            task_queue tasks;
+            std::size_t weight{1};
+            std::size_t max_concurrency{0};
+            std::size_t deficit{0};
+            std::size_t running_tasks{0};
+            std::size_t processed_tasks{0};
+            std::chrono::nanoseconds busy_time{0};
+            int ready_priority{-1};
+        };
+
+        struct lane_state {
+            jobber_priority min_priority{jobber_priority::lowest};
+            jobber_priority max_priority{jobber_priority::highest};
+            jobber_thread_priority thread_priority{jobber_thread_priority::normal};
+            std::size_t threads{0};
+            std::condition_variable cond_var;
+        };
+
+        struct worker_state {
+            std::size_t index{0};
+            lane_state* lane{nullptr};
+            task_queue pinned_tasks;
+            task_queue preferred_tasks;
+            bool busy{false};
+            bool hung{false};
+            const char* label{nullptr};
+            std::chrono::steady_clock::time_point task_start{};
+            jobber_cpu_times cpu_times;
+            int stealable_priority{-1};
+        };
+
+        struct replacement_state {
+            std::size_t worker{0};
+            std::thread thread;
+            std::atomic<bool> done{false};
+        };
+
+        template < typename R, typename F >
+        class resumable_task;
+
+        class join_state;
+        class branch_task;
+        template < std::size_t N >
+        class join_frame;
     private:
-        void push_task_(jobber_priority priority, task_ptr task);
-        task_ptr pop_task_() noexcept;
+        template < typename F >
+        static void invoke_branch_(void* f);
+        bool reclaim_branch_(branch_task* branch) noexcept;
+        void join_(const join_state& state) noexcept;
+        void push_task_(jobber_group group, jobber_priority priority, task_ptr task);
+        void push_worker_task_(std::size_t worker, bool pinned, jobber_priority priority, task_ptr task);
+        group_state* next_group_(const lane_state* lane) noexcept;
+        std::optional<jobber_priority> top_group_priority_(const lane_state* lane) const noexcept;
+        typename std::deque<branch_task*>::const_iterator next_branch_(const lane_state* lane) const noexcept;
+        bool is_runnable_(const group_state& group, const lane_state* lane = nullptr) const noexcept;
+        bool has_runnable_tasks_(const lane_state* lane = nullptr) const noexcept;
+        bool has_worker_tasks_(const worker_state& worker) const noexcept;
+        bool is_active_(const worker_state& worker) const noexcept;
+        std::optional<jobber_wait_status> active_wait_done_() const noexcept;
+        task_queue* own_queue_(worker_state& worker) const noexcept;
+        worker_state* steal_victim_(const lane_state* lane) const noexcept;
+        void refresh_group_(group_state& group) noexcept;
+        void refresh_worker_(worker_state& worker) noexcept;
+        void add_branch_(const branch_task& branch) noexcept;
+        void remove_branch_(const branch_task& branch) noexcept;
+        static std::optional<jobber_priority> top_ready_(const ready_counts& counts, const lane_state* lane) noexcept;
+        void update_ready_priority_() noexcept;
+        void notify_one_() noexcept;
+        void notify_lanes_() noexcept;
+        void notify_all_() noexcept;
+        bool should_run_inline_(const group_state& group) const noexcept;
         void shutdown_() noexcept;
-        void worker_main_() noexcept;
-        void process_task_(std::unique_lock<std::mutex> lock) noexcept;
+        std::condition_variable& lane_cond_var_(lane_state& lane) noexcept;
+        void worker_main_(std::size_t index) noexcept;
+        void elastic_main_(std::size_t threads, const jobber_options& options) noexcept;
+        void watchdog_main_(const jobber_options& options) noexcept;
+        void replacement_main_(worker_state& hung, replacement_state& self) noexcept;
+        struct cpu_frame {
+            const basic_jobber* owner{nullptr};
+            cpu_frame* parent{nullptr};
+            std::uint32_t tag{0};
+            std::chrono::nanoseconds mark{0};
+            std::chrono::nanoseconds spent{0};
+        };
+
+        void begin_task_(worker_state* worker, const char* label, cpu_frame& frame, std::uint32_t tag) noexcept;
+        void end_task_(worker_state* worker, cpu_frame& frame) noexcept;
+        cpu_frame* outer_frame_(cpu_frame* frame) const noexcept;
+        void charge_cpu_time_(std::uint32_t tag, std::chrono::nanoseconds time) noexcept;
+        std::chrono::nanoseconds task_time_() const noexcept;
+        static std::chrono::nanoseconds thread_cpu_time_() noexcept;
+        void process_task_(std::unique_lock<std::mutex> lock, worker_state* worker = nullptr) noexcept;
+        void process_queued_task_(
+            std::unique_lock<std::mutex> lock,
+            worker_state* worker,
+            worker_state& owner,
+            task_queue& tasks) noexcept;
+        void run_group_task_(
+            std::unique_lock<std::mutex> lock,
+            worker_state* worker,
+            group_state& group,
+            jobber_priority priority,
+            task_ptr task) noexcept;
+        static bool accepts_(const lane_state* lane, jobber_priority priority) noexcept;
+        static void apply_thread_priority_(jobber_thread_priority priority) noexcept;
     private:
         std::vector<std::thread> threads_;
-        std::vector<std::pair<jobber_priority, task_ptr>> tasks_;
+        std::thread elastic_thread_;
+        std::thread watchdog_thread_;
+        std::deque<std::unique_ptr<replacement_state>> replacements_;
+        std::size_t replacement_slots_{0};
+        std::size_t hung_workers_{0};
+        jobber_cpu_times helper_cpu_times_;
+        std::size_t active_threads_{0};
+        std::vector<std::unique_ptr<lane_state>> lanes_;
+        std::vector<std::unique_ptr<worker_state>> workers_;
+        std::vector<std::unique_ptr<group_state>> groups_;
+        std::size_t current_group_{0};
+        std::deque<branch_task*> branches_;
+        // runnable groups, branches and stealable preferred queues counted
+        // by their top priority, so the waits and pushes don't scan them all
+        ready_counts ready_groups_{};
+        ready_counts ready_branches_{};
+        ready_counts stealable_tasks_{};
+        std::atomic<int> ready_priority_{-1};
+        std::atomic<std::chrono::nanoseconds::rep> time_slice_{0};
         std::atomic<bool> paused_{false};
         std::atomic<bool> cancelled_{false};
         std::atomic<std::size_t> active_task_count_{0};
+        std::size_t pinned_task_count_{0};
+        std::size_t caller_runs_depth_{0};
+        std::chrono::nanoseconds caller_runs_wait_{0};
+        bool cpu_accounting_{false};
+        std::atomic<std::size_t> queued_task_count_{0};
+        std::atomic<std::size_t> caller_runs_task_count_{0};
+        std::atomic<std::chrono::nanoseconds::rep> average_task_time_{0};
         mutable std::mutex tasks_mutex_;
         mutable std::condition_variable cond_var_;
+        std::condition_variable monitor_cond_var_;
+        const std::uint64_t id_{++last_id_};
+    private:
+        inline static std::atomic<std::uint64_t> last_id_{0};
+        inline static thread_local std::uint64_t current_jobber_id_{0};
+        inline static thread_local jobber_priority current_priority_{jobber_priority::normal};
+        inline static thread_local std::chrono::steady_clock::time_point current_task_start_{};
+        inline static thread_local const basic_jobber* current_jobber_{nullptr};
+        inline static thread_local std::size_t current_worker_{0};
+        inline static thread_local bool running_inline_{false};
+        inline static thread_local const char* current_label_{nullptr};
+        inline static thread_local std::uint32_t current_tag_{0};
+        inline static thread_local cpu_frame* current_cpu_frame_{nullptr};
+    };
+
+    template < typename QueuePolicy >
+    class basic_jobber<QueuePolicy>::label_scope final : private detail::noncopyable {
+    public:
+        explicit label_scope(const char* label) noexcept
+        : prev_label_(std::exchange(current_label_, label)) {}
+
+        ~label_scope() noexcept {
+            current_label_ = prev_label_;
+        }
+    private:
+        const char* prev_label_{nullptr};
+    };
+
+    template < typename QueuePolicy >
+    class basic_jobber<QueuePolicy>::tag_scope final : private detail::noncopyable {
+    public:
+        explicit tag_scope(std::uint32_t tag) noexcept
+        : prev_tag_(std::exchange(current_tag_, tag)) {}
+
+        ~tag_scope() noexcept {
+            current_tag_ = prev_tag_;
+        }
+    private:
+        std::uint32_t prev_tag_{0};
     };
 
-    class jobber::task : private detail::noncopyable {
+    using jobber = basic_jobber<>;
+
+    // Workers and watchdog replacements own the slots made up front.
+    // Any other thread running tasks, like an active_wait_* caller, gets
+    // a slot of its own on first use, numbered after the fixed ones.
+    // The slots are shared by the handles and outlive the jobber.
+    template < typename QueuePolicy >
+    template < typename T >
+    class basic_jobber<QueuePolicy>::local final {
     public:
-        virtual ~task() noexcept = default;
-        virtual void run() noexcept = 0;
-        virtual void cancel() noexcept = 0;
+        local() = default;
+
+        T& get() const;
+        T& operator[](std::size_t slot) const;
+        std::size_t size() const;
+
+        template < typename F >
+        void for_each(F&& f) const;
+    private:
+        friend class basic_jobber;
+
+        struct slots_t {
+            std::uint64_t owner{0};
+            std::vector<std::unique_ptr<T>> fixed;
+            std::function<std::unique_ptr<T>()> make;
+            std::mutex helpers_mutex;
+            std::deque<std::pair<std::thread::id, std::unique_ptr<T>>> helpers;
+        };
+
+        explicit local(std::shared_ptr<slots_t> slots) noexcept;
+    private:
+        std::shared_ptr<slots_t> slots_;
     };
 
-    template < typename R, typename F, typename... Args >
-    class jobber::concrete_task final : public task {
+    template < typename QueuePolicy >
+    template < typename R, typename F >
+    class basic_jobber<QueuePolicy>::resumable_task final : public task_queue_hpp::task {
+        const basic_jobber& owner_;
         F f_;
-        std::tuple<Args...> args_;
         promise<R> promise_;
+        bool yielded_{false};
     public:
         template < typename U >
-        concrete_task(U&& u, std::tuple<Args...>&& args);
+        resumable_task(const basic_jobber& owner, U&& u);
         void run() noexcept final;
-        void cancel() noexcept final;
+        void cancel(std::exception_ptr e) noexcept final;
+        bool yielded() const noexcept final;
         promise<R> future() noexcept;
     };
 
-    template < typename F, typename... Args >
-    class jobber::concrete_task<void, F, Args...> final : public task {
-        F f_;
-        std::tuple<Args...> args_;
-        promise<void> promise_;
+    template < typename QueuePolicy >
+    class basic_jobber<QueuePolicy>::join_state : private detail::noncopyable {
     public:
-        template < typename U >
-        concrete_task(U&& u, std::tuple<Args...>&& args);
-        void run() noexcept final;
-        void cancel() noexcept final;
-        promise<void> future() noexcept;
+        explicit join_state(std::size_t branches) noexcept;
+
+        void fail(std::exception_ptr e) noexcept;
+        void finish() noexcept;
+        bool joined() const noexcept;
+        std::exception_ptr exception() const noexcept;
+    private:
+        std::atomic<std::size_t> pending_;
+        std::atomic<bool> failed_{false};
+        std::exception_ptr exception_{nullptr};
+    };
+
+    template < typename QueuePolicy >
+    class basic_jobber<QueuePolicy>::branch_task final : private detail::noncopyable {
+    public:
+        branch_task() = default;
+
+        void bind(
+            join_state& state,
+            jobber_priority priority,
+            std::uint32_t tag,
+            void (*invoker)(void*),
+            void* f) noexcept;
+
+        jobber_priority priority() const noexcept;
+        std::uint32_t tag() const noexcept;
+        void run() noexcept;
+        void cancel(std::exception_ptr e) noexcept;
+    private:
+        join_state* state_{nullptr};
+        jobber_priority priority_{jobber_priority::normal};
+        std::uint32_t tag_{0};
+        void (*invoker_)(void*){nullptr};
+        void* f_{nullptr};
+    };
+
+    template < typename QueuePolicy >
+    template < std::size_t N >
+    class basic_jobber<QueuePolicy>::join_frame final : public join_state {
+    public:
+        join_frame() noexcept
+        : join_state(N) {}
+
+        std::array<branch_task, N> branches;
     };
 }
 
 namespace jobber_hpp
 {
-    inline jobber::jobber(std::size_t threads) {
+    inline std::size_t affinity_cpu_count() noexcept {
+    #if defined(__linux__)
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        if ( !::sched_getaffinity(0, sizeof(set), &set) && CPU_COUNT(&set) > 0 ) {
+            return static_cast<std::size_t>(CPU_COUNT(&set));
+        }
+    #endif
+        return std::max(std::thread::hardware_concurrency(), 1u);
+    }
+
+    inline std::optional<double> cgroup_cpu_quota(const jobber_cpu_sources& sources) {
+        std::optional<double> quota;
+        const auto limit = [&quota](double cpus){
+            if ( cpus > 0.0 ) {
+                quota = quota ? std::min(*quota, cpus) : cpus;
+            }
+        };
+
+        // a nested cgroup is also limited by all of its ancestors
+        const auto walk = [](const std::string& base, std::string path, const auto& visit){
+            while ( !path.empty() && path.back() == '/' ) {
+                path.pop_back();
+            }
+            while ( true ) {
+                visit(base + path);
+                const std::size_t slash = path.find_last_of('/');
+                if ( slash == std::string::npos ) {
+                    break;
+                }
+                path.erase(slash);
+            }
+        };
+
+        const auto visit_v2 = [&limit](const std::string& dir){
+            std::ifstream cpu_max(dir + "/cpu.max");
+            std::string max;
+            double period = 0.0;
+            if ( cpu_max >> max >> period && max != "max" && period > 0.0 ) {
+                limit(std::strtod(max.c_str(), nullptr) / period);
+            }
+        };
+
+        const auto visit_v1 = [&limit](const std::string& dir){
+            std::ifstream quota_us(dir + "/cpu.cfs_quota_us");
+            std::ifstream period_us(dir + "/cpu.cfs_period_us");
+            double quota_value = 0.0;
+            double period = 0.0;
+            if ( quota_us >> quota_value && period_us >> period && period > 0.0 ) {
+                limit(quota_value / period);
+            }
+        };
+
+        const auto visit_cgroup = [&](const std::string& controllers, const std::string& path){
+            if ( controllers.empty() ) {
+                walk(sources.cgroup_root, path, visit_v2);
+                return;
+            }
+            const std::string list = "," + controllers + ",";
+            if ( list.find(",cpu,") != std::string::npos ) {
+                for ( const char* mount : {"/cpu", "/cpu,cpuacct", "/cpuacct,cpu"} ) {
+                    walk(sources.cgroup_root + mount, path, visit_v1);
+                }
+            }
+        };
+
+        // lines of /proc/self/cgroup look like "hierarchy-id:controllers:path"
+        bool found = false;
+        std::ifstream proc_cgroup(sources.proc_cgroup);
+        for ( std::string line; std::getline(proc_cgroup, line); ) {
+            const std::size_t first = line.find(':');
+            const std::size_t second = first != std::string::npos
+                ? line.find(':', first + 1)
+                : std::string::npos;
+            if ( second != std::string::npos ) {
+                visit_cgroup(
+                    line.substr(first + 1, second - first - 1),
+                    line.substr(second + 1));
+                found = true;
+            }
+        }
+
+        if ( !found ) {
+            visit_cgroup("", "");
+            visit_cgroup("cpu", "");
+        }
+
+        return quota;
+    }
+
+    inline std::size_t available_concurrency(const jobber_cpu_sources& sources) {
+        std::size_t cpus = affinity_cpu_count();
+        if ( const std::optional<double> quota = cgroup_cpu_quota(sources) ) {
+            cpus = std::min(cpus, static_cast<std::size_t>(std::ceil(*quota)));
+        }
+        return std::max(cpus, std::size_t(1));
+    }
+}
+
+namespace jobber_hpp
+{
+    template < typename Key, typename R, typename Hash >
+    jobber_unique_tasks<Key, R, Hash>::jobber_unique_tasks(std::size_t shards) {
+        shards_.resize(std::max(shards, std::size_t(1)));
+        for ( std::unique_ptr<shard>& s : shards_ ) {
+            s = std::make_unique<shard>();
+        }
+    }
+
+    template < typename Key, typename R, typename Hash >
+    std::size_t jobber_unique_tasks<Key, R, Hash>::size() const noexcept {
+        std::size_t result = 0;
+        for ( const std::unique_ptr<shard>& s : shards_ ) {
+            std::lock_guard<std::mutex> guard(s->mutex);
+            result += s->tasks.size();
+        }
+        return result;
+    }
+
+    template < typename Key, typename R, typename Hash >
+    typename jobber_unique_tasks<Key, R, Hash>::shard&
+    jobber_unique_tasks<Key, R, Hash>::shard_(const Key& key) const noexcept {
+        return *shards_[Hash()(key) % shards_.size()];
+    }
+}
+
+namespace jobber_hpp
+{
+    template < typename QueuePolicy >
+    basic_jobber<QueuePolicy>::basic_jobber(std::size_t threads)
+    : basic_jobber(threads, jobber_options()) {}
+
+    template < typename QueuePolicy >
+    basic_jobber<QueuePolicy>::basic_jobber(const jobber_options& options)
+    : basic_jobber(options.elastic
+        ? affinity_cpu_count()
+        : available_concurrency(options.cpu_sources), options) {}
+
+    template < typename QueuePolicy >
+    basic_jobber<QueuePolicy>::basic_jobber(std::size_t threads, const jobber_options& options) {
+        groups_.push_back(std::make_unique<group_state>());
+        caller_runs_depth_ = options.caller_runs_depth;
+        caller_runs_wait_ = options.caller_runs_wait;
+        cpu_accounting_ = options.cpu_accounting;
+        lane_state& general = *lanes_.emplace_back(std::make_unique<lane_state>());
+        std::vector<lane_state*> worker_lanes(threads, &general);
+        general.threads = threads;
+        if ( options.reserved_threads ) {
+            lane_state& reserved = *lanes_.emplace_back(std::make_unique<lane_state>());
+            reserved.min_priority = options.reserved_priority;
+            reserved.thread_priority = options.reserved_thread_priority;
+            reserved.threads = options.reserved_threads;
+            worker_lanes.insert(worker_lanes.end(), options.reserved_threads, &reserved);
+        }
+        if ( options.idle_threads ) {
+            lane_state& idle = *lanes_.emplace_back(std::make_unique<lane_state>());
+            idle.max_priority = jobber_priority::lowest;
+            idle.thread_priority = options.idle_thread_priority;
+            idle.threads = options.idle_threads;
+            worker_lanes.insert(worker_lanes.end(), options.idle_threads, &idle);
+            general.min_priority = jobber_priority::below_normal;
+        }
+        active_threads_ = options.elastic
+            ? std::min(threads, available_concurrency(options.cpu_sources))
+            : threads;
+        for ( std::size_t i = 0; i < worker_lanes.size(); ++i ) {
+            auto worker = std::make_unique<worker_state>();
+            worker->index = i;
+            worker->lane = worker_lanes[i];
+            workers_.push_back(std::move(worker));
+        }
+        if ( options.watchdog_replace ) {
+            replacement_slots_ = workers_.size();
+        }
         try {
-            threads_.resize(threads);
-            for ( std::thread& thread : threads_ ) {
-                thread = std::thread(&jobber::worker_main_, this);
+            threads_.resize(workers_.size());
+            for ( std::size_t i = 0; i < threads_.size(); ++i ) {
+                threads_[i] = std::thread(&basic_jobber::worker_main_, this, i);
+            }
+            if ( options.elastic ) {
+                elastic_thread_ = std::thread(&basic_jobber::elastic_main_, this, threads, options);
+            }
+            if ( options.watchdog_threshold > std::chrono::nanoseconds::zero() ) {
+                watchdog_thread_ = std::thread(&basic_jobber::watchdog_main_, this, options);
             }
         } catch (...) {
             shutdown_();
@@ -152,21 +812,44 @@ namespace jobber_hpp
         }
     }
 
-    inline jobber::~jobber() noexcept {
+    template < typename QueuePolicy >
+    basic_jobber<QueuePolicy>::~basic_jobber() noexcept {
         shutdown_();
     }
 
+    template < typename QueuePolicy >
+    template < typename F, typename... Args, typename R >
+    promise<R> basic_jobber<QueuePolicy>::async(F&& f, Args&&... args) {
+        return async(
+            current_priority_,
+            std::forward<F>(f),
+            std::forward<Args>(args)...);
+    }
+
+    template < typename QueuePolicy >
+    template < typename F, typename... Args, typename R >
+    promise<R> basic_jobber<QueuePolicy>::async(jobber_priority priority, F&& f, Args&&... args) {
+        return async(
+            jobber_group(),
+            priority,
+            std::forward<F>(f),
+            std::forward<Args>(args)...);
+    }
+
+    template < typename QueuePolicy >
     template < typename F, typename... Args, typename R >
-    promise<R> jobber::async(F&& f, Args&&... args) {
+    promise<R> basic_jobber<QueuePolicy>::async(jobber_group group, F&& f, Args&&... args) {
         return async(
-            jobber_priority::normal,
+            group,
+            current_priority_,
             std::forward<F>(f),
             std::forward<Args>(args)...);
     }
 
+    template < typename QueuePolicy >
     template < typename F, typename... Args, typename R >
-    promise<R> jobber::async(jobber_priority priority, F&& f, Args&&... args) {
-        using task_t = concrete_task<
+    promise<R> basic_jobber<QueuePolicy>::async(jobber_group group, jobber_priority priority, F&& f, Args&&... args) {
+        using task_t = task_queue_hpp::concrete_task<
             R,
             std::decay_t<F>,
             std::decay_t<Args>...>;
@@ -174,261 +857,1525 @@ namespace jobber_hpp
             std::forward<F>(f),
             std::make_tuple(std::forward<Args>(args)...));
         promise<R> future = task->future();
-        std::lock_guard<std::mutex> guard(tasks_mutex_);
-        push_task_(priority, std::move(task));
+        std::unique_lock<std::mutex> lock(tasks_mutex_);
+        group_state& state = *groups_.at(group.index());
+        if ( should_run_inline_(state) ) {
+            // accounted like a group task run by a helper, just not queued
+            task->set_label(current_label_);
+            task->set_tag(current_tag_);
+            ++caller_runs_task_count_;
+            ++active_task_count_;
+            running_inline_ = true;
+            run_group_task_(std::move(lock), nullptr, state, priority, std::move(task));
+            running_inline_ = false;
+            return future;
+        }
+        push_task_(group, priority, std::move(task));
         return future;
     }
 
-    inline void jobber::pause() noexcept {
-        std::lock_guard<std::mutex> guard(tasks_mutex_);
-        paused_.store(true);
-        cond_var_.notify_all();
+    template < typename QueuePolicy >
+    template < typename F, typename... Args, typename R >
+    typename basic_jobber<QueuePolicy>::template revocable_result_t<R>
+    basic_jobber<QueuePolicy>::async_revocable(F&& f, Args&&... args) {
+        return async_revocable(
+            current_priority_,
+            std::forward<F>(f),
+            std::forward<Args>(args)...);
     }
 
-    inline void jobber::resume() noexcept {
+    template < typename QueuePolicy >
+    template < typename F, typename... Args, typename R >
+    typename basic_jobber<QueuePolicy>::template revocable_result_t<R>
+    basic_jobber<QueuePolicy>::async_revocable(jobber_priority priority, F&& f, Args&&... args) {
+        using state_t = task_queue_hpp::concrete_revocable_state<
+            R,
+            std::decay_t<F>,
+            std::decay_t<Args>...>;
+        std::shared_ptr<state_t> state = std::make_shared<state_t>(
+            std::forward<F>(f),
+            std::make_tuple(std::forward<Args>(args)...));
+        promise<R> future = state->future();
+        task_ptr task = std::make_unique<task_queue_hpp::revocable_task>(state);
         std::lock_guard<std::mutex> guard(tasks_mutex_);
-        paused_.store(false);
-        cond_var_.notify_all();
-    }
-
-    inline bool jobber::is_paused() const noexcept {
-        return paused_;
+        push_task_(jobber_group(), priority, std::move(task));
+        return std::make_pair(std::move(future), jobber_task_handle(std::move(state)));
     }
 
-    inline std::size_t jobber::thread_count() const noexcept {
-        return threads_.size();
+    template < typename QueuePolicy >
+    template < typename Key, typename R, typename Hash, typename F, typename... Args >
+    promise<R> basic_jobber<QueuePolicy>::async_unique(
+        jobber_unique_tasks<Key, R, Hash>& tasks,
+        const Key& key,
+        F&& f,
+        Args&&... args)
+    {
+        using task_t = task_queue_hpp::concrete_task<
+            R,
+            std::decay_t<F>,
+            std::decay_t<Args>...>;
+        auto& shard = tasks.shard_(key);
+        std::unique_ptr<task_t> task;
+        promise<R> future;
+        {
+            std::lock_guard<std::mutex> guard(shard.mutex);
+            const auto iter = shard.tasks.find(key);
+            if ( iter != shard.tasks.end() ) {
+                return iter->second;
+            }
+            task = std::make_unique<task_t>(
+                std::forward<F>(f),
+                std::make_tuple(std::forward<Args>(args)...));
+            future = task->future();
+            shard.tasks.emplace(key, future);
+        }
+        const auto forget = [&shard, key](){
+            std::lock_guard<std::mutex> guard(shard.mutex);
+            shard.tasks.erase(key);
+        };
+        try {
+            std::lock_guard<std::mutex> guard(tasks_mutex_);
+            push_task_(jobber_group(), current_priority_, std::move(task));
+        } catch (...) {
+            forget();
+            throw;
+        }
+        // the key is forgotten only after the promise is settled, so the
+        // callers coming in between still share the finished result
+        future.finally(forget);
+        return future;
     }
 
-    inline std::thread::id jobber::thread_id(std::size_t i) const {
-        return threads_[i].get_id();
+    template < typename QueuePolicy >
+    template < typename F, typename... Args, typename R >
+    promise<R> basic_jobber<QueuePolicy>::async_on(std::size_t worker, F&& f, Args&&... args) {
+        return async_on(
+            worker,
+            current_priority_,
+            std::forward<F>(f),
+            std::forward<Args>(args)...);
     }
 
-    inline std::vector<std::thread::id> jobber::thread_ids() const {
-        std::vector<std::thread::id> ids;
-        ids.reserve(threads_.size());
-        for ( const std::thread& t : threads_ ) {
-            ids.push_back(t.get_id());
-        }
-        return ids;
+    template < typename QueuePolicy >
+    template < typename F, typename... Args, typename R >
+    promise<R> basic_jobber<QueuePolicy>::async_on(std::size_t worker, jobber_priority priority, F&& f, Args&&... args) {
+        using task_t = task_queue_hpp::concrete_task<
+            R,
+            std::decay_t<F>,
+            std::decay_t<Args>...>;
+        std::unique_ptr<task_t> task = std::make_unique<task_t>(
+            std::forward<F>(f),
+            std::make_tuple(std::forward<Args>(args)...));
+        promise<R> future = task->future();
+        std::lock_guard<std::mutex> guard(tasks_mutex_);
+        push_worker_task_(worker, true, priority, std::move(task));
+        return future;
     }
 
-    inline jobber_wait_status jobber::wait_all() const noexcept {
-        std::unique_lock<std::mutex> lock(tasks_mutex_);
-        cond_var_.wait(lock, [this](){
-            return cancelled_ || !active_task_count_;
-        });
-        return cancelled_
-            ? jobber_wait_status::cancelled
-            : jobber_wait_status::no_timeout;
+    template < typename QueuePolicy >
+    template < typename F, typename... Args, typename R >
+    promise<R> basic_jobber<QueuePolicy>::async_prefer(std::size_t worker, F&& f, Args&&... args) {
+        return async_prefer(
+            worker,
+            current_priority_,
+            std::forward<F>(f),
+            std::forward<Args>(args)...);
     }
 
-    inline jobber::active_wait_result_t jobber::active_wait_all() noexcept {
+    template < typename QueuePolicy >
+    template < typename F, typename... Args, typename R >
+    promise<R> basic_jobber<QueuePolicy>::async_prefer(std::size_t worker, jobber_priority priority, F&& f, Args&&... args) {
+        using task_t = task_queue_hpp::concrete_task<
+            R,
+            std::decay_t<F>,
+            std::decay_t<Args>...>;
+        std::unique_ptr<task_t> task = std::make_unique<task_t>(
+            std::forward<F>(f),
+            std::make_tuple(std::forward<Args>(args)...));
+        promise<R> future = task->future();
+        std::lock_guard<std::mutex> guard(tasks_mutex_);
+        push_worker_task_(worker, false, priority, std::move(task));
+        return future;
+    }
+
+    template < typename QueuePolicy >
+    template < typename F, typename R >
+    promise<R> basic_jobber<QueuePolicy>::async_resumable(F&& f) {
+        return async_resumable(
+            current_priority_,
+            std::forward<F>(f));
+    }
+
+    template < typename QueuePolicy >
+    template < typename F, typename R >
+    promise<R> basic_jobber<QueuePolicy>::async_resumable(jobber_priority priority, F&& f) {
+        using task_t = resumable_task<R, std::decay_t<F>>;
+        std::unique_ptr<task_t> task = std::make_unique<task_t>(
+            *this,
+            std::forward<F>(f));
+        promise<R> future = task->future();
+        std::lock_guard<std::mutex> guard(tasks_mutex_);
+        push_task_(jobber_group(), priority, std::move(task));
+        return future;
+    }
+
+    template < typename QueuePolicy >
+    bool basic_jobber<QueuePolicy>::should_yield() const noexcept {
+        if ( cancelled_.load() ) {
+            return true;
+        }
+        const int ready = ready_priority_.load(std::memory_order_relaxed);
+        const int current = static_cast<int>(current_priority_);
+        if ( ready < current ) {
+            return false;
+        }
+        if ( ready > current ) {
+            return true;
+        }
+        const std::chrono::nanoseconds slice{
+            time_slice_.load(std::memory_order_relaxed)};
+        return slice > std::chrono::nanoseconds::zero()
+            && std::chrono::steady_clock::now() - current_task_start_ >= slice;
+    }
+
+    template < typename QueuePolicy >
+    template < typename Rep, typename Period >
+    void basic_jobber<QueuePolicy>::set_time_slice(
+        const std::chrono::duration<Rep, Period>& time_slice) noexcept
+    {
+        time_slice_.store(std::chrono::duration_cast<std::chrono::nanoseconds>(
+            time_slice).count());
+    }
+
+    template < typename QueuePolicy >
+    std::chrono::nanoseconds basic_jobber<QueuePolicy>::time_slice() const noexcept {
+        return std::chrono::nanoseconds(time_slice_.load());
+    }
+
+    template < typename QueuePolicy >
+    template < typename F, typename... Fs >
+    void basic_jobber<QueuePolicy>::invoke(F&& f, Fs&&... fs) {
+        if constexpr ( sizeof...(Fs) == 0 ) {
+            std::invoke(f);
+        } else {
+            join_frame<sizeof...(Fs)> frame;
+
+            void* const callables[] = {
+                const_cast<void*>(static_cast<const void*>(std::addressof(fs)))...};
+            void (* const invokers[])(void*) = {
+                &invoke_branch_<std::remove_reference_t<Fs>>...};
+            for ( std::size_t i = 0; i < sizeof...(Fs); ++i ) {
+                frame.branches[i].bind(
+                    frame, current_priority_, current_tag_, invokers[i], callables[i]);
+            }
+
+            // branches that cannot be published are run inline by the reclaim loop
+            std::size_t published = 0;
+            try {
+                std::lock_guard<std::mutex> guard(tasks_mutex_);
+                for ( branch_task& branch : frame.branches ) {
+                    branches_.push_back(&branch);
+                    add_branch_(branch);
+                    ++active_task_count_;
+                    ++published;
+                    notify_one_();
+                }
+                update_ready_priority_();
+                notify_lanes_();
+            } catch (...) {
+            }
+
+            try {
+                std::invoke(f);
+            } catch (...) {
+                frame.fail(std::current_exception());
+            }
+
+            for ( std::size_t i = sizeof...(Fs); i > 0; --i ) {
+                branch_task& branch = frame.branches[i - 1];
+                if ( i > published || reclaim_branch_(&branch) ) {
+                    branch.run();
+                }
+            }
+
+            join_(frame);
+
+            if ( const std::exception_ptr e = frame.exception() ) {
+                std::rethrow_exception(e);
+            }
+        }
+    }
+
+    template < typename QueuePolicy >
+    jobber_group basic_jobber<QueuePolicy>::make_group(std::size_t weight, std::size_t max_concurrency) {
+        auto group = std::make_unique<group_state>();
+        group->weight = std::max(weight, std::size_t(1));
+        group->max_concurrency = max_concurrency;
+        std::lock_guard<std::mutex> guard(tasks_mutex_);
+        groups_.push_back(std::move(group));
+        return jobber_group(groups_.size() - 1);
+    }
+
+    template < typename QueuePolicy >
+    jobber_group_stats basic_jobber<QueuePolicy>::group_stats(jobber_group group) const {
+        std::lock_guard<std::mutex> guard(tasks_mutex_);
+        const group_state& state = *groups_.at(group.index());
+        jobber_group_stats stats;
+        stats.weight = state.weight;
+        stats.max_concurrency = state.max_concurrency;
+        stats.queued_tasks = state.tasks.size();
+        stats.running_tasks = state.running_tasks;
+        stats.processed_tasks = state.processed_tasks;
+        stats.busy_time = state.busy_time;
+        return stats;
+    }
+
+    template < typename QueuePolicy >
+    std::size_t basic_jobber<QueuePolicy>::group_count() const noexcept {
+        std::lock_guard<std::mutex> guard(tasks_mutex_);
+        return groups_.size();
+    }
+
+    template < typename QueuePolicy >
+    jobber_priority basic_jobber<QueuePolicy>::current_priority() noexcept {
+        return current_priority_;
+    }
+
+    template < typename QueuePolicy >
+    const char* basic_jobber<QueuePolicy>::current_label() noexcept {
+        return current_label_;
+    }
+
+    template < typename QueuePolicy >
+    std::size_t basic_jobber<QueuePolicy>::hung_worker_count() const noexcept {
+        std::lock_guard<std::mutex> guard(tasks_mutex_);
+        return hung_workers_;
+    }
+
+    template < typename QueuePolicy >
+    std::uint32_t basic_jobber<QueuePolicy>::current_tag() noexcept {
+        return current_tag_;
+    }
+
+    template < typename QueuePolicy >
+    jobber_cpu_times basic_jobber<QueuePolicy>::cpu_times() const {
+        std::lock_guard<std::mutex> guard(tasks_mutex_);
+        jobber_cpu_times result = helper_cpu_times_;
+        for ( const std::unique_ptr<worker_state>& worker : workers_ ) {
+            for ( const auto& [tag, time] : worker->cpu_times ) {
+                result[tag] += time;
+            }
+        }
+        return result;
+    }
+
+    template < typename QueuePolicy >
+    jobber_cpu_times basic_jobber<QueuePolicy>::cpu_times(std::size_t worker) const {
+        std::lock_guard<std::mutex> guard(tasks_mutex_);
+        return worker == workers_.size()
+            ? helper_cpu_times_
+            : workers_.at(worker)->cpu_times;
+    }
+
+    template < typename QueuePolicy >
+    jobber_submit_stats basic_jobber<QueuePolicy>::submit_stats() const noexcept {
+        jobber_submit_stats stats;
+        stats.queued_tasks = queued_task_count_.load();
+        stats.caller_runs_tasks = caller_runs_task_count_.load();
+        stats.average_task_time = std::chrono::nanoseconds(average_task_time_.load());
+        return stats;
+    }
+
+    template < typename QueuePolicy >
+    void basic_jobber<QueuePolicy>::pause() noexcept {
+        std::lock_guard<std::mutex> guard(tasks_mutex_);
+        paused_.store(true);
+        notify_all_();
+    }
+
+    template < typename QueuePolicy >
+    void basic_jobber<QueuePolicy>::resume() noexcept {
+        std::lock_guard<std::mutex> guard(tasks_mutex_);
+        paused_.store(false);
+        notify_all_();
+    }
+
+    template < typename QueuePolicy >
+    bool basic_jobber<QueuePolicy>::is_paused() const noexcept {
+        return paused_;
+    }
+
+    template < typename QueuePolicy >
+    std::size_t basic_jobber<QueuePolicy>::thread_count() const noexcept {
+        return threads_.size();
+    }
+
+    template < typename QueuePolicy >
+    std::size_t basic_jobber<QueuePolicy>::active_thread_count() const noexcept {
+        std::lock_guard<std::mutex> guard(tasks_mutex_);
+        return active_threads_ + threads_.size() - lanes_.front()->threads;
+    }
+
+    template < typename QueuePolicy >
+    std::thread::id basic_jobber<QueuePolicy>::thread_id(std::size_t i) const {
+        return threads_[i].get_id();
+    }
+
+    template < typename QueuePolicy >
+    std::vector<std::thread::id> basic_jobber<QueuePolicy>::thread_ids() const {
+        std::vector<std::thread::id> ids;
+        ids.reserve(threads_.size());
+        for ( const std::thread& t : threads_ ) {
+            ids.push_back(t.get_id());
+        }
+        return ids;
+    }
+
+    template < typename QueuePolicy >
+    std::size_t basic_jobber<QueuePolicy>::worker_index() const noexcept {
+        return current_jobber_ == this
+            ? std::min(current_worker_, threads_.size())
+            : threads_.size();
+    }
+
+    template < typename QueuePolicy >
+    template < typename T, typename... Args >
+    typename basic_jobber<QueuePolicy>::template local<T>
+    basic_jobber<QueuePolicy>::make_local(Args&&... args) {
+        auto slots = std::make_shared<typename local<T>::slots_t>();
+        slots->owner = id_;
+        slots->make = [args...](){
+            return std::make_unique<T>(args...);
+        };
+        slots->fixed.reserve(threads_.size() + replacement_slots_);
+        for ( std::size_t i = 0; i < threads_.size() + replacement_slots_; ++i ) {
+            slots->fixed.push_back(slots->make());
+        }
+        return local<T>(std::move(slots));
+    }
+
+    template < typename QueuePolicy >
+    jobber_wait_status basic_jobber<QueuePolicy>::wait_all() const noexcept {
+        std::unique_lock<std::mutex> lock(tasks_mutex_);
+        cond_var_.wait(lock, [this](){
+            return cancelled_ || !active_task_count_;
+        });
+        return cancelled_
+            ? jobber_wait_status::cancelled
+            : jobber_wait_status::no_timeout;
+    }
+
+    template < typename QueuePolicy >
+    typename basic_jobber<QueuePolicy>::active_wait_result_t
+    basic_jobber<QueuePolicy>::active_wait_all() noexcept {
         std::size_t processed_tasks = 0;
-        while ( !cancelled_ && active_task_count_ ) {
-            std::unique_lock<std::mutex> lock(tasks_mutex_);
+        std::unique_lock<std::mutex> lock(tasks_mutex_);
+        while ( true ) {
             cond_var_.wait(lock, [this](){
-                return cancelled_ || !active_task_count_ || !tasks_.empty();
+                return active_wait_done_() || has_runnable_tasks_();
             });
-            if ( !tasks_.empty() ) {
-                process_task_(std::move(lock));
-                ++processed_tasks;
+            if ( const std::optional<jobber_wait_status> status = active_wait_done_() ) {
+                return std::make_pair(*status, processed_tasks);
             }
+            process_task_(std::move(lock));
+            ++processed_tasks;
+            lock = std::unique_lock<std::mutex>(tasks_mutex_);
         }
-        return std::make_pair(
-            cancelled_
-                ? jobber_wait_status::cancelled
-                : jobber_wait_status::no_timeout,
-            processed_tasks);
     }
 
-    inline jobber::active_wait_result_t jobber::active_wait_one() noexcept {
+    template < typename QueuePolicy >
+    typename basic_jobber<QueuePolicy>::active_wait_result_t
+    basic_jobber<QueuePolicy>::active_wait_one() noexcept {
         std::unique_lock<std::mutex> lock(tasks_mutex_);
         if ( cancelled_ ) {
             return std::make_pair(jobber_wait_status::cancelled, 0u);
         }
-        if ( tasks_.empty() ) {
+        if ( !has_runnable_tasks_() ) {
             return std::make_pair(jobber_wait_status::no_timeout, 0u);
         }
         process_task_(std::move(lock));
         return std::make_pair(jobber_wait_status::no_timeout, 1u);
     }
 
-    template < typename Rep, typename Period >
-    jobber_wait_status jobber::wait_all_for(
+    template < typename QueuePolicy >
+    template < typename Clock, typename Rep, typename Period >
+    jobber_wait_status basic_jobber<QueuePolicy>::wait_all_for(
         const std::chrono::duration<Rep, Period>& timeout_duration) const
     {
         return wait_all_until(
-            std::chrono::steady_clock::now() + timeout_duration);
+            Clock::now() + timeout_duration);
     }
 
+    template < typename QueuePolicy >
     template < typename Clock, typename Duration >
-    jobber_wait_status jobber::wait_all_until(
+    jobber_wait_status basic_jobber<QueuePolicy>::wait_all_until(
         const std::chrono::time_point<Clock, Duration>& timeout_time) const
     {
         std::unique_lock<std::mutex> lock(tasks_mutex_);
-        return cond_var_.wait_until(lock, timeout_time, [this](){
-            return cancelled_ || !active_task_count_;
-        })  ? jobber_wait_status::no_timeout
-            : jobber_wait_status::timeout;
+        if constexpr ( is_virtual_clock_v<Clock> ) {
+            if ( cancelled_ || !active_task_count_ ) {
+                return jobber_wait_status::no_timeout;
+            }
+            Clock::advance_to(timeout_time);
+            return jobber_wait_status::timeout;
+        } else {
+            return cond_var_.wait_until(lock, timeout_time, [this](){
+                return cancelled_ || !active_task_count_;
+            })  ? jobber_wait_status::no_timeout
+                : jobber_wait_status::timeout;
+        }
     }
 
-    template < typename Rep, typename Period >
-    jobber::active_wait_result_t jobber::active_wait_all_for(
+    template < typename QueuePolicy >
+    template < typename Clock, typename Rep, typename Period >
+    typename basic_jobber<QueuePolicy>::active_wait_result_t
+    basic_jobber<QueuePolicy>::active_wait_all_for(
         const std::chrono::duration<Rep, Period>& timeout_duration)
     {
         return active_wait_all_until(
-            std::chrono::steady_clock::now() + timeout_duration);
+            Clock::now() + timeout_duration);
     }
 
+    template < typename QueuePolicy >
     template < typename Clock, typename Duration >
-    jobber::active_wait_result_t jobber::active_wait_all_until(
+    typename basic_jobber<QueuePolicy>::active_wait_result_t
+    basic_jobber<QueuePolicy>::active_wait_all_until(
         const std::chrono::time_point<Clock, Duration>& timeout_time)
     {
         std::size_t processed_tasks = 0;
-        while ( !cancelled_ && active_task_count_ ) {
+        std::unique_lock<std::mutex> lock(tasks_mutex_);
+        while ( !active_wait_done_() ) {
             if ( !(Clock::now() < timeout_time) ) {
                 return std::make_pair(
                     jobber_wait_status::timeout,
                     processed_tasks);
             }
-            std::unique_lock<std::mutex> lock(tasks_mutex_);
-            cond_var_.wait_until(lock, timeout_time, [this](){
-                return cancelled_ || !active_task_count_ || !tasks_.empty();
-            });
-            if ( !tasks_.empty() ) {
+            if constexpr ( is_virtual_clock_v<Clock> ) {
+                // nothing to run here, so the virtual time runs out at once
+                if ( !has_runnable_tasks_() ) {
+                    Clock::advance_to(timeout_time);
+                    continue;
+                }
+            } else {
+                cond_var_.wait_until(lock, timeout_time, [this](){
+                    return active_wait_done_() || has_runnable_tasks_();
+                });
+            }
+            if ( has_runnable_tasks_() ) {
                 process_task_(std::move(lock));
                 ++processed_tasks;
+                lock = std::unique_lock<std::mutex>(tasks_mutex_);
             }
         }
-        return std::make_pair(
-            cancelled_
-                ? jobber_wait_status::cancelled
-                : jobber_wait_status::no_timeout,
-            processed_tasks);
+        return std::make_pair(*active_wait_done_(), processed_tasks);
+    }
+
+    template < typename QueuePolicy >
+    template < typename F >
+    void basic_jobber<QueuePolicy>::invoke_branch_(void* f) {
+        std::invoke(*static_cast<F*>(f));
+    }
+
+    template < typename QueuePolicy >
+    bool basic_jobber<QueuePolicy>::reclaim_branch_(branch_task* branch) noexcept {
+        std::lock_guard<std::mutex> guard(tasks_mutex_);
+        const auto iter = std::find(branches_.rbegin(), branches_.rend(), branch);
+        if ( iter == branches_.rend() ) {
+            return false;
+        }
+        branches_.erase(std::next(iter).base());
+        remove_branch_(*branch);
+        update_ready_priority_();
+        if ( !--active_task_count_ ) {
+            cond_var_.notify_all();
+        }
+        return true;
     }
 
-    inline void jobber::push_task_(jobber_priority priority, task_ptr task) {
-        tasks_.emplace_back(priority, std::move(task));
-        std::push_heap(tasks_.begin(), tasks_.end());
+    template < typename QueuePolicy >
+    void basic_jobber<QueuePolicy>::join_(const join_state& state) noexcept {
+        if ( state.joined() ) {
+            return;
+        }
+        // a joining worker keeps its lane and its own queues while helping
+        worker_state* worker = current_jobber_ == this && current_worker_ < workers_.size()
+            ? workers_[current_worker_].get()
+            : nullptr;
+        std::unique_lock<std::mutex> lock(tasks_mutex_);
+        while ( !state.joined() ) {
+            if ( worker ? has_worker_tasks_(*worker) : has_runnable_tasks_() ) {
+                process_task_(std::move(lock), worker);
+                lock = std::unique_lock<std::mutex>(tasks_mutex_);
+            } else {
+                cond_var_.wait(lock);
+            }
+        }
+    }
+
+    template < typename QueuePolicy >
+    void basic_jobber<QueuePolicy>::push_task_(jobber_group group, jobber_priority priority, task_ptr task) {
+        task->set_label(current_label_);
+        task->set_tag(current_tag_);
+        group_state& state = *groups_.at(group.index());
+        state.tasks.push(priority, std::move(task));
         ++active_task_count_;
-        cond_var_.notify_one();
+        ++queued_task_count_;
+        refresh_group_(state);
+        update_ready_priority_();
+        notify_one_();
+        notify_lanes_();
+    }
+
+    template < typename QueuePolicy >
+    void basic_jobber<QueuePolicy>::push_worker_task_(std::size_t worker, bool pinned, jobber_priority priority, task_ptr task) {
+        worker_state& state = *workers_.at(worker);
+        task->set_label(current_label_);
+        task->set_tag(current_tag_);
+        (pinned ? state.pinned_tasks : state.preferred_tasks).push(priority, std::move(task));
+        ++active_task_count_;
+        ++queued_task_count_;
+        pinned_task_count_ += pinned ? 1 : 0;
+        refresh_worker_(state);
+        if ( !state.busy ) {
+            // the owner shares its condition variable with the whole lane
+            lane_cond_var_(*state.lane).notify_all();
+        } else if ( !pinned ) {
+            notify_one_();
+        }
+    }
+
+    template < typename QueuePolicy >
+    typename basic_jobber<QueuePolicy>::group_state*
+    basic_jobber<QueuePolicy>::next_group_(const lane_state* lane) noexcept {
+        // the highest queued priority goes first, deficit round robin with
+        // a cost of one per task shares it between the groups holding it
+        const std::optional<jobber_priority> top = top_group_priority_(lane);
+        if ( !top ) {
+            return nullptr;
+        }
+        const auto eligible = [this, lane, &top](const group_state& group){
+            return is_runnable_(group, lane) && group.tasks.top_priority() == *top;
+        };
+        for ( std::size_t i = 0; i <= groups_.size(); ++i ) {
+            group_state& group = *groups_[current_group_];
+            if ( group.deficit && eligible(group) ) {
+                --group.deficit;
+                return &group;
+            }
+            if ( group.tasks.empty() ) {
+                group.deficit = 0;
+            }
+            current_group_ = (current_group_ + 1) % groups_.size();
+            group_state& next = *groups_[current_group_];
+            if ( eligible(next) ) {
+                next.deficit += next.weight;
+            }
+        }
+        return nullptr;
+    }
+
+    template < typename QueuePolicy >
+    std::optional<jobber_priority> basic_jobber<QueuePolicy>::top_group_priority_(const lane_state* lane) const noexcept {
+        return top_ready_(ready_groups_, lane);
+    }
+
+    template < typename QueuePolicy >
+    typename std::deque<typename basic_jobber<QueuePolicy>::branch_task*>::const_iterator
+    basic_jobber<QueuePolicy>::next_branch_(const lane_state* lane) const noexcept {
+        // the oldest of the highest priority branches the lane accepts
+        auto next = branches_.end();
+        for ( auto iter = branches_.begin(); iter != branches_.end(); ++iter ) {
+            if ( accepts_(lane, (*iter)->priority())
+                && (next == branches_.end() || (*iter)->priority() > (*next)->priority()) )
+            {
+                next = iter;
+            }
+        }
+        return next;
+    }
+
+    template < typename QueuePolicy >
+    bool basic_jobber<QueuePolicy>::is_runnable_(const group_state& group, const lane_state* lane) const noexcept {
+        return !group.tasks.empty()
+            && (!group.max_concurrency || group.running_tasks < group.max_concurrency)
+            && accepts_(lane, group.tasks.top_priority());
+    }
+
+    template < typename QueuePolicy >
+    bool basic_jobber<QueuePolicy>::has_runnable_tasks_(const lane_state* lane) const noexcept {
+        return top_ready_(ready_branches_, lane)
+            || top_ready_(ready_groups_, lane)
+            || top_ready_(stealable_tasks_, lane);
+    }
+
+    template < typename QueuePolicy >
+    bool basic_jobber<QueuePolicy>::has_worker_tasks_(const worker_state& worker) const noexcept {
+        if ( !worker.pinned_tasks.empty() ) {
+            return true;
+        }
+        return is_active_(worker)
+            && (!worker.preferred_tasks.empty() || has_runnable_tasks_(worker.lane));
+    }
+
+    template < typename QueuePolicy >
+    bool basic_jobber<QueuePolicy>::is_active_(const worker_state& worker) const noexcept {
+        return worker.lane != lanes_.front().get()
+            || worker.index < active_threads_;
     }
 
-    inline jobber::task_ptr jobber::pop_task_() noexcept {
-        if ( !tasks_.empty() ) {
-            std::pop_heap(tasks_.begin(), tasks_.end());
-            task_ptr task = std::move(tasks_.back().second);
-            tasks_.pop_back();
-            return task;
+    template < typename QueuePolicy >
+    std::optional<jobber_wait_status> basic_jobber<QueuePolicy>::active_wait_done_() const noexcept {
+        if ( cancelled_ ) {
+            return jobber_wait_status::cancelled;
+        }
+        if ( !active_task_count_ ) {
+            return jobber_wait_status::no_timeout;
+        }
+        if ( active_task_count_ == pinned_task_count_ ) {
+            return jobber_wait_status::pinned_pending;
+        }
+        return std::nullopt;
+    }
+
+    template < typename QueuePolicy >
+    typename basic_jobber<QueuePolicy>::task_queue*
+    basic_jobber<QueuePolicy>::own_queue_(worker_state& worker) const noexcept {
+        task_queue* pinned = !worker.pinned_tasks.empty()
+            ? &worker.pinned_tasks
+            : nullptr;
+        task_queue* preferred = !worker.preferred_tasks.empty() && is_active_(worker)
+            ? &worker.preferred_tasks
+            : nullptr;
+        if ( pinned && preferred ) {
+            return preferred->top_priority() > pinned->top_priority()
+                ? preferred
+                : pinned;
+        }
+        return pinned ? pinned : preferred;
+    }
+
+    template < typename QueuePolicy >
+    typename basic_jobber<QueuePolicy>::worker_state*
+    basic_jobber<QueuePolicy>::steal_victim_(const lane_state* lane) const noexcept {
+        if ( !top_ready_(stealable_tasks_, lane) ) {
+            return nullptr;
+        }
+        for ( const std::unique_ptr<worker_state>& worker : workers_ ) {
+            if ( worker->stealable_priority != -1
+                && accepts_(lane, static_cast<jobber_priority>(worker->stealable_priority)) )
+            {
+                return worker.get();
+            }
         }
         return nullptr;
     }
 
-    inline void jobber::shutdown_() noexcept {
+    template < typename QueuePolicy >
+    void basic_jobber<QueuePolicy>::refresh_group_(group_state& group) noexcept {
+        const int ready = is_runnable_(group)
+            ? static_cast<int>(group.tasks.top_priority())
+            : -1;
+        if ( ready != group.ready_priority ) {
+            if ( group.ready_priority != -1 ) {
+                --ready_groups_[static_cast<std::size_t>(group.ready_priority)];
+            }
+            if ( ready != -1 ) {
+                ++ready_groups_[static_cast<std::size_t>(ready)];
+            }
+            group.ready_priority = ready;
+        }
+    }
+
+    template < typename QueuePolicy >
+    void basic_jobber<QueuePolicy>::refresh_worker_(worker_state& worker) noexcept {
+        // preferred tasks are only taken from workers busy with something else
+        // or parked by the elastic scaling, which never run them themselves
+        const int stealable = (worker.busy || !is_active_(worker)) && !worker.preferred_tasks.empty()
+            ? static_cast<int>(worker.preferred_tasks.top_priority())
+            : -1;
+        if ( stealable != worker.stealable_priority ) {
+            if ( worker.stealable_priority != -1 ) {
+                --stealable_tasks_[static_cast<std::size_t>(worker.stealable_priority)];
+            }
+            if ( stealable != -1 ) {
+                ++stealable_tasks_[static_cast<std::size_t>(stealable)];
+            }
+            worker.stealable_priority = stealable;
+        }
+    }
+
+    template < typename QueuePolicy >
+    void basic_jobber<QueuePolicy>::add_branch_(const branch_task& branch) noexcept {
+        ++ready_branches_[static_cast<std::size_t>(branch.priority())];
+    }
+
+    template < typename QueuePolicy >
+    void basic_jobber<QueuePolicy>::remove_branch_(const branch_task& branch) noexcept {
+        --ready_branches_[static_cast<std::size_t>(branch.priority())];
+    }
+
+    template < typename QueuePolicy >
+    std::optional<jobber_priority> basic_jobber<QueuePolicy>::top_ready_(
+        const ready_counts& counts,
+        const lane_state* lane) noexcept
+    {
+        for ( std::size_t i = counts.size(); i > 0; --i ) {
+            const auto priority = static_cast<jobber_priority>(i - 1);
+            if ( counts[i - 1] && accepts_(lane, priority) ) {
+                return priority;
+            }
+        }
+        return std::nullopt;
+    }
+
+    template < typename QueuePolicy >
+    void basic_jobber<QueuePolicy>::update_ready_priority_() noexcept {
+        const std::optional<jobber_priority> branch = top_ready_(ready_branches_, nullptr);
+        const std::optional<jobber_priority> group = top_ready_(ready_groups_, nullptr);
+        const int ready = std::max(
+            branch ? static_cast<int>(*branch) : -1,
+            group ? static_cast<int>(*group) : -1);
+        ready_priority_.store(ready, std::memory_order_relaxed);
+    }
+
+    template < typename QueuePolicy >
+    void basic_jobber<QueuePolicy>::notify_one_() noexcept {
+        // parked elastic workers would swallow a single notification
+        if ( active_threads_ < lanes_.front()->threads ) {
+            cond_var_.notify_all();
+        } else {
+            cond_var_.notify_one();
+        }
+    }
+
+    template < typename QueuePolicy >
+    void basic_jobber<QueuePolicy>::notify_lanes_() noexcept {
+        // callers wake the first lane through cond_var_ themselves
+        for ( std::size_t i = 1; i < lanes_.size(); ++i ) {
+            if ( has_runnable_tasks_(lanes_[i].get()) ) {
+                lanes_[i]->cond_var.notify_one();
+            }
+        }
+    }
+
+    template < typename QueuePolicy >
+    void basic_jobber<QueuePolicy>::notify_all_() noexcept {
+        cond_var_.notify_all();
+        monitor_cond_var_.notify_all();
+        for ( std::size_t i = 1; i < lanes_.size(); ++i ) {
+            lanes_[i]->cond_var.notify_all();
+        }
+    }
+
+    template < typename QueuePolicy >
+    bool basic_jobber<QueuePolicy>::should_run_inline_(const group_state& group) const noexcept {
+        if ( !caller_runs_depth_ && caller_runs_wait_ <= std::chrono::nanoseconds::zero() ) {
+            return false;
+        }
+        if ( running_inline_ || paused_ || cancelled_ ) {
+            return false;
+        }
+        // workers pick up their own submissions anyway and the caps of
+        // a group hold for the callers too
+        if ( current_jobber_ == this
+            || (group.max_concurrency && group.running_tasks >= group.max_concurrency) )
+        {
+            return false;
+        }
+        const std::size_t pending = active_task_count_.load();
+        if ( caller_runs_depth_ && pending >= caller_runs_depth_ ) {
+            return true;
+        }
+        // every worker is expected to take its share of the pending tasks
+        const std::chrono::nanoseconds::rep estimated_wait =
+            average_task_time_.load(std::memory_order_relaxed)
+            * static_cast<std::chrono::nanoseconds::rep>(pending)
+            / static_cast<std::chrono::nanoseconds::rep>(std::max(threads_.size(), std::size_t(1)));
+        return caller_runs_wait_ > std::chrono::nanoseconds::zero()
+            && std::chrono::nanoseconds(estimated_wait) >= caller_runs_wait_;
+    }
+
+    template < typename QueuePolicy >
+    void basic_jobber<QueuePolicy>::shutdown_() noexcept {
         {
             std::lock_guard<std::mutex> guard(tasks_mutex_);
-            while ( !tasks_.empty() ) {
-                task_ptr task = pop_task_();
-                if ( task ) {
-                    task->cancel();
-                    --active_task_count_;
+            const std::exception_ptr e = std::make_exception_ptr(
+                jobber_cancelled_exception());
+            while ( !branches_.empty() ) {
+                branches_.front()->cancel(e);
+                remove_branch_(*branches_.front());
+                branches_.pop_front();
+                --active_task_count_;
+            }
+            const auto cancel_tasks = [this, &e](task_queue& tasks){
+                while ( !tasks.empty() ) {
+                    task_ptr task = tasks.pop();
+                    if ( task ) {
+                        task->cancel(e);
+                        --active_task_count_;
+                    }
                 }
+            };
+            for ( const std::unique_ptr<group_state>& group : groups_ ) {
+                cancel_tasks(group->tasks);
+                refresh_group_(*group);
             }
+            for ( const std::unique_ptr<worker_state>& worker : workers_ ) {
+                cancel_tasks(worker->pinned_tasks);
+                cancel_tasks(worker->preferred_tasks);
+                refresh_worker_(*worker);
+            }
+            pinned_task_count_ = 0;
+            update_ready_priority_();
             cancelled_.store(true);
-            cond_var_.notify_all();
+            notify_all_();
         }
         for ( std::thread& thread : threads_ ) {
             if ( thread.joinable() ) {
                 thread.join();
             }
         }
+        if ( elastic_thread_.joinable() ) {
+            elastic_thread_.join();
+        }
+        if ( watchdog_thread_.joinable() ) {
+            watchdog_thread_.join();
+        }
+        for ( const std::unique_ptr<replacement_state>& replacement : replacements_ ) {
+            if ( replacement->thread.joinable() ) {
+                replacement->thread.join();
+            }
+        }
+    }
+
+    template < typename QueuePolicy >
+    std::condition_variable& basic_jobber<QueuePolicy>::lane_cond_var_(lane_state& lane) noexcept {
+        // the first lane shares cond_var_ with the waiting threads
+        return &lane == lanes_.front().get()
+            ? cond_var_
+            : lane.cond_var;
     }
 
-    inline void jobber::worker_main_() noexcept {
+    template < typename QueuePolicy >
+    void basic_jobber<QueuePolicy>::worker_main_(std::size_t index) noexcept {
+        current_jobber_ = this;
+        current_jobber_id_ = id_;
+        current_worker_ = index;
+        worker_state& worker = *workers_[index];
+        apply_thread_priority_(worker.lane->thread_priority);
+        std::condition_variable& cond_var = lane_cond_var_(*worker.lane);
         while ( true ) {
             std::unique_lock<std::mutex> lock(tasks_mutex_);
-            cond_var_.wait(lock, [this](){
-                return cancelled_ || (!paused_ && !tasks_.empty());
+            cond_var.wait(lock, [this, &worker](){
+                return cancelled_ || (!paused_ && has_worker_tasks_(worker));
             });
             if ( cancelled_ ) {
                 break;
             }
-            process_task_(std::move(lock));
+            process_task_(std::move(lock), &worker);
+        }
+    }
+
+    template < typename QueuePolicy >
+    void basic_jobber<QueuePolicy>::elastic_main_(std::size_t threads, const jobber_options& options) noexcept {
+        std::unique_lock<std::mutex> lock(tasks_mutex_);
+        while ( !monitor_cond_var_.wait_for(lock, options.elastic_interval, [this](){
+            return cancelled_.load();
+        }) ) {
+            lock.unlock();
+            std::size_t active = threads;
+            try {
+                active = std::min(threads, available_concurrency(options.cpu_sources));
+            } catch (...) {
+            }
+            lock.lock();
+            if ( active_threads_ != active ) {
+                active_threads_ = active;
+                for ( const std::unique_ptr<worker_state>& worker : workers_ ) {
+                    refresh_worker_(*worker);
+                }
+                notify_all_();
+            }
+        }
+    }
+
+    template < typename QueuePolicy >
+    void basic_jobber<QueuePolicy>::watchdog_main_(const jobber_options& options) noexcept {
+        std::unique_lock<std::mutex> lock(tasks_mutex_);
+        while ( !monitor_cond_var_.wait_for(lock, options.watchdog_interval, [this](){
+            return cancelled_.load();
+        }) ) {
+            while ( !replacements_.empty() && replacements_.front()->done ) {
+                replacements_.front()->thread.join();
+                replacements_.pop_front();
+            }
+
+            std::vector<jobber_hung_task> hung_tasks;
+            const auto now = std::chrono::steady_clock::now();
+            for ( const std::unique_ptr<worker_state>& worker : workers_ ) {
+                const auto running_time = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    now - worker->task_start);
+                if ( !worker->busy || worker->hung || running_time < options.watchdog_threshold ) {
+                    continue;
+                }
+                // a replacement still finishing its last task keeps the local
+                // slots of the worker, the next round starts the new one
+                const bool replacing = std::any_of(
+                    replacements_.begin(), replacements_.end(),
+                    [&worker](const std::unique_ptr<replacement_state>& replacement){
+                        return replacement->worker == worker->index && !replacement->done;
+                    });
+                if ( replacing ) {
+                    continue;
+                }
+                worker->hung = true;
+                ++hung_workers_;
+                try {
+                    hung_tasks.push_back({worker->index, worker->label, running_time});
+                    if ( options.watchdog_replace ) {
+                        auto replacement = std::make_unique<replacement_state>();
+                        replacement->worker = worker->index;
+                        replacement->thread = std::thread(
+                            &basic_jobber::replacement_main_, this,
+                            std::ref(*worker), std::ref(*replacement));
+                        replacements_.push_back(std::move(replacement));
+                    }
+                } catch (...) {
+                }
+            }
+
+            if ( !hung_tasks.empty() && options.watchdog_callback ) {
+                lock.unlock();
+                for ( const jobber_hung_task& hung_task : hung_tasks ) {
+                    try {
+                        options.watchdog_callback(hung_task);
+                    } catch (...) {
+                    }
+                }
+                lock.lock();
+            }
+        }
+    }
+
+    template < typename QueuePolicy >
+    void basic_jobber<QueuePolicy>::replacement_main_(worker_state& hung, replacement_state& self) noexcept {
+        // replacements help like active_wait_* callers until the hung worker
+        // is back, with the local slots reserved for the hung worker
+        current_jobber_ = this;
+        current_jobber_id_ = id_;
+        current_worker_ = threads_.size() + hung.index;
+        {
+            std::unique_lock<std::mutex> lock(tasks_mutex_);
+            while ( true ) {
+                cond_var_.wait(lock, [this, &hung](){
+                    return cancelled_ || !hung.hung || (!paused_ && has_runnable_tasks_());
+                });
+                if ( cancelled_ || !hung.hung ) {
+                    break;
+                }
+                process_task_(std::move(lock));
+                lock = std::unique_lock<std::mutex>(tasks_mutex_);
+            }
+        }
+        self.done.store(true);
+    }
+
+    template < typename QueuePolicy >
+    void basic_jobber<QueuePolicy>::begin_task_(
+        worker_state* worker,
+        const char* label,
+        cpu_frame& frame,
+        std::uint32_t tag) noexcept
+    {
+        // nested tasks pause the accounting of the task of this jobber they
+        // run inside of, the tasks of other jobbers keep theirs running
+        const std::chrono::nanoseconds now = task_time_();
+        if ( cpu_frame* outer = outer_frame_(current_cpu_frame_) ) {
+            outer->spent += now - outer->mark;
+            charge_cpu_time_(outer->tag, now - outer->mark);
+        }
+        frame = cpu_frame{this, current_cpu_frame_, tag, now, std::chrono::nanoseconds(0)};
+        current_cpu_frame_ = &frame;
+        if ( worker ) {
+            worker->busy = true;
+            worker->label = label;
+            worker->task_start = std::chrono::steady_clock::now();
+            refresh_worker_(*worker);
+        }
+    }
+
+    template < typename QueuePolicy >
+    void basic_jobber<QueuePolicy>::end_task_(worker_state* worker, cpu_frame& frame) noexcept {
+        assert(current_cpu_frame_ == &frame);
+        const std::chrono::nanoseconds now = task_time_();
+        frame.spent += now - frame.mark;
+        charge_cpu_time_(frame.tag, now - frame.mark);
+        current_cpu_frame_ = frame.parent;
+        cpu_frame* outer = outer_frame_(frame.parent);
+        if ( outer ) {
+            outer->mark = now;
+        }
+        if ( worker && outer ) {
+            // back to the task the nested one was helping from
+            worker->label = current_label_;
+            worker->task_start = current_task_start_;
+        } else if ( worker ) {
+            worker->busy = false;
+            worker->label = nullptr;
+            refresh_worker_(*worker);
+            if ( worker->hung ) {
+                worker->hung = false;
+                --hung_workers_;
+            }
+        }
+    }
+
+    template < typename QueuePolicy >
+    typename basic_jobber<QueuePolicy>::cpu_frame*
+    basic_jobber<QueuePolicy>::outer_frame_(cpu_frame* frame) const noexcept {
+        while ( frame && frame->owner != this ) {
+            frame = frame->parent;
+        }
+        return frame;
+    }
+
+    template < typename QueuePolicy >
+    void basic_jobber<QueuePolicy>::charge_cpu_time_(std::uint32_t tag, std::chrono::nanoseconds time) noexcept {
+        if ( !cpu_accounting_ ) {
+            return;
+        }
+        jobber_cpu_times& cpu_times = current_jobber_ == this && current_worker_ < workers_.size()
+            ? workers_[current_worker_]->cpu_times
+            : helper_cpu_times_;
+        try {
+            cpu_times[tag] += time;
+        } catch (...) {
+        }
+    }
+
+    template < typename QueuePolicy >
+    std::chrono::nanoseconds basic_jobber<QueuePolicy>::task_time_() const noexcept {
+        // the thread CPU clock is a syscall, the steady one is not
+        return cpu_accounting_
+            ? thread_cpu_time_()
+            : std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now().time_since_epoch());
+    }
+
+    template < typename QueuePolicy >
+    std::chrono::nanoseconds basic_jobber<QueuePolicy>::thread_cpu_time_() noexcept {
+    #if defined(__linux__) || defined(__APPLE__)
+        timespec ts{};
+        if ( !::clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) ) {
+            return std::chrono::seconds(ts.tv_sec) + std::chrono::nanoseconds(ts.tv_nsec);
         }
+    #endif
+        // falls back to the wall time where the thread CPU clock is missing
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch());
     }
 
-    inline void jobber::process_task_(std::unique_lock<std::mutex> lock) noexcept {
+    template < typename QueuePolicy >
+    void basic_jobber<QueuePolicy>::process_task_(std::unique_lock<std::mutex> lock, worker_state* worker) noexcept {
         assert(lock.owns_lock());
-        task_ptr task = pop_task_();
+        task_queue* own_tasks = worker ? own_queue_(*worker) : nullptr;
+        if ( own_tasks && static_cast<int>(own_tasks->top_priority()) >= ready_priority_.load() ) {
+            process_queued_task_(std::move(lock), worker, *worker, *own_tasks);
+            return;
+        }
+        if ( worker && !is_active_(*worker) ) {
+            if ( own_tasks ) {
+                process_queued_task_(std::move(lock), worker, *worker, *own_tasks);
+            }
+            return;
+        }
+        const lane_state* lane = worker ? worker->lane : nullptr;
+        // branches block their joins, so they win ties with the groups
+        const auto next_branch = next_branch_(lane);
+        const std::optional<jobber_priority> group_priority = top_group_priority_(lane);
+        if ( next_branch != branches_.end()
+            && (!group_priority || (*next_branch)->priority() >= *group_priority) )
+        {
+            branch_task* branch = *next_branch;
+            branches_.erase(next_branch);
+            remove_branch_(*branch);
+            update_ready_priority_();
+            cpu_frame frame;
+            begin_task_(worker, nullptr, frame, branch->tag());
+            lock.unlock();
+            const jobber_priority prev_priority = std::exchange(
+                current_priority_, branch->priority());
+            const char* const prev_label = std::exchange(
+                current_label_, nullptr);
+            const std::uint32_t prev_tag = std::exchange(
+                current_tag_, branch->tag());
+            const auto prev_task_start = std::exchange(
+                current_task_start_, std::chrono::steady_clock::now());
+            branch->run();
+            current_task_start_ = prev_task_start;
+            current_tag_ = prev_tag;
+            current_label_ = prev_label;
+            current_priority_ = prev_priority;
+            lock.lock();
+            end_task_(worker, frame);
+            --active_task_count_;
+            cond_var_.notify_all();
+            notify_lanes_();
+            return;
+        }
+        group_state* group = next_group_(lane);
+        if ( !group ) {
+            if ( own_tasks ) {
+                process_queued_task_(std::move(lock), worker, *worker, *own_tasks);
+            } else if ( worker_state* victim = steal_victim_(lane) ) {
+                process_queued_task_(std::move(lock), worker, *victim, victim->preferred_tasks);
+            }
+            return;
+        }
+        const jobber_priority priority = group->tasks.top_priority();
+        task_ptr task = group->tasks.pop();
+        refresh_group_(*group);
         if ( task ) {
+            run_group_task_(std::move(lock), worker, *group, priority, std::move(task));
+        } else {
+            update_ready_priority_();
+        }
+    }
+
+    template < typename QueuePolicy >
+    void basic_jobber<QueuePolicy>::run_group_task_(
+        std::unique_lock<std::mutex> lock,
+        worker_state* worker,
+        group_state& group,
+        jobber_priority priority,
+        task_ptr task) noexcept
+    {
+        assert(lock.owns_lock() && task);
+        ++group.running_tasks;
+        refresh_group_(group);
+        update_ready_priority_();
+        cpu_frame frame;
+        begin_task_(worker, task->label(), frame, task->tag());
+        lock.unlock();
+        const jobber_priority prev_priority = std::exchange(
+            current_priority_, priority);
+        const char* const prev_label = std::exchange(
+            current_label_, task->label());
+        const std::uint32_t prev_tag = std::exchange(
+            current_tag_, task->tag());
+        const auto run_begin = std::chrono::steady_clock::now();
+        const auto prev_task_start = std::exchange(
+            current_task_start_, run_begin);
+        task->run();
+        const auto run_end = std::chrono::steady_clock::now();
+        current_task_start_ = prev_task_start;
+        current_tag_ = prev_tag;
+        current_label_ = prev_label;
+        current_priority_ = prev_priority;
+        lock.lock();
+        end_task_(worker, frame);
+        --group.running_tasks;
+        // the frame leaves out the tasks run while this one was helping
+        group.busy_time += frame.spent;
+        const std::chrono::nanoseconds::rep average = average_task_time_.load(std::memory_order_relaxed);
+        average_task_time_.store(average + (std::chrono::duration_cast<std::chrono::nanoseconds>(
+            run_end - run_begin).count() - average) / 8, std::memory_order_relaxed);
+        if ( task->yielded() && cancelled_ ) {
+            task->cancel(std::make_exception_ptr(jobber_cancelled_exception()));
+            --active_task_count_;
+        } else if ( task->yielded() ) {
+            group.tasks.push(priority, std::move(task));
+        } else {
+            ++group.processed_tasks;
+            --active_task_count_;
+        }
+        refresh_group_(group);
+        update_ready_priority_();
+        cond_var_.notify_all();
+        notify_lanes_();
+    }
+
+    template < typename QueuePolicy >
+    void basic_jobber<QueuePolicy>::process_queued_task_(
+        std::unique_lock<std::mutex> lock,
+        worker_state* worker,
+        worker_state& owner,
+        task_queue& tasks) noexcept
+    {
+        assert(lock.owns_lock() && !tasks.empty());
+        const bool pinned = &tasks == &owner.pinned_tasks;
+        const jobber_priority priority = tasks.top_priority();
+        task_ptr task = tasks.pop();
+        pinned_task_count_ -= pinned ? 1 : 0;
+        refresh_worker_(owner);
+        if ( task ) {
+            cpu_frame frame;
+            begin_task_(worker, task->label(), frame, task->tag());
             lock.unlock();
+            const jobber_priority prev_priority = std::exchange(
+                current_priority_, priority);
+            const char* const prev_label = std::exchange(
+                current_label_, task->label());
+            const std::uint32_t prev_tag = std::exchange(
+                current_tag_, task->tag());
+            const auto prev_task_start = std::exchange(
+                current_task_start_, std::chrono::steady_clock::now());
             task->run();
+            current_task_start_ = prev_task_start;
+            current_tag_ = prev_tag;
+            current_label_ = prev_label;
+            current_priority_ = prev_priority;
             lock.lock();
-            --active_task_count_;
+            end_task_(worker, frame);
+            if ( task->yielded() && cancelled_ ) {
+                task->cancel(std::make_exception_ptr(jobber_cancelled_exception()));
+                --active_task_count_;
+            } else if ( task->yielded() ) {
+                tasks.push(priority, std::move(task));
+                pinned_task_count_ += pinned ? 1 : 0;
+                refresh_worker_(owner);
+            } else {
+                --active_task_count_;
+            }
             cond_var_.notify_all();
+            notify_lanes_();
         }
     }
+
+    template < typename QueuePolicy >
+    bool basic_jobber<QueuePolicy>::accepts_(const lane_state* lane, jobber_priority priority) noexcept {
+        return !lane
+            || (priority >= lane->min_priority && priority <= lane->max_priority);
+    }
+
+    template < typename QueuePolicy >
+    void basic_jobber<QueuePolicy>::apply_thread_priority_(jobber_thread_priority priority) noexcept {
+        // best effort, unprivileged processes keep the default priority
+    #if defined(__linux__)
+        const auto tid = static_cast<id_t>(::syscall(SYS_gettid));
+        switch ( priority ) {
+        case jobber_thread_priority::normal:
+            break;
+        case jobber_thread_priority::realtime: {
+            sched_param param{};
+            param.sched_priority = ::sched_get_priority_min(SCHED_FIFO);
+            if ( !::pthread_setschedparam(::pthread_self(), SCHED_FIFO, &param) ) {
+                break;
+            }
+            [[fallthrough]];
+        }
+        case jobber_thread_priority::raised:
+            (void)::setpriority(PRIO_PROCESS, tid, -10);
+            break;
+        case jobber_thread_priority::idle: {
+        #if defined(SCHED_IDLE)
+            sched_param param{};
+            if ( !::pthread_setschedparam(::pthread_self(), SCHED_IDLE, &param) ) {
+                break;
+            }
+        #endif
+            (void)::setpriority(PRIO_PROCESS, tid, 19);
+            break;
+        }
+        }
+    #else
+        (void)priority;
+    #endif
+    }
 }
 
 namespace jobber_hpp
 {
     //
-    // concrete_task<R, F, Args...>
+    // local<T>
     //
 
-    template < typename R, typename F, typename... Args >
-    template < typename U >
-    jobber::concrete_task<R, F, Args...>::concrete_task(U&& u, std::tuple<Args...>&& args)
-    : f_(std::forward<U>(u))
-    , args_(std::move(args)) {}
+    template < typename QueuePolicy >
+    template < typename T >
+    basic_jobber<QueuePolicy>::local<T>::local(std::shared_ptr<slots_t> slots) noexcept
+    : slots_(std::move(slots)) {}
 
-    template < typename R, typename F, typename... Args >
-    void jobber::concrete_task<R, F, Args...>::run() noexcept {
-        try {
-            R value = std::apply(std::move(f_), std::move(args_));
-            promise_.resolve(std::move(value));
-        } catch (...) {
-            promise_.reject(std::current_exception());
+    template < typename QueuePolicy >
+    template < typename T >
+    T& basic_jobber<QueuePolicy>::local<T>::get() const {
+        assert(slots_);
+        if ( current_jobber_id_ == slots_->owner && current_worker_ < slots_->fixed.size() ) {
+            return *slots_->fixed[current_worker_];
         }
+        std::lock_guard<std::mutex> guard(slots_->helpers_mutex);
+        const std::thread::id id = std::this_thread::get_id();
+        for ( const auto& [helper, value] : slots_->helpers ) {
+            if ( helper == id ) {
+                return *value;
+            }
+        }
+        return *slots_->helpers.emplace_back(id, slots_->make()).second;
     }
 
-    template < typename R, typename F, typename... Args >
-    void jobber::concrete_task<R, F, Args...>::cancel() noexcept {
-        promise_.reject(jobber_cancelled_exception());
+    template < typename QueuePolicy >
+    template < typename T >
+    T& basic_jobber<QueuePolicy>::local<T>::operator[](std::size_t slot) const {
+        assert(slots_ && slot < size());
+        if ( slot < slots_->fixed.size() ) {
+            return *slots_->fixed[slot];
+        }
+        std::lock_guard<std::mutex> guard(slots_->helpers_mutex);
+        return *slots_->helpers[slot - slots_->fixed.size()].second;
     }
 
-    template < typename R, typename F, typename... Args >
-    promise<R> jobber::concrete_task<R, F, Args...>::future() noexcept {
-        return promise_;
+    template < typename QueuePolicy >
+    template < typename T >
+    std::size_t basic_jobber<QueuePolicy>::local<T>::size() const {
+        if ( !slots_ ) {
+            return 0u;
+        }
+        std::lock_guard<std::mutex> guard(slots_->helpers_mutex);
+        return slots_->fixed.size() + slots_->helpers.size();
+    }
+
+    template < typename QueuePolicy >
+    template < typename T >
+    template < typename F >
+    void basic_jobber<QueuePolicy>::local<T>::for_each(F&& f) const {
+        if ( slots_ ) {
+            for ( const std::unique_ptr<T>& value : slots_->fixed ) {
+                std::invoke(f, *value);
+            }
+            std::lock_guard<std::mutex> guard(slots_->helpers_mutex);
+            for ( const auto& helper : slots_->helpers ) {
+                std::invoke(f, *helper.second);
+            }
+        }
     }
 
     //
-    // concrete_task<void, F, Args...>
+    // resumable_task<R, F>
     //
 
-    template < typename F, typename... Args >
+    template < typename QueuePolicy >
+    template < typename R, typename F >
     template < typename U >
-    jobber::concrete_task<void, F, Args...>::concrete_task(U&& u, std::tuple<Args...>&& args)
-    : f_(std::forward<U>(u))
-    , args_(std::move(args)) {}
+    basic_jobber<QueuePolicy>::resumable_task<R, F>::resumable_task(const basic_jobber& owner, U&& u)
+    : owner_(owner)
+    , f_(std::forward<U>(u)) {}
 
-    template < typename F, typename... Args >
-    void jobber::concrete_task<void, F, Args...>::run() noexcept {
+    template < typename QueuePolicy >
+    template < typename R, typename F >
+    void basic_jobber<QueuePolicy>::resumable_task<R, F>::run() noexcept {
+        yielded_ = false;
         try {
-            std::apply(std::move(f_), std::move(args_));
-            promise_.resolve();
+            do {
+                if constexpr ( std::is_void_v<R> ) {
+                    if ( std::invoke(f_) ) {
+                        promise_.resolve();
+                        return;
+                    }
+                } else {
+                    std::optional<R> value = std::invoke(f_);
+                    if ( value ) {
+                        promise_.resolve(std::move(*value));
+                        return;
+                    }
+                }
+            } while ( !owner_.should_yield() );
+            yielded_ = true;
         } catch (...) {
             promise_.reject(std::current_exception());
         }
     }
 
-    template < typename F, typename... Args >
-    void jobber::concrete_task<void, F, Args...>::cancel() noexcept {
-        promise_.reject(jobber_cancelled_exception());
+    template < typename QueuePolicy >
+    template < typename R, typename F >
+    void basic_jobber<QueuePolicy>::resumable_task<R, F>::cancel(std::exception_ptr e) noexcept {
+        promise_.reject(e);
+    }
+
+    template < typename QueuePolicy >
+    template < typename R, typename F >
+    bool basic_jobber<QueuePolicy>::resumable_task<R, F>::yielded() const noexcept {
+        return yielded_;
     }
 
-    template < typename F, typename... Args >
-    promise<void> jobber::concrete_task<void, F, Args...>::future() noexcept {
+    template < typename QueuePolicy >
+    template < typename R, typename F >
+    promise<R> basic_jobber<QueuePolicy>::resumable_task<R, F>::future() noexcept {
         return promise_;
     }
+
+    //
+    // join_state
+    //
+
+    template < typename QueuePolicy >
+    basic_jobber<QueuePolicy>::join_state::join_state(std::size_t branches) noexcept
+    : pending_(branches) {}
+
+    template < typename QueuePolicy >
+    void basic_jobber<QueuePolicy>::join_state::fail(std::exception_ptr e) noexcept {
+        bool expected = false;
+        if ( failed_.compare_exchange_strong(expected, true) ) {
+            exception_ = e;
+        }
+    }
+
+    template < typename QueuePolicy >
+    void basic_jobber<QueuePolicy>::join_state::finish() noexcept {
+        --pending_;
+    }
+
+    template < typename QueuePolicy >
+    bool basic_jobber<QueuePolicy>::join_state::joined() const noexcept {
+        return !pending_;
+    }
+
+    template < typename QueuePolicy >
+    std::exception_ptr basic_jobber<QueuePolicy>::join_state::exception() const noexcept {
+        assert(joined());
+        return exception_;
+    }
+
+    //
+    // branch_task
+    //
+
+    template < typename QueuePolicy >
+    void basic_jobber<QueuePolicy>::branch_task::bind(
+        join_state& state,
+        jobber_priority priority,
+        std::uint32_t tag,
+        void (*invoker)(void*),
+        void* f) noexcept
+    {
+        state_ = &state;
+        priority_ = priority;
+        tag_ = tag;
+        invoker_ = invoker;
+        f_ = f;
+    }
+
+    template < typename QueuePolicy >
+    jobber_priority basic_jobber<QueuePolicy>::branch_task::priority() const noexcept {
+        return priority_;
+    }
+
+    template < typename QueuePolicy >
+    std::uint32_t basic_jobber<QueuePolicy>::branch_task::tag() const noexcept {
+        return tag_;
+    }
+
+    template < typename QueuePolicy >
+    void basic_jobber<QueuePolicy>::branch_task::run() noexcept {
+        try {
+            invoker_(f_);
+        } catch (...) {
+            state_->fail(std::current_exception());
+        }
+        state_->finish();
+    }
+
+    template < typename QueuePolicy >
+    void basic_jobber<QueuePolicy>::branch_task::cancel(std::exception_ptr e) noexcept {
+        state_->fail(e);
+        state_->finish();
+    }
 }
@@ -0,0 +1,519 @@
+/*******************************************************************************
+ * This file is part of the "https://github.com/blackmatov/promise.hpp"
+ * For conditions of distribution and use, see copyright notice in LICENSE.md
+ * Copyright (C) 2018-2023, by Matvey Cherevko (blackmatov@gmail.com)
+ ******************************************************************************/
+
+#pragma once
+
+#include "../promise.hpp"
+#include "task_queue.hpp"
+#include "scheduler.hpp"
+
+#include <deque>
+#include <optional>
+#include <algorithm>
+
+#if defined(__linux__)
+#  include <pthread.h>
+#  include <sched.h>
+#endif
+
+namespace runtime_hpp
+{
+    using namespace promise_hpp;
+
+    class runtime_cancelled_exception final : public std::runtime_error {
+    public:
+        runtime_cancelled_exception()
+        : std::runtime_error("runtime has stopped working") {}
+    };
+
+    struct runtime_options {
+        std::size_t ring_capacity{1024};
+        bool pin_threads{true};
+    };
+
+    template < typename QueuePolicy = task_queue_hpp::priority_heap_policy >
+    class basic_runtime final : private detail::noncopyable {
+    public:
+        using scheduler_type = scheduler_hpp::basic_scheduler<QueuePolicy>;
+
+        static constexpr std::size_t npos = static_cast<std::size_t>(-1);
+
+        explicit basic_runtime(std::size_t cores);
+        basic_runtime(std::size_t cores, const runtime_options& options);
+        ~basic_runtime() noexcept;
+
+        std::size_t core_count() const noexcept;
+
+        // The index of the calling core, or `npos` for outside threads.
+        std::size_t current_core() const noexcept;
+
+        // The scheduler driven by the loop of the core. It may be used
+        // only from that core, other threads go through `submit_to`.
+        scheduler_type& scheduler(std::size_t core) noexcept;
+
+        template < typename F, typename... Args >
+        using submit_invoke_result_t = std::invoke_result_t<
+            std::decay_t<F>,
+            std::decay_t<Args>...>;
+
+        // Runs the function on the core. Called from another core, the task
+        // and its result travel over the rings between the two cores and
+        // the promise is resolved back on the caller's core. Outside threads
+        // get a promise resolved on the target core.
+        template < typename F, typename... Args
+                 , typename R = submit_invoke_result_t<F, Args...> >
+        promise<R> submit_to(std::size_t core, F&& f, Args&&... args);
+    private:
+        using task_ptr = task_queue_hpp::task_ptr;
+
+        template < typename R >
+        class reply_task final : public task_queue_hpp::task {
+        public:
+            reply_task(promise<R> future, std::exception_ptr e);
+            template < typename U >
+            reply_task(promise<R> future, U&& value);
+            void run() noexcept final;
+            void cancel(std::exception_ptr e) noexcept final;
+        private:
+            using value_type = std::conditional_t<std::is_void_v<R>, bool, R>;
+            promise<R> future_;
+            std::optional<value_type> value_;
+            std::exception_ptr exception_;
+        };
+
+        template < typename R, typename F, typename... Args >
+        class submit_task final : public task_queue_hpp::task {
+        public:
+            template < typename U >
+            submit_task(basic_runtime& owner, std::size_t home, U&& u, std::tuple<Args...>&& args);
+            void run() noexcept final;
+            void cancel(std::exception_ptr e) noexcept final;
+            promise<R> future() noexcept;
+        private:
+            basic_runtime& runtime_;
+            std::size_t home_;
+            F f_;
+            std::tuple<Args...> args_;
+            promise<R> future_;
+        };
+
+        // `rings[from]` carries tasks from other cores and `backlogs[to]`
+        // keeps what did not fit into a full ring, in order.
+        struct core_state {
+            std::size_t index{0};
+            scheduler_type scheduler;
+            std::vector<std::unique_ptr<task_queue_hpp::task_ring>> rings;
+            std::vector<std::deque<task_ptr>> backlogs;
+            std::size_t backlog_count{0};
+            task_queue_hpp::task_inbox inbox;
+            std::atomic<bool> parked{false};
+            std::atomic<bool> awaits_drain{false};
+            std::mutex park_mutex;
+            std::condition_variable park_cond_var;
+        };
+
+        void core_main_(std::size_t core, bool pin) noexcept;
+        std::size_t poll_(core_state& core) noexcept;
+        void park_(core_state& core);
+        void wake_(core_state& core) noexcept;
+        bool has_incoming_(core_state& core) const noexcept;
+        void send_(std::size_t from, std::size_t to, task_ptr task);
+        std::size_t flush_backlogs_(core_state& core) noexcept;
+        void shutdown_() noexcept;
+        static void pin_thread_(std::size_t core) noexcept;
+    private:
+        static constexpr std::chrono::milliseconds backlog_retry_interval_{1};
+        std::vector<std::unique_ptr<core_state>> cores_;
+        std::vector<std::thread> threads_;
+        std::atomic<bool> stopping_{false};
+        inline static thread_local const basic_runtime* current_runtime_{nullptr};
+        inline static thread_local std::size_t current_core_{npos};
+    };
+
+    using runtime = basic_runtime<>;
+}
+
+namespace runtime_hpp
+{
+    //
+    // reply_task
+    //
+
+    template < typename QueuePolicy >
+    template < typename R >
+    basic_runtime<QueuePolicy>::reply_task<R>::reply_task(promise<R> future, std::exception_ptr e)
+    : future_(std::move(future))
+    , exception_(std::move(e)) {}
+
+    template < typename QueuePolicy >
+    template < typename R >
+    template < typename U >
+    basic_runtime<QueuePolicy>::reply_task<R>::reply_task(promise<R> future, U&& value)
+    : future_(std::move(future))
+    , value_(std::forward<U>(value)) {}
+
+    template < typename QueuePolicy >
+    template < typename R >
+    void basic_runtime<QueuePolicy>::reply_task<R>::run() noexcept {
+        if ( exception_ ) {
+            future_.reject(exception_);
+        } else if constexpr ( std::is_void_v<R> ) {
+            future_.resolve();
+        } else {
+            future_.resolve(std::move(*value_));
+        }
+    }
+
+    template < typename QueuePolicy >
+    template < typename R >
+    void basic_runtime<QueuePolicy>::reply_task<R>::cancel(std::exception_ptr e) noexcept {
+        // the work is done already, only its delivery was cut short
+        if ( value_ || exception_ ) {
+            run();
+        } else {
+            future_.reject(e);
+        }
+    }
+
+    //
+    // submit_task
+    //
+
+    template < typename QueuePolicy >
+    template < typename R, typename F, typename... Args >
+    template < typename U >
+    basic_runtime<QueuePolicy>::submit_task<R, F, Args...>::submit_task(
+        basic_runtime& owner,
+        std::size_t home,
+        U&& u,
+        std::tuple<Args...>&& args)
+    : runtime_(owner)
+    , home_(home)
+    , f_(std::forward<U>(u))
+    , args_(std::move(args)) {}
+
+    template < typename QueuePolicy >
+    template < typename R, typename F, typename... Args >
+    void basic_runtime<QueuePolicy>::submit_task<R, F, Args...>::run() noexcept {
+        task_ptr reply;
+        try {
+            try {
+                if constexpr ( std::is_void_v<R> ) {
+                    std::apply(std::move(f_), std::move(args_));
+                    reply = std::make_unique<reply_task<R>>(future_, true);
+                } else {
+                    reply = std::make_unique<reply_task<R>>(future_,
+                        std::apply(std::move(f_), std::move(args_)));
+                }
+            } catch (...) {
+                reply = std::make_unique<reply_task<R>>(future_, std::current_exception());
+            }
+            runtime_.send_(current_core_, home_, std::move(reply));
+        } catch (...) {
+            // out of memory, settle here rather than lose the promise
+            if ( reply ) {
+                reply->run();
+            } else {
+                future_.reject(std::current_exception());
+            }
+        }
+    }
+
+    template < typename QueuePolicy >
+    template < typename R, typename F, typename... Args >
+    void basic_runtime<QueuePolicy>::submit_task<R, F, Args...>::cancel(std::exception_ptr e) noexcept {
+        future_.reject(e);
+    }
+
+    template < typename QueuePolicy >
+    template < typename R, typename F, typename... Args >
+    promise<R> basic_runtime<QueuePolicy>::submit_task<R, F, Args...>::future() noexcept {
+        return future_;
+    }
+
+    //
+    // basic_runtime
+    //
+
+    template < typename QueuePolicy >
+    basic_runtime<QueuePolicy>::basic_runtime(std::size_t cores)
+    : basic_runtime(cores, runtime_options()) {}
+
+    template < typename QueuePolicy >
+    basic_runtime<QueuePolicy>::basic_runtime(std::size_t cores, const runtime_options& options) {
+        cores = std::max(cores, std::size_t(1));
+        cores_.reserve(cores);
+        for ( std::size_t i = 0; i < cores; ++i ) {
+            auto core = std::make_unique<core_state>();
+            core->index = i;
+            core->rings.resize(cores);
+            core->backlogs.resize(cores);
+            for ( std::size_t from = 0; from < cores; ++from ) {
+                if ( from != i ) {
+                    core->rings[from] = std::make_unique<task_queue_hpp::task_ring>(
+                        std::max(options.ring_capacity, std::size_t(1)));
+                }
+            }
+            cores_.push_back(std::move(core));
+        }
+        try {
+            threads_.reserve(cores);
+            for ( std::size_t i = 0; i < cores; ++i ) {
+                threads_.emplace_back(&basic_runtime::core_main_, this, i, options.pin_threads);
+            }
+        } catch (...) {
+            shutdown_();
+            throw;
+        }
+    }
+
+    template < typename QueuePolicy >
+    basic_runtime<QueuePolicy>::~basic_runtime() noexcept {
+        shutdown_();
+    }
+
+    template < typename QueuePolicy >
+    std::size_t basic_runtime<QueuePolicy>::core_count() const noexcept {
+        return cores_.size();
+    }
+
+    template < typename QueuePolicy >
+    std::size_t basic_runtime<QueuePolicy>::current_core() const noexcept {
+        return current_runtime_ == this ? current_core_ : npos;
+    }
+
+    template < typename QueuePolicy >
+    typename basic_runtime<QueuePolicy>::scheduler_type&
+    basic_runtime<QueuePolicy>::scheduler(std::size_t core) noexcept {
+        assert(core < cores_.size());
+        return cores_[core]->scheduler;
+    }
+
+    template < typename QueuePolicy >
+    template < typename F, typename... Args, typename R >
+    promise<R> basic_runtime<QueuePolicy>::submit_to(std::size_t core, F&& f, Args&&... args) {
+        assert(core < cores_.size());
+        const std::size_t home = current_core();
+        if ( home == core ) {
+            return cores_[core]->scheduler.schedule(
+                std::forward<F>(f),
+                std::forward<Args>(args)...);
+        }
+        if ( home == npos ) {
+            using task_t = task_queue_hpp::concrete_task<
+                R,
+                std::decay_t<F>,
+                std::decay_t<Args>...>;
+            std::unique_ptr<task_t> task = std::make_unique<task_t>(
+                std::forward<F>(f),
+                std::make_tuple(std::forward<Args>(args)...));
+            promise<R> future = task->future();
+            cores_[core]->inbox.push(std::move(task));
+            wake_(*cores_[core]);
+            return future;
+        }
+        using task_t = submit_task<
+            R,
+            std::decay_t<F>,
+            std::decay_t<Args>...>;
+        std::unique_ptr<task_t> task = std::make_unique<task_t>(
+            *this,
+            home,
+            std::forward<F>(f),
+            std::make_tuple(std::forward<Args>(args)...));
+        promise<R> future = task->future();
+        send_(home, core, std::move(task));
+        return future;
+    }
+
+    template < typename QueuePolicy >
+    void basic_runtime<QueuePolicy>::core_main_(std::size_t core, bool pin) noexcept {
+        current_runtime_ = this;
+        current_core_ = core;
+        if ( pin ) {
+            pin_thread_(core);
+        }
+        core_state& state = *cores_[core];
+        while ( !stopping_.load() ) {
+            std::size_t processed = poll_(state);
+            processed += state.scheduler.process_pending_tasks().second;
+            if ( !processed ) {
+                try {
+                    park_(state);
+                } catch (...) {
+                    std::this_thread::yield();
+                }
+            }
+        }
+    }
+
+    template < typename QueuePolicy >
+    std::size_t basic_runtime<QueuePolicy>::poll_(core_state& core) noexcept {
+        std::size_t processed = 0;
+        for ( std::size_t from = 0; from < core.rings.size(); ++from ) {
+            const std::unique_ptr<task_queue_hpp::task_ring>& ring = core.rings[from];
+            // one ring's worth at most, so a busy sender cannot starve the others
+            std::size_t popped = 0;
+            for ( std::size_t e = ring ? ring->capacity() : 0; popped < e; ++popped ) {
+                task_ptr task = ring->try_pop();
+                if ( !task ) {
+                    break;
+                }
+                task->run();
+            }
+            if ( popped && cores_[from]->awaits_drain.load() ) {
+                // the sender parked with a backlog for this ring
+                wake_(*cores_[from]);
+            }
+            processed += popped;
+        }
+        processed += core.inbox.drain([](task_ptr task){
+            task->run();
+        });
+        return processed + flush_backlogs_(core);
+    }
+
+    template < typename QueuePolicy >
+    void basic_runtime<QueuePolicy>::park_(core_state& core) {
+        // a pending backlog waits for the targets to drain their rings,
+        // which wake this core, and retries on its own now and then in
+        // case a drain slipped in before the flag was seen
+        core.awaits_drain.store(core.backlog_count != 0);
+        // both sides exchange the flag, so either the sender sees it set
+        // or this core sees the task published before the sender's exchange
+        (void)core.parked.exchange(true);
+        if ( !stopping_.load() && !has_incoming_(core) ) {
+            const auto predicate = [this, &core](){
+                return !core.parked.load() || stopping_.load();
+            };
+            auto wake_time = core.scheduler.next_timer_time();
+            if ( core.backlog_count ) {
+                const auto retry_time = std::chrono::steady_clock::now() + backlog_retry_interval_;
+                if ( !wake_time || retry_time < *wake_time ) {
+                    wake_time = retry_time;
+                }
+            }
+            std::unique_lock<std::mutex> lock(core.park_mutex);
+            if ( wake_time ) {
+                core.park_cond_var.wait_until(lock, *wake_time, predicate);
+            } else {
+                core.park_cond_var.wait(lock, predicate);
+            }
+        }
+        core.parked.store(false);
+        core.awaits_drain.store(false);
+    }
+
+    template < typename QueuePolicy >
+    void basic_runtime<QueuePolicy>::wake_(core_state& core) noexcept {
+        if ( core.parked.exchange(false) ) {
+            std::lock_guard<std::mutex> guard(core.park_mutex);
+            core.park_cond_var.notify_one();
+        }
+    }
+
+    template < typename QueuePolicy >
+    bool basic_runtime<QueuePolicy>::has_incoming_(core_state& core) const noexcept {
+        // the own backlog is not incoming, it is flushed when a target drains
+        if ( !core.inbox.empty() ) {
+            return true;
+        }
+        return std::any_of(core.rings.begin(), core.rings.end(), [](const auto& ring){
+            return ring && !ring->empty();
+        });
+    }
+
+    template < typename QueuePolicy >
+    void basic_runtime<QueuePolicy>::send_(std::size_t from, std::size_t to, task_ptr task) {
+        core_state& source = *cores_[from];
+        core_state& target = *cores_[to];
+        std::deque<task_ptr>& backlog = source.backlogs[to];
+        if ( !backlog.empty() || !target.rings[from]->try_push(task) ) {
+            backlog.push_back(std::move(task));
+            ++source.backlog_count;
+        }
+        wake_(target);
+    }
+
+    template < typename QueuePolicy >
+    std::size_t basic_runtime<QueuePolicy>::flush_backlogs_(core_state& core) noexcept {
+        std::size_t flushed = 0;
+        for ( std::size_t to = 0; core.backlog_count && to < cores_.size(); ++to ) {
+            std::deque<task_ptr>& backlog = core.backlogs[to];
+            if ( backlog.empty() ) {
+                continue;
+            }
+            task_queue_hpp::task_ring& ring = *cores_[to]->rings[core.index];
+            const std::size_t size = backlog.size();
+            while ( !backlog.empty() && ring.try_push(backlog.front()) ) {
+                backlog.pop_front();
+            }
+            if ( backlog.size() != size ) {
+                flushed += size - backlog.size();
+                core.backlog_count -= size - backlog.size();
+                wake_(*cores_[to]);
+            }
+        }
+        return flushed;
+    }
+
+    template < typename QueuePolicy >
+    void basic_runtime<QueuePolicy>::shutdown_() noexcept {
+        stopping_.store(true);
+        for ( const std::unique_ptr<core_state>& core : cores_ ) {
+            std::lock_guard<std::mutex> guard(core->park_mutex);
+            core->park_cond_var.notify_one();
+        }
+        for ( std::thread& thread : threads_ ) {
+            if ( thread.joinable() ) {
+                thread.join();
+            }
+        }
+        const std::exception_ptr e = std::make_exception_ptr(
+            runtime_cancelled_exception());
+        for ( const std::unique_ptr<core_state>& core : cores_ ) {
+            for ( const std::unique_ptr<task_queue_hpp::task_ring>& ring : core->rings ) {
+                while ( task_ptr task = ring ? ring->try_pop() : nullptr ) {
+                    task->cancel(e);
+                }
+            }
+            for ( std::deque<task_ptr>& backlog : core->backlogs ) {
+                for ( task_ptr& task : backlog ) {
+                    task->cancel(e);
+                }
+                backlog.clear();
+            }
+            core->backlog_count = 0;
+            core->inbox.drain([&e](task_ptr task){
+                task->cancel(e);
+            });
+        }
+    }
+
+    template < typename QueuePolicy >
+    void basic_runtime<QueuePolicy>::pin_thread_(std::size_t core) noexcept {
+        // best effort, cores past the allowed cpus wrap around
+    #if defined(__linux__)
+        cpu_set_t allowed;
+        CPU_ZERO(&allowed);
+        if ( ::sched_getaffinity(0, sizeof(allowed), &allowed) || CPU_COUNT(&allowed) <= 0 ) {
+            return;
+        }
+        std::size_t skip = core % static_cast<std::size_t>(CPU_COUNT(&allowed));
+        for ( std::size_t cpu = 0; cpu < static_cast<std::size_t>(CPU_SETSIZE); ++cpu ) {
+            if ( CPU_ISSET(cpu, &allowed) && !skip-- ) {
+                cpu_set_t set;
+                CPU_ZERO(&set);
+                CPU_SET(cpu, &set);
+                (void)::pthread_setaffinity_np(::pthread_self(), sizeof(set), &set);
+                return;
+            }
+        }
+    #else
+        (void)core;
+    #endif
+    }
+}
@@ -7,8 +7,23 @@
 #pragma once
 
 #include "../promise.hpp"
+#include "task_queue.hpp"
 
+#include <array>
+#include <optional>
 #include <algorithm>
+#include <system_error>
+#include <unordered_map>
+
+#include <cmath>
+#include <cerrno>
+
+#if defined(__linux__)
+#  include <sys/epoll.h>
+#  include <sys/eventfd.h>
+#  include <sys/timerfd.h>
+#  include <unistd.h>
+#endif
 
 namespace scheduler_hpp
 {
@@ -28,16 +43,172 @@ namespace scheduler_hpp
         cancelled
     };
 
+    struct scheduler_frame_stats {
+        std::chrono::nanoseconds budget{0};
+        std::chrono::nanoseconds busy_time{0};
+        std::size_t processed_tasks{0};
+        std::size_t deferred_tasks{0};
+        std::size_t clock_reads{0};
+    };
+
+    // Durations counted in power-of-two buckets: bucket 0 holds zero,
+    // bucket `i` the ones in [2^(i-1), 2^i) nanoseconds and the last
+    // one everything longer.
+    struct scheduler_histogram {
+        static constexpr std::size_t bucket_count = 40;
+        std::array<std::uint64_t, bucket_count> buckets{};
+
+        std::uint64_t count() const noexcept;
+        std::chrono::nanoseconds percentile(double fraction) const noexcept;
+    };
+
+    struct scheduler_priority_stats {
+        std::size_t backlog{0};
+        scheduler_histogram wait_time;
+        scheduler_histogram run_time;
+    };
+
+    struct scheduler_stats {
+        std::array<
+            scheduler_priority_stats,
+            task_queue_hpp::priority_count_v<scheduler_priority>> priorities;
+        std::uint64_t calls{0};
+        std::uint64_t over_budget_calls{0};
+        scheduler_histogram call_time;
+        scheduler_frame_stats last_call;
+    };
+
     class scheduler_cancelled_exception final : public std::runtime_error {
     public:
         scheduler_cancelled_exception()
         : std::runtime_error("scheduler has stopped working") {}
     };
 
-    class scheduler final : private detail::noncopyable {
+    class scheduler_task_cancelled_exception final : public std::runtime_error {
+    public:
+        scheduler_task_cancelled_exception()
+        : std::runtime_error("scheduler task has been cancelled") {}
+    };
+
+    class scheduler_task_handle final {
+    public:
+        scheduler_task_handle() = default;
+
+        bool valid() const noexcept {
+            return !!state_;
+        }
+
+        bool cancel() noexcept {
+            return state_ && state_->revoke(
+                std::make_exception_ptr(scheduler_task_cancelled_exception()));
+        }
+    private:
+        template < typename QueuePolicy, typename TimerClock, bool Instrumented >
+        friend class basic_scheduler;
+
+        explicit scheduler_task_handle(std::shared_ptr<task_queue_hpp::revocable_state> state) noexcept
+        : state_(std::move(state)) {}
+    private:
+        std::shared_ptr<task_queue_hpp::revocable_state> state_;
+    };
+
+    enum class scheduler_coalesce_policy {
+        latest,
+        first
+    };
+
+    template < typename Key, typename R, typename Hash = std::hash<Key> >
+    class scheduler_coalesced_tasks final : private detail::noncopyable {
+    public:
+        explicit scheduler_coalesced_tasks(
+            scheduler_coalesce_policy policy = scheduler_coalesce_policy::latest) noexcept;
+        ~scheduler_coalesced_tasks() noexcept;
+        std::size_t size() const noexcept;
+    private:
+        template < typename QueuePolicy, typename TimerClock, bool Instrumented >
+        friend class basic_scheduler;
+
+        class callable {
+        public:
+            virtual ~callable() noexcept = default;
+            virtual R invoke() = 0;
+        };
+
+        template < typename F, typename... Args >
+        class concrete_callable final : public callable {
+            F f_;
+            std::tuple<Args...> args_;
+        public:
+            template < typename U >
+            concrete_callable(U&& u, std::tuple<Args...>&& args)
+            : f_(std::forward<U>(u))
+            , args_(std::move(args)) {}
+
+            R invoke() final {
+                return std::apply(std::move(f_), std::move(args_));
+            }
+        };
+
+        struct entry {
+            std::unique_ptr<callable> call;
+            promise<R> future;
+        };
+
+        // The queued task only knows the key, so the callable can be
+        // replaced until the task takes the entry out to run it.
+        class pending_task final : public task_queue_hpp::task {
+        public:
+            pending_task(scheduler_coalesced_tasks& tasks, const Key& key);
+            void run() noexcept final;
+            void cancel(std::exception_ptr e) noexcept final;
+        private:
+            scheduler_coalesced_tasks& tasks_;
+            Key key_;
+        };
+
+        entry take_(const Key& key) noexcept;
+    private:
+        scheduler_coalesce_policy policy_;
+        mutable std::mutex mutex_;
+        std::unordered_map<Key, entry, Hash> entries_;
+    };
+
+    namespace impl
+    {
+        struct scheduler_histogram_counters {
+            std::array<
+                std::atomic<std::uint64_t>,
+                scheduler_histogram::bucket_count> buckets{};
+        };
+
+        struct scheduler_instrumentation_state {
+            static constexpr std::size_t priority_count =
+                task_queue_hpp::priority_count_v<scheduler_priority>;
+            std::array<std::atomic<std::size_t>, priority_count> backlog{};
+            std::array<scheduler_histogram_counters, priority_count> wait_time;
+            std::array<scheduler_histogram_counters, priority_count> run_time;
+            std::atomic<std::uint64_t> calls{0};
+            std::atomic<std::uint64_t> over_budget_calls{0};
+            scheduler_histogram_counters call_time;
+            scheduler_frame_stats last_call;
+        };
+
+        // a base, so schedulers without instrumentation don't pay for it
+        struct scheduler_no_instrumentation_state {};
+    }
+
+    template < typename QueuePolicy = task_queue_hpp::priority_heap_policy
+             , typename TimerClock = std::chrono::steady_clock
+             , bool Instrumented = false >
+    class basic_scheduler final
+        : private detail::noncopyable
+        , private std::conditional_t<
+            Instrumented,
+            impl::scheduler_instrumentation_state,
+            impl::scheduler_no_instrumentation_state> {
     public:
-        scheduler();
-        ~scheduler() noexcept;
+        basic_scheduler();
+        ~basic_scheduler() noexcept;
 
         using processing_result_t = std::pair<
             scheduler_processing_status,
@@ -48,6 +219,10 @@ namespace scheduler_hpp
             std::decay_t<F>,
             std::decay_t<Args>...>;
 
+        // Tasks scheduled by a running task are kept aside until it finishes
+        // unless another thread is processing or waiting for tasks then, so
+        // a task can only block on the work it schedules while another
+        // thread processes this scheduler.
         template < typename F, typename... Args
                  , typename R = schedule_invoke_result_t<F, Args...> >
         promise<R> schedule(F&& f, Args&&... args);
@@ -56,6 +231,73 @@ namespace scheduler_hpp
                  , typename R = schedule_invoke_result_t<F, Args...> >
         promise<R> schedule(scheduler_priority scheduler_priority, F&& f, Args&&... args);
 
+        // Calls with a key that is still pending share its promise and its
+        // single run, at the priority of the first call. Depending on the
+        // policy of the table, the latest function replaces the pending one
+        // or the first one is kept. The table must outlive the scheduled
+        // work, until it is run or cancelled by the scheduler shutdown.
+        template < typename Key, typename R, typename Hash, typename F, typename... Args >
+        promise<R> schedule_coalesced(
+            scheduler_coalesced_tasks<Key, R, Hash>& tasks,
+            const Key& key,
+            F&& f, Args&&... args);
+
+        template < typename Key, typename R, typename Hash, typename F, typename... Args >
+        promise<R> schedule_coalesced(
+            scheduler_priority scheduler_priority,
+            scheduler_coalesced_tasks<Key, R, Hash>& tasks,
+            const Key& key,
+            F&& f, Args&&... args);
+
+        template < typename R >
+        using timer_result_t = std::pair<
+            promise<R>,
+            scheduler_task_handle>;
+
+        template < typename Rep, typename Period, typename F, typename... Args
+                 , typename R = schedule_invoke_result_t<F, Args...> >
+        timer_result_t<R> schedule_after(
+            const std::chrono::duration<Rep, Period>& delay,
+            F&& f, Args&&... args);
+
+        template < typename Rep, typename Period, typename F, typename... Args
+                 , typename R = schedule_invoke_result_t<F, Args...> >
+        timer_result_t<R> schedule_after(
+            scheduler_priority scheduler_priority,
+            const std::chrono::duration<Rep, Period>& delay,
+            F&& f, Args&&... args);
+
+        template < typename Clock, typename Duration, typename F, typename... Args
+                 , typename R = schedule_invoke_result_t<F, Args...> >
+        timer_result_t<R> schedule_at(
+            const std::chrono::time_point<Clock, Duration>& time,
+            F&& f, Args&&... args);
+
+        template < typename Clock, typename Duration, typename F, typename... Args
+                 , typename R = schedule_invoke_result_t<F, Args...> >
+        timer_result_t<R> schedule_at(
+            scheduler_priority scheduler_priority,
+            const std::chrono::time_point<Clock, Duration>& time,
+            F&& f, Args&&... args);
+
+        // Ticks stay on multiples of the period from the first one and missed
+        // ticks are skipped rather than run late. The promise is rejected
+        // when the timer is cancelled or its function throws.
+        template < typename Rep, typename Period, typename F, typename... Args >
+        timer_result_t<void> schedule_every(
+            const std::chrono::duration<Rep, Period>& period,
+            F&& f, Args&&... args);
+
+        template < typename Rep, typename Period, typename F, typename... Args >
+        timer_result_t<void> schedule_every(
+            scheduler_priority scheduler_priority,
+            const std::chrono::duration<Rep, Period>& period,
+            F&& f, Args&&... args);
+
+        // The due time of the earliest timer, cancelled ones included,
+        // for loops that sleep on their own primitives.
+        std::optional<typename TimerClock::time_point> next_timer_time() const;
+
         processing_result_t process_one_task() noexcept;
         processing_result_t process_all_tasks() noexcept;
 
@@ -66,77 +308,300 @@ namespace scheduler_hpp
         template < typename Clock, typename Duration >
         processing_result_t process_tasks_until(
             const std::chrono::time_point<Clock, Duration>& timeout_time) noexcept;
+
+        // A descriptor for poll/epoll that becomes readable when tasks arrive,
+        // a timer comes due or a processing call leaves work behind, or -1
+        // where epoll is not available. Readiness is cleared and the tasks
+        // pending on entry are run by `process_pending_tasks`.
+        int wakeup_fd();
+        processing_result_t process_pending_tasks() noexcept;
+
+        // Tasks scheduled in a category scope share a learned cost, and
+        // `process_tasks_until` defers a task that would not fit in what is
+        // left of its budget. Categories are folded into 64 cost slots.
+        class category_scope;
+        static std::uint32_t current_category() noexcept;
+        std::chrono::nanoseconds category_cost(std::uint32_t category) const noexcept;
+
+        // Stats of the last `process_tasks_for` or `process_tasks_until` call.
+        scheduler_frame_stats frame_stats() const;
+
+        // Backlog, wait and run times per priority and the stats of every
+        // `process_*` call. Only instrumented schedulers collect them, the
+        // others compile the bookkeeping out.
+        scheduler_stats stats() const;
     private:
-        class task;
-        using task_ptr = std::unique_ptr<task>;
-        template < typename R, typename F, typename... Args >
-        class concrete_task;
+        using task_ptr = task_queue_hpp::task_ptr;
+        using task_queue = typename QueuePolicy::template queue<
+            scheduler_priority,
+            task_ptr>;
+        using local_tasks_t = std::vector<std::pair<
+            scheduler_priority,
+            task_ptr>>;
+        using timer_clock = TimerClock;
+        using timer_time_point = typename TimerClock::time_point;
+        using timer_duration = typename TimerClock::duration;
+
+        struct timer_entry {
+            timer_time_point due;
+            timer_duration period;
+            std::uint64_t sequence;
+            scheduler_priority priority;
+            std::uint32_t category;
+            std::shared_ptr<task_queue_hpp::revocable_state> state;
+        };
+
+        struct cost_slot {
+            std::atomic<std::chrono::nanoseconds::rep> average{0};
+            std::atomic<std::uint32_t> runs{0};
+        };
+
+        struct frame_state {
+            timer_time_point now;
+            timer_time_point deadline;
+            std::size_t unmeasured_tasks{0};
+            bool deferred{false};
+            scheduler_frame_stats stats;
+        };
+
+        using histogram_counters = impl::scheduler_histogram_counters;
+        using instrumentation_state = std::conditional_t<
+            Instrumented,
+            impl::scheduler_instrumentation_state,
+            impl::scheduler_no_instrumentation_state>;
+
+        static constexpr std::size_t cost_slot_count_ = 64;
+        static constexpr std::uint32_t cost_sample_period_ = 16;
+        static constexpr std::size_t max_unmeasured_tasks_ = 16;
     private:
+        void schedule_task_(scheduler_priority scheduler_priority, task_ptr task);
         void push_task_(scheduler_priority scheduler_priority, task_ptr task);
         task_ptr pop_task_() noexcept;
+        bool has_tasks_() const noexcept;
+        void drain_inboxes_() noexcept;
+        template < typename Predicate >
+        void wait_tasks_(std::unique_lock<std::mutex>& lock, Predicate predicate);
+        template < typename Clock, typename Duration, typename Predicate >
+        void wait_tasks_until_(
+            std::unique_lock<std::mutex>& lock,
+            const std::chrono::time_point<Clock, Duration>& timeout_time,
+            Predicate predicate);
         void shutdown_() noexcept;
-        void process_task_(std::unique_lock<std::mutex> lock) noexcept;
+        void process_task_(std::unique_lock<std::mutex> lock, frame_state& frame) noexcept;
+        template < typename Runner >
+        std::size_t process_batch_(
+            std::unique_lock<std::mutex> lock,
+            Runner run_task) noexcept;
+        void run_task_(
+            scheduler_priority scheduler_priority,
+            task_queue_hpp::task& task,
+            frame_state& frame) noexcept;
+        bool run_budgeted_task_(
+            scheduler_priority scheduler_priority,
+            task_queue_hpp::task& task,
+            frame_state& frame) noexcept;
+        template < typename F >
+        local_tasks_t run_unlocked_(std::unique_lock<std::mutex>& lock, F&& f) noexcept;
+        void push_local_tasks_(local_tasks_t& local_tasks) noexcept;
+        void signal_wakeup_() noexcept;
+        void consume_wakeup_() noexcept;
+        void refresh_wakeup_() noexcept;
+        void arm_timer_fd_() noexcept;
+        void push_timer_(
+            scheduler_priority scheduler_priority,
+            timer_time_point due,
+            timer_duration period,
+            std::shared_ptr<task_queue_hpp::revocable_state> state);
+        void promote_timers_() noexcept;
+        void purge_timers_() noexcept;
+        template < typename Clock, typename Duration >
+        static timer_time_point to_timer_time_(
+            const std::chrono::time_point<Clock, Duration>& time);
+        static bool timer_greater_(const timer_entry& l, const timer_entry& r) noexcept;
+        void record_call_(const frame_state& frame) noexcept;
+        instrumentation_state& instrumentation_() noexcept;
+        const instrumentation_state& instrumentation_() const noexcept;
+        void release_backlog_(scheduler_priority priority) noexcept;
+        static void record_duration_(histogram_counters& histogram, std::chrono::nanoseconds duration) noexcept;
+        static scheduler_histogram load_histogram_(const histogram_counters& histogram) noexcept;
+        static std::uint32_t to_stamp_(timer_time_point time) noexcept;
     private:
-        std::vector<std::pair<scheduler_priority, task_ptr>> tasks_;
+        task_queue tasks_;
+        std::array<
+            task_queue_hpp::task_inbox,
+            task_queue_hpp::priority_count_v<scheduler_priority>> inboxes_;
+        std::atomic<std::size_t> waiters_{0};
+        std::atomic<std::size_t> runners_{0};
+        std::atomic<int> wakeup_fd_{-1};
+        int event_fd_{-1};
+        int timer_fd_{-1};
+        std::vector<timer_entry> timers_;
+        std::uint64_t timer_sequence_{0};
+        std::atomic<std::size_t> timer_count_{0};
+        std::array<cost_slot, cost_slot_count_> cost_slots_;
+        scheduler_frame_stats frame_stats_;
         std::atomic<bool> cancelled_{false};
         std::atomic<std::size_t> active_task_count_{0};
         mutable std::mutex tasks_mutex_;
         mutable std::condition_variable cond_var_;
+    private:
+        inline static thread_local const basic_scheduler* current_scheduler_{nullptr};
+        inline static thread_local local_tasks_t* current_local_tasks_{nullptr};
+        inline static thread_local std::uint32_t current_category_{0};
     };
 
-    class scheduler::task : private detail::noncopyable {
+    template < typename QueuePolicy, typename TimerClock, bool Instrumented >
+    class basic_scheduler<QueuePolicy, TimerClock, Instrumented>::category_scope final : private detail::noncopyable {
     public:
-        virtual ~task() noexcept = default;
-        virtual void run() noexcept = 0;
-        virtual void cancel() noexcept = 0;
-    };
+        explicit category_scope(std::uint32_t category) noexcept
+        : prev_category_(std::exchange(current_category_, category)) {}
 
-    template < typename R, typename F, typename... Args >
-    class scheduler::concrete_task final : public task {
-        F f_;
-        std::tuple<Args...> args_;
-        promise<R> promise_;
-    public:
-        template < typename U >
-        concrete_task(U&& u, std::tuple<Args...>&& args);
-        void run() noexcept final;
-        void cancel() noexcept final;
-        promise<R> future() noexcept;
+        ~category_scope() noexcept {
+            current_category_ = prev_category_;
+        }
+    private:
+        std::uint32_t prev_category_{0};
     };
 
-    template < typename F, typename... Args >
-    class scheduler::concrete_task<void, F, Args...> final : public task {
-        F f_;
-        std::tuple<Args...> args_;
-        promise<void> promise_;
-    public:
-        template < typename U >
-        concrete_task(U&& u, std::tuple<Args...>&& args);
-        void run() noexcept final;
-        void cancel() noexcept final;
-        promise<void> future() noexcept;
-    };
+    using scheduler = basic_scheduler<>;
+
+    using instrumented_scheduler = basic_scheduler<
+        task_queue_hpp::priority_heap_policy,
+        std::chrono::steady_clock,
+        true>;
+
+    // Timers run on a virtual_clock and waits for them move the clock
+    // instead of sleeping, so simulated time passes as fast as it's processed.
+    template < typename Tag = void >
+    using virtual_scheduler = basic_scheduler<
+        task_queue_hpp::priority_fifo_policy,
+        virtual_clock<Tag>>;
+}
+
+namespace scheduler_hpp
+{
+    template < typename Key, typename R, typename Hash >
+    scheduler_coalesced_tasks<Key, R, Hash>::scheduler_coalesced_tasks(
+        scheduler_coalesce_policy policy) noexcept
+    : policy_(policy) {}
+
+    template < typename Key, typename R, typename Hash >
+    scheduler_coalesced_tasks<Key, R, Hash>::~scheduler_coalesced_tasks() noexcept {
+        assert(entries_.empty() && "pending coalesced tasks outlive their table");
+    }
+
+    template < typename Key, typename R, typename Hash >
+    std::size_t scheduler_coalesced_tasks<Key, R, Hash>::size() const noexcept {
+        std::lock_guard<std::mutex> guard(mutex_);
+        return entries_.size();
+    }
+
+    template < typename Key, typename R, typename Hash >
+    typename scheduler_coalesced_tasks<Key, R, Hash>::entry
+    scheduler_coalesced_tasks<Key, R, Hash>::take_(const Key& key) noexcept {
+        std::lock_guard<std::mutex> guard(mutex_);
+        const auto iter = entries_.find(key);
+        assert(iter != entries_.end());
+        entry result = std::move(iter->second);
+        entries_.erase(iter);
+        return result;
+    }
+
+    template < typename Key, typename R, typename Hash >
+    scheduler_coalesced_tasks<Key, R, Hash>::pending_task::pending_task(
+        scheduler_coalesced_tasks& tasks,
+        const Key& key)
+    : tasks_(tasks)
+    , key_(key) {}
+
+    template < typename Key, typename R, typename Hash >
+    void scheduler_coalesced_tasks<Key, R, Hash>::pending_task::run() noexcept {
+        // calls coming in while it runs start a new pending entry
+        entry e = tasks_.take_(key_);
+        try {
+            if constexpr ( std::is_void_v<R> ) {
+                e.call->invoke();
+                e.future.resolve();
+            } else {
+                e.future.resolve(e.call->invoke());
+            }
+        } catch (...) {
+            e.future.reject(std::current_exception());
+        }
+    }
+
+    template < typename Key, typename R, typename Hash >
+    void scheduler_coalesced_tasks<Key, R, Hash>::pending_task::cancel(std::exception_ptr e) noexcept {
+        tasks_.take_(key_).future.reject(e);
+    }
 }
 
 namespace scheduler_hpp
 {
-    inline scheduler::scheduler() = default;
+    //
+    // scheduler_histogram
+    //
 
-    inline scheduler::~scheduler() noexcept {
+    inline std::uint64_t scheduler_histogram::count() const noexcept {
+        std::uint64_t total = 0;
+        for ( const std::uint64_t bucket : buckets ) {
+            total += bucket;
+        }
+        return total;
+    }
+
+    inline std::chrono::nanoseconds scheduler_histogram::percentile(double fraction) const noexcept {
+        // the upper bound of the bucket holding the percentile
+        const std::uint64_t total = count();
+        if ( !total ) {
+            return std::chrono::nanoseconds::zero();
+        }
+        const double clamped = std::min(std::max(fraction, 0.0), 1.0);
+        const std::uint64_t target = std::max(
+            static_cast<std::uint64_t>(std::ceil(clamped * static_cast<double>(total))),
+            std::uint64_t(1));
+        std::uint64_t seen = 0;
+        for ( std::size_t i = 0; i < buckets.size(); ++i ) {
+            seen += buckets[i];
+            if ( seen >= target ) {
+                return std::chrono::nanoseconds(std::int64_t(1) << i);
+            }
+        }
+        return std::chrono::nanoseconds(std::int64_t(1) << (buckets.size() - 1));
+    }
+
+    //
+    // basic_scheduler
+    //
+
+    template < typename QueuePolicy, typename TimerClock, bool Instrumented >
+    basic_scheduler<QueuePolicy, TimerClock, Instrumented>::basic_scheduler() = default;
+
+    template < typename QueuePolicy, typename TimerClock, bool Instrumented >
+    basic_scheduler<QueuePolicy, TimerClock, Instrumented>::~basic_scheduler() noexcept {
         shutdown_();
+    #if defined(__linux__)
+        if ( const int fd = wakeup_fd_.load(); fd != -1 ) {
+            ::close(fd);
+            ::close(event_fd_);
+            ::close(timer_fd_);
+        }
+    #endif
     }
 
+    template < typename QueuePolicy, typename TimerClock, bool Instrumented >
     template < typename F, typename... Args, typename R >
-    promise<R> scheduler::schedule(F&& f, Args&&... args) {
+    promise<R> basic_scheduler<QueuePolicy, TimerClock, Instrumented>::schedule(F&& f, Args&&... args) {
         return schedule(
             scheduler_priority::normal,
             std::forward<F>(f),
             std::forward<Args>(args)...);
     }
 
+    template < typename QueuePolicy, typename TimerClock, bool Instrumented >
     template < typename F, typename... Args, typename R >
-    promise<R> scheduler::schedule(scheduler_priority priority, F&& f, Args&&... args) {
-        using task_t = concrete_task<
+    promise<R> basic_scheduler<QueuePolicy, TimerClock, Instrumented>::schedule(scheduler_priority priority, F&& f, Args&&... args) {
+        using task_t = task_queue_hpp::concrete_task<
             R,
             std::decay_t<F>,
             std::decay_t<Args>...>;
@@ -144,35 +609,224 @@ namespace scheduler_hpp
             std::forward<F>(f),
             std::make_tuple(std::forward<Args>(args)...));
         promise<R> future = task->future();
-        std::lock_guard<std::mutex> guard(tasks_mutex_);
-        push_task_(priority, std::move(task));
+        schedule_task_(priority, std::move(task));
+        return future;
+    }
+
+    template < typename QueuePolicy, typename TimerClock, bool Instrumented >
+    template < typename Key, typename R, typename Hash, typename F, typename... Args >
+    promise<R> basic_scheduler<QueuePolicy, TimerClock, Instrumented>::schedule_coalesced(
+        scheduler_coalesced_tasks<Key, R, Hash>& tasks,
+        const Key& key,
+        F&& f, Args&&... args)
+    {
+        return schedule_coalesced(
+            scheduler_priority::normal,
+            tasks,
+            key,
+            std::forward<F>(f),
+            std::forward<Args>(args)...);
+    }
+
+    template < typename QueuePolicy, typename TimerClock, bool Instrumented >
+    template < typename Key, typename R, typename Hash, typename F, typename... Args >
+    promise<R> basic_scheduler<QueuePolicy, TimerClock, Instrumented>::schedule_coalesced(
+        scheduler_priority priority,
+        scheduler_coalesced_tasks<Key, R, Hash>& tasks,
+        const Key& key,
+        F&& f, Args&&... args)
+    {
+        using callable_t = typename scheduler_coalesced_tasks<Key, R, Hash>::template concrete_callable<
+            std::decay_t<F>,
+            std::decay_t<Args>...>;
+        using pending_task_t = typename scheduler_coalesced_tasks<Key, R, Hash>::pending_task;
+        std::unique_ptr<typename scheduler_coalesced_tasks<Key, R, Hash>::callable> call =
+            std::make_unique<callable_t>(
+                std::forward<F>(f),
+                std::make_tuple(std::forward<Args>(args)...));
+        promise<R> future;
+        {
+            std::lock_guard<std::mutex> guard(tasks.mutex_);
+            const auto iter = tasks.entries_.find(key);
+            if ( iter != tasks.entries_.end() ) {
+                if ( tasks.policy_ == scheduler_coalesce_policy::latest ) {
+                    // the replaced function is released after the unlock
+                    std::swap(iter->second.call, call);
+                }
+                return iter->second.future;
+            }
+            tasks.entries_.emplace(key, typename scheduler_coalesced_tasks<Key, R, Hash>::entry{
+                std::move(call),
+                future});
+        }
+        try {
+            schedule_task_(
+                priority,
+                std::make_unique<pending_task_t>(tasks, key));
+        } catch (...) {
+            tasks.take_(key);
+            throw;
+        }
         return future;
     }
 
-    inline scheduler::processing_result_t scheduler::process_one_task() noexcept {
+    template < typename QueuePolicy, typename TimerClock, bool Instrumented >
+    template < typename Rep, typename Period, typename F, typename... Args, typename R >
+    typename basic_scheduler<QueuePolicy, TimerClock, Instrumented>::template timer_result_t<R>
+    basic_scheduler<QueuePolicy, TimerClock, Instrumented>::schedule_after(
+        const std::chrono::duration<Rep, Period>& delay,
+        F&& f, Args&&... args)
+    {
+        return schedule_after(
+            scheduler_priority::normal,
+            delay,
+            std::forward<F>(f),
+            std::forward<Args>(args)...);
+    }
+
+    template < typename QueuePolicy, typename TimerClock, bool Instrumented >
+    template < typename Rep, typename Period, typename F, typename... Args, typename R >
+    typename basic_scheduler<QueuePolicy, TimerClock, Instrumented>::template timer_result_t<R>
+    basic_scheduler<QueuePolicy, TimerClock, Instrumented>::schedule_after(
+        scheduler_priority priority,
+        const std::chrono::duration<Rep, Period>& delay,
+        F&& f, Args&&... args)
+    {
+        return schedule_at(
+            priority,
+            timer_clock::now() + std::chrono::ceil<timer_duration>(delay),
+            std::forward<F>(f),
+            std::forward<Args>(args)...);
+    }
+
+    template < typename QueuePolicy, typename TimerClock, bool Instrumented >
+    template < typename Clock, typename Duration, typename F, typename... Args, typename R >
+    typename basic_scheduler<QueuePolicy, TimerClock, Instrumented>::template timer_result_t<R>
+    basic_scheduler<QueuePolicy, TimerClock, Instrumented>::schedule_at(
+        const std::chrono::time_point<Clock, Duration>& time,
+        F&& f, Args&&... args)
+    {
+        return schedule_at(
+            scheduler_priority::normal,
+            time,
+            std::forward<F>(f),
+            std::forward<Args>(args)...);
+    }
+
+    template < typename QueuePolicy, typename TimerClock, bool Instrumented >
+    template < typename Clock, typename Duration, typename F, typename... Args, typename R >
+    typename basic_scheduler<QueuePolicy, TimerClock, Instrumented>::template timer_result_t<R>
+    basic_scheduler<QueuePolicy, TimerClock, Instrumented>::schedule_at(
+        scheduler_priority priority,
+        const std::chrono::time_point<Clock, Duration>& time,
+        F&& f, Args&&... args)
+    {
+        using state_t = task_queue_hpp::concrete_revocable_state<
+            R,
+            std::decay_t<F>,
+            std::decay_t<Args>...>;
+        std::shared_ptr<state_t> state = std::make_shared<state_t>(
+            std::forward<F>(f),
+            std::make_tuple(std::forward<Args>(args)...));
+        promise<R> future = state->future();
+        push_timer_(
+            priority,
+            to_timer_time_(time),
+            timer_duration::zero(),
+            state);
+        return std::make_pair(std::move(future), scheduler_task_handle(std::move(state)));
+    }
+
+    template < typename QueuePolicy, typename TimerClock, bool Instrumented >
+    template < typename Rep, typename Period, typename F, typename... Args >
+    typename basic_scheduler<QueuePolicy, TimerClock, Instrumented>::template timer_result_t<void>
+    basic_scheduler<QueuePolicy, TimerClock, Instrumented>::schedule_every(
+        const std::chrono::duration<Rep, Period>& period,
+        F&& f, Args&&... args)
+    {
+        return schedule_every(
+            scheduler_priority::normal,
+            period,
+            std::forward<F>(f),
+            std::forward<Args>(args)...);
+    }
+
+    template < typename QueuePolicy, typename TimerClock, bool Instrumented >
+    template < typename Rep, typename Period, typename F, typename... Args >
+    typename basic_scheduler<QueuePolicy, TimerClock, Instrumented>::template timer_result_t<void>
+    basic_scheduler<QueuePolicy, TimerClock, Instrumented>::schedule_every(
+        scheduler_priority priority,
+        const std::chrono::duration<Rep, Period>& period,
+        F&& f, Args&&... args)
+    {
+        using state_t = task_queue_hpp::concrete_periodic_state<
+            std::decay_t<F>,
+            std::decay_t<Args>...>;
+        const auto timer_period = std::chrono::ceil<timer_duration>(period);
+        assert(timer_period > timer_duration::zero());
+        std::shared_ptr<state_t> state = std::make_shared<state_t>(
+            std::forward<F>(f),
+            std::make_tuple(std::forward<Args>(args)...));
+        promise<void> future = state->future();
+        push_timer_(
+            priority,
+            timer_clock::now() + timer_period,
+            timer_period,
+            state);
+        return std::make_pair(std::move(future), scheduler_task_handle(std::move(state)));
+    }
+
+    template < typename QueuePolicy, typename TimerClock, bool Instrumented >
+    typename basic_scheduler<QueuePolicy, TimerClock, Instrumented>::processing_result_t
+    basic_scheduler<QueuePolicy, TimerClock, Instrumented>::process_one_task() noexcept {
         std::unique_lock<std::mutex> lock(tasks_mutex_);
         if ( cancelled_ ) {
             return std::make_pair(scheduler_processing_status::cancelled, 0u);
         }
+        promote_timers_();
+        consume_wakeup_();
+        drain_inboxes_();
+        frame_state frame;
         if ( tasks_.empty() ) {
+            lock.unlock();
+            record_call_(frame);
             return std::make_pair(scheduler_processing_status::done, 0u);
         }
-        process_task_(std::move(lock));
+        process_task_(std::move(lock), frame);
+        record_call_(frame);
+        refresh_wakeup_();
         return std::make_pair(scheduler_processing_status::done, 1u);
     }
 
-    inline scheduler::processing_result_t scheduler::process_all_tasks() noexcept {
+    template < typename QueuePolicy, typename TimerClock, bool Instrumented >
+    typename basic_scheduler<QueuePolicy, TimerClock, Instrumented>::processing_result_t
+    basic_scheduler<QueuePolicy, TimerClock, Instrumented>::process_all_tasks() noexcept {
+        {
+            // only timers already due are run, periodic ones could keep it busy forever
+            std::lock_guard<std::mutex> guard(tasks_mutex_);
+            promote_timers_();
+        }
         std::size_t processed_tasks = 0;
+        frame_state frame;
         while ( !cancelled_ && active_task_count_ ) {
             std::unique_lock<std::mutex> lock(tasks_mutex_);
-            cond_var_.wait(lock, [this](){
-                return cancelled_ || !active_task_count_ || !tasks_.empty();
+            wait_tasks_(lock, [this](){
+                return cancelled_ || !active_task_count_ || has_tasks_();
             });
+            consume_wakeup_();
+            drain_inboxes_();
             if ( !tasks_.empty() ) {
-                process_task_(std::move(lock));
-                ++processed_tasks;
+                processed_tasks += process_batch_(std::move(lock), [this, &frame](
+                    scheduler_priority priority,
+                    task_ptr& task)
+                {
+                    run_task_(priority, *task, frame);
+                    return true;
+                });
             }
         }
+        record_call_(frame);
+        refresh_wakeup_();
         return std::make_pair(
             cancelled_
                 ? scheduler_processing_status::cancelled
@@ -180,34 +834,186 @@ namespace scheduler_hpp
             processed_tasks);
     }
 
+    template < typename QueuePolicy, typename TimerClock, bool Instrumented >
     template < typename Rep, typename Period >
-    scheduler::processing_result_t scheduler::process_tasks_for(
+    typename basic_scheduler<QueuePolicy, TimerClock, Instrumented>::processing_result_t
+    basic_scheduler<QueuePolicy, TimerClock, Instrumented>::process_tasks_for(
         const std::chrono::duration<Rep, Period>& timeout_duration) noexcept
     {
         return process_tasks_until(
-            std::chrono::steady_clock::now() + timeout_duration);
+            timer_clock::now() + timeout_duration);
     }
 
+    template < typename QueuePolicy, typename TimerClock, bool Instrumented >
     template < typename Clock, typename Duration >
-    scheduler::processing_result_t scheduler::process_tasks_until(
+    typename basic_scheduler<QueuePolicy, TimerClock, Instrumented>::processing_result_t
+    basic_scheduler<QueuePolicy, TimerClock, Instrumented>::process_tasks_until(
         const std::chrono::time_point<Clock, Duration>& timeout_time) noexcept
     {
-        std::size_t processed_tasks = 0;
-        while ( !cancelled_ && active_task_count_ ) {
-            if ( !(Clock::now() < timeout_time) ) {
-                return std::make_pair(
-                    scheduler_processing_status::timeout,
-                    processed_tasks);
+        frame_state frame;
+        frame.now = timer_clock::now();
+        frame.deadline = to_timer_time_(timeout_time);
+        frame.stats.budget = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            frame.deadline - frame.now);
+        const auto finish_frame = [this, &frame](scheduler_processing_status status){
+            record_call_(frame);
+            refresh_wakeup_();
+            std::lock_guard<std::mutex> guard(tasks_mutex_);
+            frame_stats_ = frame.stats;
+            return std::make_pair(status, frame.stats.processed_tasks);
+        };
+        while ( !cancelled_ && (active_task_count_ || timer_count_) ) {
+            if ( frame.deferred || !(Clock::now() < timeout_time) ) {
+                return finish_frame(scheduler_processing_status::timeout);
             }
             std::unique_lock<std::mutex> lock(tasks_mutex_);
-            cond_var_.wait_until(lock, timeout_time, [this](){
-                return cancelled_ || !active_task_count_ || !tasks_.empty();
+            wait_tasks_until_(lock, timeout_time, [this](){
+                return cancelled_
+                    || (!active_task_count_ && !timer_count_)
+                    || has_tasks_();
             });
+            // the wait may have used up a part of the frame
+            frame.now = timer_clock::now();
+            frame.unmeasured_tasks = 0;
+            ++frame.stats.clock_reads;
+            promote_timers_();
+            consume_wakeup_();
+            drain_inboxes_();
             if ( !tasks_.empty() ) {
-                process_task_(std::move(lock));
-                ++processed_tasks;
+                process_batch_(std::move(lock), [this, &frame](
+                    scheduler_priority priority,
+                    task_ptr& task)
+                {
+                    return run_budgeted_task_(priority, *task, frame);
+                });
+            }
+        }
+        return finish_frame(cancelled_
+            ? scheduler_processing_status::cancelled
+            : scheduler_processing_status::done);
+    }
+
+    template < typename QueuePolicy, typename TimerClock, bool Instrumented >
+    std::uint32_t basic_scheduler<QueuePolicy, TimerClock, Instrumented>::current_category() noexcept {
+        return current_category_;
+    }
+
+    template < typename QueuePolicy, typename TimerClock, bool Instrumented >
+    std::chrono::nanoseconds basic_scheduler<QueuePolicy, TimerClock, Instrumented>::category_cost(std::uint32_t category) const noexcept {
+        return std::chrono::nanoseconds(cost_slots_[category % cost_slot_count_]
+            .average.load(std::memory_order_relaxed));
+    }
+
+    template < typename QueuePolicy, typename TimerClock, bool Instrumented >
+    std::optional<typename TimerClock::time_point> basic_scheduler<QueuePolicy, TimerClock, Instrumented>::next_timer_time() const {
+        std::lock_guard<std::mutex> guard(tasks_mutex_);
+        if ( timers_.empty() ) {
+            return std::nullopt;
+        }
+        return timers_.front().due;
+    }
+
+    template < typename QueuePolicy, typename TimerClock, bool Instrumented >
+    scheduler_frame_stats basic_scheduler<QueuePolicy, TimerClock, Instrumented>::frame_stats() const {
+        std::lock_guard<std::mutex> guard(tasks_mutex_);
+        return frame_stats_;
+    }
+
+    template < typename QueuePolicy, typename TimerClock, bool Instrumented >
+    scheduler_stats basic_scheduler<QueuePolicy, TimerClock, Instrumented>::stats() const {
+        static_assert(Instrumented, "stats are only collected by instrumented schedulers");
+        scheduler_stats snapshot;
+        for ( std::size_t i = 0; i < snapshot.priorities.size(); ++i ) {
+            scheduler_priority_stats& priority = snapshot.priorities[i];
+            priority.backlog = instrumentation_().backlog[i].load(std::memory_order_relaxed);
+            priority.wait_time = load_histogram_(instrumentation_().wait_time[i]);
+            priority.run_time = load_histogram_(instrumentation_().run_time[i]);
+        }
+        snapshot.calls = instrumentation_().calls.load(std::memory_order_relaxed);
+        snapshot.over_budget_calls = instrumentation_().over_budget_calls.load(std::memory_order_relaxed);
+        snapshot.call_time = load_histogram_(instrumentation_().call_time);
+        std::lock_guard<std::mutex> guard(tasks_mutex_);
+        snapshot.last_call = instrumentation_().last_call;
+        return snapshot;
+    }
+
+    template < typename QueuePolicy, typename TimerClock, bool Instrumented >
+    int basic_scheduler<QueuePolicy, TimerClock, Instrumented>::wakeup_fd() {
+    #if defined(__linux__)
+        std::lock_guard<std::mutex> guard(tasks_mutex_);
+        if ( const int fd = wakeup_fd_.load(); fd != -1 ) {
+            return fd;
+        }
+        // the handed out epoll descriptor watches an eventfd for the pushes
+        // and a timerfd armed for the earliest timer
+        int fds[3] = {-1, -1, -1};
+        const auto fail = [&fds](const char* what){
+            const int error = errno;
+            for ( const int fd : fds ) {
+                if ( fd != -1 ) {
+                    ::close(fd);
+                }
+            }
+            throw std::system_error(error, std::generic_category(), what);
+        };
+        if ( (fds[0] = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1 ) {
+            fail("eventfd");
+        }
+        if ( (fds[1] = ::timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) == -1 ) {
+            fail("timerfd_create");
+        }
+        if ( (fds[2] = ::epoll_create1(EPOLL_CLOEXEC)) == -1 ) {
+            fail("epoll_create1");
+        }
+        for ( int i = 0; i < 2; ++i ) {
+            epoll_event event{};
+            event.events = EPOLLIN;
+            event.data.fd = fds[i];
+            if ( ::epoll_ctl(fds[2], EPOLL_CTL_ADD, fds[i], &event) == -1 ) {
+                fail("epoll_ctl");
             }
         }
+        event_fd_ = fds[0];
+        timer_fd_ = fds[1];
+        wakeup_fd_.store(fds[2]);
+        if ( has_tasks_() ) {
+            signal_wakeup_();
+        }
+        arm_timer_fd_();
+        return fds[2];
+    #else
+        return -1;
+    #endif
+    }
+
+    template < typename QueuePolicy, typename TimerClock, bool Instrumented >
+    typename basic_scheduler<QueuePolicy, TimerClock, Instrumented>::processing_result_t
+    basic_scheduler<QueuePolicy, TimerClock, Instrumented>::process_pending_tasks() noexcept {
+        // anything arriving after the readiness is cleared signals again
+        consume_wakeup_();
+        std::size_t processed_tasks = 0;
+        frame_state frame;
+        std::unique_lock<std::mutex> lock(tasks_mutex_);
+        promote_timers_();
+        drain_inboxes_();
+        if ( !cancelled_ && !tasks_.empty() ) {
+            // one batch only, tasks scheduled meanwhile are left for the next
+            // readiness, so a task rescheduling itself cannot hold the caller
+            processed_tasks = process_batch_(std::move(lock), [this, &frame](
+                scheduler_priority priority,
+                task_ptr& task)
+            {
+                if ( cancelled_ ) {
+                    return false;
+                }
+                run_task_(priority, *task, frame);
+                return true;
+            });
+        } else {
+            lock.unlock();
+        }
+        record_call_(frame);
+        refresh_wakeup_();
         return std::make_pair(
             cancelled_
                 ? scheduler_processing_status::cancelled
@@ -215,108 +1021,531 @@ namespace scheduler_hpp
             processed_tasks);
     }
 
-    inline void scheduler::push_task_(scheduler_priority priority, task_ptr task) {
-        tasks_.emplace_back(priority, std::move(task));
-        std::push_heap(tasks_.begin(), tasks_.end());
+    template < typename QueuePolicy, typename TimerClock, bool Instrumented >
+    void basic_scheduler<QueuePolicy, TimerClock, Instrumented>::schedule_task_(scheduler_priority priority, task_ptr task) {
+        task->set_tag(current_category_);
+        if constexpr ( Instrumented ) {
+            task->set_stamp(to_stamp_(timer_clock::now()));
+            instrumentation_().backlog[static_cast<std::size_t>(priority)]
+                .fetch_add(1, std::memory_order_relaxed);
+        }
+        try {
+            // tasks scheduled by a running task are merged when it finishes,
+            // other consumers get them at once since the task may wait for them
+            if ( current_scheduler_ == this && !waiters_.load() && runners_.load() == 1 ) {
+                current_local_tasks_->emplace_back(priority, std::move(task));
+                return;
+            }
+            push_task_(priority, std::move(task));
+        } catch (...) {
+            release_backlog_(priority);
+            throw;
+        }
+    }
+
+    template < typename QueuePolicy, typename TimerClock, bool Instrumented >
+    void basic_scheduler<QueuePolicy, TimerClock, Instrumented>::push_task_(scheduler_priority priority, task_ptr task) {
         ++active_task_count_;
-        cond_var_.notify_one();
+        if ( inboxes_[static_cast<std::size_t>(priority)].push(std::move(task)) ) {
+            // only the first task after a drain has to make the descriptor readable
+            signal_wakeup_();
+        }
+        // the mutex is only taken to wake a consumer already waiting for tasks
+        if ( waiters_.load() ) {
+            std::lock_guard<std::mutex> guard(tasks_mutex_);
+            cond_var_.notify_one();
+        }
+    }
+
+    template < typename QueuePolicy, typename TimerClock, bool Instrumented >
+    typename basic_scheduler<QueuePolicy, TimerClock, Instrumented>::task_ptr
+    basic_scheduler<QueuePolicy, TimerClock, Instrumented>::pop_task_() noexcept {
+        return !tasks_.empty()
+            ? tasks_.pop()
+            : nullptr;
     }
 
-    inline scheduler::task_ptr scheduler::pop_task_() noexcept {
-        if ( !tasks_.empty() ) {
-            std::pop_heap(tasks_.begin(), tasks_.end());
-            task_ptr task = std::move(tasks_.back().second);
-            tasks_.pop_back();
-            return task;
+    template < typename QueuePolicy, typename TimerClock, bool Instrumented >
+    bool basic_scheduler<QueuePolicy, TimerClock, Instrumented>::has_tasks_() const noexcept {
+        return !tasks_.empty()
+            || std::any_of(inboxes_.begin(), inboxes_.end(), [](const auto& inbox){
+                return !inbox.empty();
+            });
+    }
+
+    template < typename QueuePolicy, typename TimerClock, bool Instrumented >
+    void basic_scheduler<QueuePolicy, TimerClock, Instrumented>::drain_inboxes_() noexcept {
+        for ( std::size_t i = inboxes_.size(); i > 0; --i ) {
+            const auto priority = static_cast<scheduler_priority>(i - 1);
+            try {
+                inboxes_[i - 1].drain([this, priority](task_ptr&& task){
+                    tasks_.push(priority, std::move(task));
+                });
+            } catch (...) {
+                // the rest stays in the inbox until the next drain
+            }
         }
-        return nullptr;
     }
 
-    inline void scheduler::shutdown_() noexcept {
+    template < typename QueuePolicy, typename TimerClock, bool Instrumented >
+    template < typename Predicate >
+    void basic_scheduler<QueuePolicy, TimerClock, Instrumented>::wait_tasks_(
+        std::unique_lock<std::mutex>& lock,
+        Predicate predicate)
+    {
+        ++waiters_;
+        cond_var_.wait(lock, predicate);
+        --waiters_;
+    }
+
+    template < typename QueuePolicy, typename TimerClock, bool Instrumented >
+    template < typename Clock, typename Duration, typename Predicate >
+    void basic_scheduler<QueuePolicy, TimerClock, Instrumented>::wait_tasks_until_(
+        std::unique_lock<std::mutex>& lock,
+        const std::chrono::time_point<Clock, Duration>& timeout_time,
+        Predicate predicate)
+    {
+        purge_timers_();
+        if constexpr ( is_virtual_clock_v<timer_clock> ) {
+            // nothing to run yet, so the clock jumps to the next timer or the timeout
+            if ( !predicate() ) {
+                const timer_time_point timeout = to_timer_time_(timeout_time);
+                timer_clock::advance_to(!timers_.empty() && timers_.front().due < timeout
+                    ? timers_.front().due
+                    : timeout);
+            }
+        } else {
+            // a due timer ends the wait early, and so does an earlier timer added meanwhile
+            const timer_time_point due = !timers_.empty()
+                ? timers_.front().due
+                : timer_time_point::max();
+            const auto wait_predicate = [this, &predicate, due](){
+                return predicate() || (!timers_.empty() && timers_.front().due < due);
+            };
+            ++waiters_;
+            if ( due != timer_time_point::max()
+                && Clock::now() + std::chrono::duration_cast<typename Clock::duration>(
+                    due - timer_clock::now()) < timeout_time )
+            {
+                cond_var_.wait_until(lock, due, wait_predicate);
+            } else {
+                cond_var_.wait_until(lock, timeout_time, wait_predicate);
+            }
+            --waiters_;
+        }
+    }
+
+    template < typename QueuePolicy, typename TimerClock, bool Instrumented >
+    void basic_scheduler<QueuePolicy, TimerClock, Instrumented>::shutdown_() noexcept {
         std::lock_guard<std::mutex> guard(tasks_mutex_);
+        const std::exception_ptr e = std::make_exception_ptr(
+            scheduler_cancelled_exception());
+        drain_inboxes_();
         while ( !tasks_.empty() ) {
+            const scheduler_priority priority = tasks_.top_priority();
             task_ptr task = pop_task_();
+            release_backlog_(priority);
             if ( task ) {
-                task->cancel();
+                task->cancel(e);
                 --active_task_count_;
             }
         }
+        for ( timer_entry& timer : timers_ ) {
+            timer.state->revoke(e);
+        }
+        timers_.clear();
+        timer_count_.store(0);
         cancelled_.store(true);
         cond_var_.notify_all();
     }
 
-    inline void scheduler::process_task_(std::unique_lock<std::mutex> lock) noexcept {
+    template < typename QueuePolicy, typename TimerClock, bool Instrumented >
+    void basic_scheduler<QueuePolicy, TimerClock, Instrumented>::process_task_(std::unique_lock<std::mutex> lock, frame_state& frame) noexcept {
         assert(lock.owns_lock());
+        const scheduler_priority priority = !tasks_.empty()
+            ? tasks_.top_priority()
+            : scheduler_priority::normal;
         task_ptr task = pop_task_();
         if ( task ) {
-            lock.unlock();
-            task->run();
-            lock.lock();
+            local_tasks_t local_tasks = run_unlocked_(lock, [this, priority, &task, &frame](){
+                run_task_(priority, *task, frame);
+            });
+            push_local_tasks_(local_tasks);
             --active_task_count_;
             cond_var_.notify_all();
         }
     }
-}
 
-namespace scheduler_hpp
-{
-    //
-    // concrete_task<R, F, Args...>
-    //
+    template < typename QueuePolicy, typename TimerClock, bool Instrumented >
+    template < typename Runner >
+    std::size_t basic_scheduler<QueuePolicy, TimerClock, Instrumented>::process_batch_(
+        std::unique_lock<std::mutex> lock,
+        Runner run_task) noexcept
+    {
+        assert(lock.owns_lock());
+        // the whole queue is taken at once, so the lock and the notify
+        // are paid once per batch instead of once per task
+        task_queue batch;
+        batch.swap(tasks_);
+        std::size_t processed_tasks = 0;
+        local_tasks_t local_tasks = run_unlocked_(
+            lock,
+            [&batch, &run_task, &processed_tasks](){
+                while ( !batch.empty() && run_task(batch.top_priority(), batch.top()) ) {
+                    batch.pop();
+                    ++processed_tasks;
+                }
+            });
+        if ( tasks_.empty() ) {
+            // keeps both the leftovers and the storage of the queue
+            tasks_.swap(batch);
+        }
+        while ( !batch.empty() ) {
+            const scheduler_priority priority = batch.top_priority();
+            task_ptr task = batch.pop();
+            try {
+                tasks_.push(priority, std::move(task));
+            } catch (...) {
+                if ( task ) {
+                    task->cancel(std::current_exception());
+                }
+                release_backlog_(priority);
+                --active_task_count_;
+            }
+        }
+        push_local_tasks_(local_tasks);
+        active_task_count_ -= processed_tasks;
+        cond_var_.notify_all();
+        return processed_tasks;
+    }
 
-    template < typename R, typename F, typename... Args >
-    template < typename U >
-    scheduler::concrete_task<R, F, Args...>::concrete_task(U&& u, std::tuple<Args...>&& args)
-    : f_(std::forward<U>(u))
-    , args_(std::move(args)) {}
+    template < typename QueuePolicy, typename TimerClock, bool Instrumented >
+    void basic_scheduler<QueuePolicy, TimerClock, Instrumented>::run_task_(
+        scheduler_priority priority,
+        task_queue_hpp::task& task,
+        frame_state& frame) noexcept
+    {
+        // only every few runs of a category are timed, the others are
+        // accounted with its average cost, instrumented schedulers time all
+        cost_slot& cost = cost_slots_[task.tag() % cost_slot_count_];
+        const std::uint32_t runs = cost.runs.fetch_add(1, std::memory_order_relaxed);
+        ++frame.stats.processed_tasks;
+        if ( !Instrumented && runs % cost_sample_period_ ) {
+            const std::chrono::nanoseconds average(cost.average.load(std::memory_order_relaxed));
+            task.run();
+            frame.now += std::chrono::duration_cast<timer_duration>(average);
+            frame.stats.busy_time += average;
+            ++frame.unmeasured_tasks;
+            return;
+        }
+        const timer_time_point run_begin = timer_clock::now();
+        task.run();
+        const timer_time_point run_end = timer_clock::now();
+        const std::chrono::nanoseconds run_duration =
+            std::chrono::duration_cast<std::chrono::nanoseconds>(run_end - run_begin);
+        const std::chrono::nanoseconds::rep average = cost.average.load(std::memory_order_relaxed);
+        cost.average.store(runs
+            ? average + (run_duration.count() - average) / 8
+            : run_duration.count(), std::memory_order_relaxed);
+        frame.now = run_end;
+        frame.unmeasured_tasks = 0;
+        frame.stats.busy_time += run_duration;
+        frame.stats.clock_reads += 2;
+        if constexpr ( Instrumented ) {
+            const std::size_t index = static_cast<std::size_t>(priority);
+            const std::uint32_t waited = to_stamp_(run_begin) - task.stamp();
+            release_backlog_(priority);
+            record_duration_(instrumentation_().wait_time[index], std::chrono::microseconds(waited));
+            record_duration_(instrumentation_().run_time[index], run_duration);
+        } else {
+            (void)priority;
+        }
+    }
 
-    template < typename R, typename F, typename... Args >
-    void scheduler::concrete_task<R, F, Args...>::run() noexcept {
-        try {
-            R value = std::apply(std::move(f_), std::move(args_));
-            promise_.resolve(std::move(value));
-        } catch (...) {
-            promise_.reject(std::current_exception());
+    template < typename QueuePolicy, typename TimerClock, bool Instrumented >
+    bool basic_scheduler<QueuePolicy, TimerClock, Instrumented>::run_budgeted_task_(
+        scheduler_priority priority,
+        task_queue_hpp::task& task,
+        frame_state& frame) noexcept
+    {
+        if ( frame.stats.processed_tasks ) {
+            const std::chrono::nanoseconds predicted(cost_slots_[task.tag() % cost_slot_count_]
+                .average.load(std::memory_order_relaxed));
+            if ( frame.unmeasured_tasks >= max_unmeasured_tasks_
+                || !(frame.now + predicted < frame.deadline) )
+            {
+                // the estimated time drifts with every unmeasured task,
+                // so a task is never deferred without reading the clock
+                if ( frame.unmeasured_tasks ) {
+                    frame.now = timer_clock::now();
+                    frame.unmeasured_tasks = 0;
+                    ++frame.stats.clock_reads;
+                }
+                if ( !(frame.now + predicted < frame.deadline) ) {
+                    ++frame.stats.deferred_tasks;
+                    frame.deferred = true;
+                    return false;
+                }
+            }
         }
+        run_task_(priority, task, frame);
+        return true;
     }
 
-    template < typename R, typename F, typename... Args >
-    void scheduler::concrete_task<R, F, Args...>::cancel() noexcept {
-        promise_.reject(scheduler_cancelled_exception());
+    template < typename QueuePolicy, typename TimerClock, bool Instrumented >
+    template < typename F >
+    typename basic_scheduler<QueuePolicy, TimerClock, Instrumented>::local_tasks_t
+    basic_scheduler<QueuePolicy, TimerClock, Instrumented>::run_unlocked_(
+        std::unique_lock<std::mutex>& lock,
+        F&& f) noexcept
+    {
+        assert(lock.owns_lock());
+        lock.unlock();
+        local_tasks_t local_tasks;
+        const basic_scheduler* prev_scheduler = std::exchange(
+            current_scheduler_, this);
+        local_tasks_t* prev_local_tasks = std::exchange(
+            current_local_tasks_, &local_tasks);
+        ++runners_;
+        f();
+        --runners_;
+        current_local_tasks_ = prev_local_tasks;
+        current_scheduler_ = prev_scheduler;
+        lock.lock();
+        return local_tasks;
     }
 
-    template < typename R, typename F, typename... Args >
-    promise<R> scheduler::concrete_task<R, F, Args...>::future() noexcept {
-        return promise_;
+    template < typename QueuePolicy, typename TimerClock, bool Instrumented >
+    void basic_scheduler<QueuePolicy, TimerClock, Instrumented>::push_local_tasks_(local_tasks_t& local_tasks) noexcept {
+        for ( auto& [priority, local_task] : local_tasks ) {
+            try {
+                tasks_.push(priority, std::move(local_task));
+                ++active_task_count_;
+            } catch (...) {
+                if ( local_task ) {
+                    local_task->cancel(std::current_exception());
+                }
+                release_backlog_(priority);
+            }
+        }
     }
 
-    //
-    // concrete_task<void, F, Args...>
-    //
+    template < typename QueuePolicy, typename TimerClock, bool Instrumented >
+    void basic_scheduler<QueuePolicy, TimerClock, Instrumented>::signal_wakeup_() noexcept {
+    #if defined(__linux__)
+        if ( wakeup_fd_.load() != -1 ) {
+            const std::uint64_t value = 1;
+            [[maybe_unused]] const ssize_t written = ::write(event_fd_, &value, sizeof(value));
+        }
+    #endif
+    }
 
-    template < typename F, typename... Args >
-    template < typename U >
-    scheduler::concrete_task<void, F, Args...>::concrete_task(U&& u, std::tuple<Args...>&& args)
-    : f_(std::forward<U>(u))
-    , args_(std::move(args)) {}
+    template < typename QueuePolicy, typename TimerClock, bool Instrumented >
+    void basic_scheduler<QueuePolicy, TimerClock, Instrumented>::consume_wakeup_() noexcept {
+    #if defined(__linux__)
+        if ( wakeup_fd_.load() != -1 ) {
+            std::uint64_t value = 0;
+            [[maybe_unused]] const ssize_t events = ::read(event_fd_, &value, sizeof(value));
+            [[maybe_unused]] const ssize_t expirations = ::read(timer_fd_, &value, sizeof(value));
+        }
+    #endif
+    }
 
-    template < typename F, typename... Args >
-    void scheduler::concrete_task<void, F, Args...>::run() noexcept {
-        try {
-            std::apply(std::move(f_), std::move(args_));
-            promise_.resolve();
-        } catch (...) {
-            promise_.reject(std::current_exception());
+    template < typename QueuePolicy, typename TimerClock, bool Instrumented >
+    void basic_scheduler<QueuePolicy, TimerClock, Instrumented>::refresh_wakeup_() noexcept {
+        // local, deferred and newly due work stays visible to the poller
+        if ( wakeup_fd_.load() == -1 ) {
+            return;
+        }
+        std::lock_guard<std::mutex> guard(tasks_mutex_);
+        if ( has_tasks_() ) {
+            signal_wakeup_();
+        }
+        arm_timer_fd_();
+    }
+
+    template < typename QueuePolicy, typename TimerClock, bool Instrumented >
+    void basic_scheduler<QueuePolicy, TimerClock, Instrumented>::arm_timer_fd_() noexcept {
+    #if defined(__linux__)
+        if ( wakeup_fd_.load() == -1 ) {
+            return;
+        }
+        // relative, so timer clocks other than the monotonic one work too
+        itimerspec spec{};
+        if ( !timers_.empty() ) {
+            const auto delay = std::max(
+                std::chrono::duration_cast<std::chrono::nanoseconds>(timers_.front().due - timer_clock::now()),
+                std::chrono::nanoseconds(1));
+            spec.it_value.tv_sec = static_cast<time_t>(
+                std::chrono::duration_cast<std::chrono::seconds>(delay).count());
+            spec.it_value.tv_nsec = static_cast<long>((delay % std::chrono::seconds(1)).count());
         }
+        [[maybe_unused]] const int armed = ::timerfd_settime(timer_fd_, 0, &spec, nullptr);
+    #endif
     }
 
-    template < typename F, typename... Args >
-    void scheduler::concrete_task<void, F, Args...>::cancel() noexcept {
-        promise_.reject(scheduler_cancelled_exception());
+    template < typename QueuePolicy, typename TimerClock, bool Instrumented >
+    void basic_scheduler<QueuePolicy, TimerClock, Instrumented>::push_timer_(
+        scheduler_priority priority,
+        timer_time_point due,
+        timer_duration period,
+        std::shared_ptr<task_queue_hpp::revocable_state> state)
+    {
+        std::lock_guard<std::mutex> guard(tasks_mutex_);
+        const std::uint64_t sequence = timer_sequence_++;
+        timers_.push_back(timer_entry{due, period, sequence, priority, current_category_, std::move(state)});
+        std::push_heap(timers_.begin(), timers_.end(), &basic_scheduler::timer_greater_);
+        ++timer_count_;
+        if ( timers_.front().sequence == sequence ) {
+            arm_timer_fd_();
+            cond_var_.notify_all();
+        }
+    }
+
+    template < typename QueuePolicy, typename TimerClock, bool Instrumented >
+    void basic_scheduler<QueuePolicy, TimerClock, Instrumented>::promote_timers_() noexcept {
+        purge_timers_();
+        if ( timers_.empty() ) {
+            return;
+        }
+        const timer_time_point now = timer_clock::now();
+        while ( !timers_.empty() && !(now < timers_.front().due) ) {
+            const timer_entry& timer = timers_.front();
+            if ( !timer.state->claimed() ) {
+                try {
+                    task_ptr task = timer.period == timer_duration::zero()
+                        ? task_ptr(std::make_unique<task_queue_hpp::revocable_task>(timer.state))
+                        : task_ptr(std::make_unique<task_queue_hpp::periodic_task>(timer.state));
+                    task->set_tag(timer.category);
+                    if constexpr ( Instrumented ) {
+                        // a timer has been waiting since it came due
+                        task->set_stamp(to_stamp_(timer.due));
+                    }
+                    tasks_.push(timer.priority, std::move(task));
+                    ++active_task_count_;
+                    if constexpr ( Instrumented ) {
+                        instrumentation_().backlog[static_cast<std::size_t>(timer.priority)]
+                            .fetch_add(1, std::memory_order_relaxed);
+                    }
+                } catch (...) {
+                    // the timer stays due until the next promotion
+                    return;
+                }
+            }
+            std::pop_heap(timers_.begin(), timers_.end(), &basic_scheduler::timer_greater_);
+            timer_entry& last = timers_.back();
+            if ( last.period != timer_duration::zero() && !last.state->claimed() ) {
+                last.due += last.period * ((now - last.due) / last.period + 1);
+                last.sequence = timer_sequence_++;
+                std::push_heap(timers_.begin(), timers_.end(), &basic_scheduler::timer_greater_);
+            } else {
+                timers_.pop_back();
+                --timer_count_;
+            }
+        }
+    }
+
+    template < typename QueuePolicy, typename TimerClock, bool Instrumented >
+    void basic_scheduler<QueuePolicy, TimerClock, Instrumented>::purge_timers_() noexcept {
+        // cancelled timers are dropped once they reach the front, so they do not
+        // hold the waits open, a cancel during a wait ends it at the timer's due
+        while ( !timers_.empty() && timers_.front().state->claimed() ) {
+            std::pop_heap(timers_.begin(), timers_.end(), &basic_scheduler::timer_greater_);
+            timers_.pop_back();
+            --timer_count_;
+        }
+    }
+
+    template < typename QueuePolicy, typename TimerClock, bool Instrumented >
+    template < typename Clock, typename Duration >
+    typename basic_scheduler<QueuePolicy, TimerClock, Instrumented>::timer_time_point
+    basic_scheduler<QueuePolicy, TimerClock, Instrumented>::to_timer_time_(
+        const std::chrono::time_point<Clock, Duration>& time)
+    {
+        // virtual time only moves by the waits of its own clock, so a deadline
+        // on another clock would never be reached and the waits would spin
+        static_assert(
+            std::is_same_v<Clock, timer_clock>
+            || !(is_virtual_clock_v<Clock> || is_virtual_clock_v<timer_clock>),
+            "virtual clocks can't be mixed with other clocks");
+        if constexpr ( std::is_same_v<Clock, timer_clock> ) {
+            return std::chrono::ceil<timer_duration>(time);
+        } else {
+            return timer_clock::now()
+                + std::chrono::ceil<timer_duration>(time - Clock::now());
+        }
+    }
+
+    template < typename QueuePolicy, typename TimerClock, bool Instrumented >
+    bool basic_scheduler<QueuePolicy, TimerClock, Instrumented>::timer_greater_(const timer_entry& l, const timer_entry& r) noexcept {
+        return l.due > r.due
+            || (l.due == r.due && l.sequence > r.sequence);
+    }
+
+    template < typename QueuePolicy, typename TimerClock, bool Instrumented >
+    void basic_scheduler<QueuePolicy, TimerClock, Instrumented>::record_call_(const frame_state& frame) noexcept {
+        if constexpr ( Instrumented ) {
+            instrumentation_().calls.fetch_add(1, std::memory_order_relaxed);
+            if ( frame.stats.budget > std::chrono::nanoseconds::zero()
+                && frame.stats.busy_time > frame.stats.budget )
+            {
+                instrumentation_().over_budget_calls.fetch_add(1, std::memory_order_relaxed);
+            }
+            record_duration_(instrumentation_().call_time, frame.stats.busy_time);
+            std::lock_guard<std::mutex> guard(tasks_mutex_);
+            instrumentation_().last_call = frame.stats;
+        } else {
+            (void)frame;
+        }
+    }
+
+    template < typename QueuePolicy, typename TimerClock, bool Instrumented >
+    typename basic_scheduler<QueuePolicy, TimerClock, Instrumented>::instrumentation_state&
+    basic_scheduler<QueuePolicy, TimerClock, Instrumented>::instrumentation_() noexcept {
+        return *this;
+    }
+
+    template < typename QueuePolicy, typename TimerClock, bool Instrumented >
+    const typename basic_scheduler<QueuePolicy, TimerClock, Instrumented>::instrumentation_state&
+    basic_scheduler<QueuePolicy, TimerClock, Instrumented>::instrumentation_() const noexcept {
+        return *this;
+    }
+
+    template < typename QueuePolicy, typename TimerClock, bool Instrumented >
+    void basic_scheduler<QueuePolicy, TimerClock, Instrumented>::release_backlog_(scheduler_priority priority) noexcept {
+        if constexpr ( Instrumented ) {
+            instrumentation_().backlog[static_cast<std::size_t>(priority)]
+                .fetch_sub(1, std::memory_order_relaxed);
+        } else {
+            (void)priority;
+        }
+    }
+
+    template < typename QueuePolicy, typename TimerClock, bool Instrumented >
+    void basic_scheduler<QueuePolicy, TimerClock, Instrumented>::record_duration_(
+        histogram_counters& histogram,
+        std::chrono::nanoseconds duration) noexcept
+    {
+        std::size_t bucket = 0;
+        for ( auto count = duration.count(); count > 0 && bucket + 1 < histogram.buckets.size(); count >>= 1 ) {
+            ++bucket;
+        }
+        histogram.buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+    }
+
+    template < typename QueuePolicy, typename TimerClock, bool Instrumented >
+    scheduler_histogram basic_scheduler<QueuePolicy, TimerClock, Instrumented>::load_histogram_(const histogram_counters& histogram) noexcept {
+        scheduler_histogram snapshot;
+        for ( std::size_t i = 0; i < snapshot.buckets.size(); ++i ) {
+            snapshot.buckets[i] = histogram.buckets[i].load(std::memory_order_relaxed);
+        }
+        return snapshot;
     }
 
-    template < typename F, typename... Args >
-    promise<void> scheduler::concrete_task<void, F, Args...>::future() noexcept {
-        return promise_;
+    template < typename QueuePolicy, typename TimerClock, bool Instrumented >
+    std::uint32_t basic_scheduler<QueuePolicy, TimerClock, Instrumented>::to_stamp_(timer_time_point time) noexcept {
+        // microseconds modulo 2^32, waits up to an hour are measured exactly
+        return static_cast<std::uint32_t>(std::chrono::duration_cast<std::chrono::microseconds>(
+            time.time_since_epoch()).count());
     }
 }
@@ -0,0 +1,1062 @@
+/*******************************************************************************
+ * This file is part of the "https://github.com/blackmatov/promise.hpp"
+ * For conditions of distribution and use, see copyright notice in LICENSE.md
+ * Copyright (C) 2018-2023, by Matvey Cherevko (blackmatov@gmail.com)
+ ******************************************************************************/
+
+#pragma once
+
+#include "../promise.hpp"
+
+#include <array>
+#include <deque>
+#include <chrono>
+#include <optional>
+#include <algorithm>
+
+namespace task_queue_hpp
+{
+    using namespace promise_hpp;
+
+    //
+    // task
+    //
+
+    class task : private detail::noncopyable {
+    public:
+        virtual ~task() noexcept = default;
+        virtual void run() noexcept = 0;
+        virtual void cancel(std::exception_ptr e) noexcept = 0;
+        virtual bool yielded() const noexcept { return false; }
+
+        const char* label() const noexcept { return label_; }
+        void set_label(const char* label) noexcept { label_ = label; }
+
+        std::uint32_t tag() const noexcept { return tag_; }
+        void set_tag(std::uint32_t tag) noexcept { tag_ = tag; }
+
+        // When the task was queued, in the front end's own wrapping units.
+        std::uint32_t stamp() const noexcept { return stamp_; }
+        void set_stamp(std::uint32_t stamp) noexcept { stamp_ = stamp; }
+    private:
+        friend class task_inbox;
+        const char* label_{nullptr};
+        std::uint32_t tag_{0};
+        std::uint32_t stamp_{0};
+        task* inbox_next_{nullptr};
+    };
+
+    using task_ptr = std::unique_ptr<task>;
+
+    //
+    // task_inbox
+    //
+    // An intrusive lock-free stack for many producers and one consumer.
+    // The consumer takes the whole stack with one exchange and reverses it,
+    // so tasks come out in the order they were pushed.
+    //
+
+    class task_inbox final : private detail::noncopyable {
+    public:
+        task_inbox() = default;
+        ~task_inbox() noexcept;
+
+        bool empty() const noexcept;
+        bool push(task_ptr value) noexcept;
+
+        template < typename F >
+        std::size_t drain(F&& f);
+    private:
+        static task* reverse_(task* head) noexcept;
+    private:
+        std::atomic<task*> head_{nullptr};
+        task* pending_{nullptr};
+    };
+
+    //
+    // task_ring
+    //
+    // A bounded lock-free ring for one producer and one consumer.
+    // Each side caches the other's index, so a push or a pop usually
+    // touches only its own cache line.
+    //
+
+    class task_ring final : private detail::noncopyable {
+    public:
+        explicit task_ring(std::size_t capacity);
+        ~task_ring() noexcept;
+
+        bool empty() const noexcept;
+        std::size_t capacity() const noexcept;
+
+        bool try_push(task_ptr& value) noexcept;
+        task_ptr try_pop() noexcept;
+    private:
+        std::vector<task*> slots_;
+        std::size_t mask_{0};
+        alignas(64) std::atomic<std::size_t> head_{0};
+        std::size_t cached_tail_{0};
+        alignas(64) std::atomic<std::size_t> tail_{0};
+        std::size_t cached_head_{0};
+    };
+
+    template < typename R, typename F, typename... Args >
+    class concrete_task final : public task {
+        F f_;
+        std::tuple<Args...> args_;
+        promise<R> promise_;
+    public:
+        template < typename U >
+        concrete_task(U&& u, std::tuple<Args...>&& args);
+        void run() noexcept final;
+        void cancel(std::exception_ptr e) noexcept final;
+        promise<R> future() noexcept;
+    };
+
+    template < typename F, typename... Args >
+    class concrete_task<void, F, Args...> final : public task {
+        F f_;
+        std::tuple<Args...> args_;
+        promise<void> promise_;
+    public:
+        template < typename U >
+        concrete_task(U&& u, std::tuple<Args...>&& args);
+        void run() noexcept final;
+        void cancel(std::exception_ptr e) noexcept final;
+        promise<void> future() noexcept;
+    };
+
+    //
+    // revocable tasks
+    //
+    // The queued revocable_task is only a tombstone sharing the state with
+    // the caller. Whoever claims the state first either runs or revokes it,
+    // so revoking is O(1) and frees the function and its arguments at once.
+    //
+
+    class revocable_state : private detail::noncopyable {
+    public:
+        virtual ~revocable_state() noexcept = default;
+        bool claim() noexcept;
+        bool claimed() const noexcept;
+        bool revoke(std::exception_ptr e) noexcept;
+        virtual void run() noexcept = 0;
+    protected:
+        virtual void release(std::exception_ptr e) noexcept = 0;
+    private:
+        std::atomic<bool> claimed_{false};
+    };
+
+    template < typename R, typename F, typename... Args >
+    class concrete_revocable_state final : public revocable_state {
+        std::optional<F> f_;
+        std::optional<std::tuple<Args...>> args_;
+        promise<R> promise_;
+    public:
+        template < typename U >
+        concrete_revocable_state(U&& u, std::tuple<Args...>&& args);
+        void run() noexcept final;
+        promise<R> future() noexcept;
+    protected:
+        void release(std::exception_ptr e) noexcept final;
+    };
+
+    class revocable_task final : public task {
+        std::shared_ptr<revocable_state> state_;
+    public:
+        explicit revocable_task(std::shared_ptr<revocable_state> state) noexcept;
+        void run() noexcept final;
+        void cancel(std::exception_ptr e) noexcept final;
+    };
+
+    //
+    // periodic tasks
+    //
+    // A periodic state runs until it is revoked, by a cancel or by its own
+    // exception. Every tick is a separate periodic_task sharing the state.
+    // The function is only released with the state, so a tick may still be
+    // running while another thread revokes it.
+    //
+
+    template < typename F, typename... Args >
+    class concrete_periodic_state final : public revocable_state {
+        F f_;
+        std::tuple<Args...> args_;
+        promise<void> promise_;
+    public:
+        template < typename U >
+        concrete_periodic_state(U&& u, std::tuple<Args...>&& args);
+        void run() noexcept final;
+        promise<void> future() noexcept;
+    protected:
+        void release(std::exception_ptr e) noexcept final;
+    };
+
+    class periodic_task final : public task {
+        std::shared_ptr<revocable_state> state_;
+    public:
+        explicit periodic_task(std::shared_ptr<revocable_state> state) noexcept;
+        void run() noexcept final;
+        void cancel(std::exception_ptr e) noexcept final;
+    };
+
+    //
+    // queue policies
+    //
+    // Every policy provides a `queue<Priority, Value>` template with
+    // `empty`, `size`, `top_priority`, `top`, `push`, `pop` and `swap`. The heap,
+    // FIFO, LIFO and MPMC policies pop higher priorities first and differ in
+    // the order of equal ones, the EDF policy pops the earliest deadline first.
+    // Priority must be an enum with values from zero to Priority::highest.
+    //
+
+    struct priority_heap_policy {
+        template < typename Priority, typename Value >
+        class queue;
+    };
+
+    struct priority_fifo_policy {
+        template < typename Priority, typename Value >
+        class queue;
+    };
+
+    struct priority_lifo_policy {
+        template < typename Priority, typename Value >
+        class queue;
+    };
+
+    // A task is due `highest_budget << (highest - priority)` after its push,
+    // so a waiting lower priority task eventually runs before fresh higher ones.
+    struct earliest_deadline_policy {
+        static constexpr std::chrono::microseconds highest_budget{1000};
+
+        template < typename Priority, typename Value >
+        class queue;
+    };
+
+    // Per-priority bounded lock-free rings with a locked overflow list.
+    // Any thread may push and `try_pop` concurrently, the rest of the
+    // interface expects the consumers to be serialized by the front end.
+    template < std::size_t Capacity = 256 >
+    struct mpmc_fifo_policy {
+        static_assert(Capacity > 1 && !(Capacity & (Capacity - 1)),
+            "Capacity must be a power of two");
+
+        template < typename Priority, typename Value >
+        class queue;
+    };
+
+    template < typename Priority >
+    inline constexpr std::size_t priority_count_v =
+        static_cast<std::size_t>(Priority::highest) + 1;
+
+    template < typename Priority, typename Value >
+    class priority_heap_policy::queue final {
+    public:
+        bool empty() const noexcept;
+        std::size_t size() const noexcept;
+        Priority top_priority() const noexcept;
+        Value& top() noexcept;
+        void push(Priority priority, Value value);
+        Value pop() noexcept;
+        void swap(queue& other) noexcept;
+    private:
+        static bool less_(
+            const std::pair<Priority, Value>& l,
+            const std::pair<Priority, Value>& r) noexcept;
+    private:
+        std::vector<std::pair<Priority, Value>> values_;
+    };
+
+    template < typename Priority, typename Value >
+    class priority_fifo_policy::queue final {
+    public:
+        bool empty() const noexcept;
+        std::size_t size() const noexcept;
+        Priority top_priority() const noexcept;
+        Value& top() noexcept;
+        void push(Priority priority, Value value);
+        Value pop() noexcept;
+        void swap(queue& other) noexcept;
+    private:
+        std::array<std::deque<Value>, priority_count_v<Priority>> values_;
+        std::size_t size_{0};
+    };
+
+    template < typename Priority, typename Value >
+    class priority_lifo_policy::queue final {
+    public:
+        bool empty() const noexcept;
+        std::size_t size() const noexcept;
+        Priority top_priority() const noexcept;
+        Value& top() noexcept;
+        void push(Priority priority, Value value);
+        Value pop() noexcept;
+        void swap(queue& other) noexcept;
+    private:
+        std::array<std::vector<Value>, priority_count_v<Priority>> values_;
+        std::size_t size_{0};
+    };
+
+    template < typename Priority, typename Value >
+    class earliest_deadline_policy::queue final {
+    public:
+        bool empty() const noexcept;
+        std::size_t size() const noexcept;
+        Priority top_priority() const noexcept;
+        Value& top() noexcept;
+        void push(Priority priority, Value value);
+        Value pop() noexcept;
+        void swap(queue& other) noexcept;
+    private:
+        struct entry {
+            std::chrono::steady_clock::time_point deadline;
+            std::uint64_t sequence{0};
+            Priority priority;
+            Value value;
+        };
+        static bool later_(const entry& l, const entry& r) noexcept;
+    private:
+        std::vector<entry> values_;
+        std::uint64_t sequence_{0};
+    };
+
+    template < std::size_t Capacity >
+    template < typename Priority, typename Value >
+    class mpmc_fifo_policy<Capacity>::queue final : private detail::noncopyable {
+    public:
+        queue() = default;
+        ~queue() noexcept;
+
+        bool empty() const noexcept;
+        std::size_t size() const noexcept;
+        Priority top_priority() const noexcept;
+        Value& top() noexcept;
+        void push(Priority priority, Value value);
+        Value pop() noexcept;
+        bool try_pop(Value& value) noexcept;
+        void swap(queue& other) noexcept;
+    private:
+        struct cell {
+            std::atomic<std::size_t> sequence{0};
+            Value value{};
+        };
+
+        struct ring {
+            ring() noexcept;
+            std::array<cell, Capacity> cells;
+            alignas(64) std::atomic<std::size_t> enqueue_pos{0};
+            alignas(64) std::atomic<std::size_t> dequeue_pos{0};
+            alignas(64) std::atomic<std::size_t> size{0};
+            std::atomic<std::size_t> overflow_size{0};
+            std::mutex overflow_mutex;
+            std::deque<Value> overflow;
+        };
+
+        ring& ring_(Priority priority);
+        static bool try_push_(ring& r, Value& value) noexcept;
+        static bool try_pop_(ring& r, Value& value) noexcept;
+        static bool pop_overflow_(ring& r, Value& value) noexcept;
+    private:
+        std::array<std::atomic<ring*>, priority_count_v<Priority>> rings_{};
+        std::atomic<std::size_t> size_{0};
+    };
+}
+
+namespace task_queue_hpp
+{
+    //
+    // concrete_task<R, F, Args...>
+    //
+
+    template < typename R, typename F, typename... Args >
+    template < typename U >
+    concrete_task<R, F, Args...>::concrete_task(U&& u, std::tuple<Args...>&& args)
+    : f_(std::forward<U>(u))
+    , args_(std::move(args)) {}
+
+    template < typename R, typename F, typename... Args >
+    void concrete_task<R, F, Args...>::run() noexcept {
+        try {
+            R value = std::apply(std::move(f_), std::move(args_));
+            promise_.resolve(std::move(value));
+        } catch (...) {
+            promise_.reject(std::current_exception());
+        }
+    }
+
+    template < typename R, typename F, typename... Args >
+    void concrete_task<R, F, Args...>::cancel(std::exception_ptr e) noexcept {
+        promise_.reject(e);
+    }
+
+    template < typename R, typename F, typename... Args >
+    promise<R> concrete_task<R, F, Args...>::future() noexcept {
+        return promise_;
+    }
+
+    //
+    // concrete_task<void, F, Args...>
+    //
+
+    template < typename F, typename... Args >
+    template < typename U >
+    concrete_task<void, F, Args...>::concrete_task(U&& u, std::tuple<Args...>&& args)
+    : f_(std::forward<U>(u))
+    , args_(std::move(args)) {}
+
+    template < typename F, typename... Args >
+    void concrete_task<void, F, Args...>::run() noexcept {
+        try {
+            std::apply(std::move(f_), std::move(args_));
+            promise_.resolve();
+        } catch (...) {
+            promise_.reject(std::current_exception());
+        }
+    }
+
+    template < typename F, typename... Args >
+    void concrete_task<void, F, Args...>::cancel(std::exception_ptr e) noexcept {
+        promise_.reject(e);
+    }
+
+    template < typename F, typename... Args >
+    promise<void> concrete_task<void, F, Args...>::future() noexcept {
+        return promise_;
+    }
+
+    //
+    // task_inbox
+    //
+
+    inline task_inbox::~task_inbox() noexcept {
+        drain([](task_ptr){});
+    }
+
+    inline bool task_inbox::empty() const noexcept {
+        return !pending_ && !head_.load();
+    }
+
+    inline bool task_inbox::push(task_ptr value) noexcept {
+        // the node belongs to the consumer as soon as it is published,
+        // so the previous head is kept in a local
+        task* node = value.release();
+        task* next = head_.load(std::memory_order_relaxed);
+        do {
+            node->inbox_next_ = next;
+        } while ( !head_.compare_exchange_weak(next, node) );
+        return !next;
+    }
+
+    template < typename F >
+    std::size_t task_inbox::drain(F&& f) {
+        // tasks left over by a throwing callback are kept for the next drain
+        if ( !pending_ ) {
+            pending_ = reverse_(head_.exchange(nullptr));
+        }
+        std::size_t count = 0;
+        while ( pending_ ) {
+            task_ptr node(pending_);
+            pending_ = std::exchange(node->inbox_next_, nullptr);
+            try {
+                f(std::move(node));
+            } catch (...) {
+                if ( node ) {
+                    node->inbox_next_ = std::exchange(pending_, node.release());
+                }
+                throw;
+            }
+            ++count;
+        }
+        return count;
+    }
+
+    inline task* task_inbox::reverse_(task* head) noexcept {
+        task* reversed = nullptr;
+        while ( head ) {
+            task* next = std::exchange(head->inbox_next_, reversed);
+            reversed = std::exchange(head, next);
+        }
+        return reversed;
+    }
+
+    //
+    // task_ring
+    //
+
+    inline task_ring::task_ring(std::size_t capacity) {
+        std::size_t size = 1;
+        while ( size < capacity ) {
+            size <<= 1u;
+        }
+        slots_.resize(size, nullptr);
+        mask_ = size - 1;
+    }
+
+    inline task_ring::~task_ring() noexcept {
+        while ( try_pop() ) {}
+    }
+
+    inline bool task_ring::empty() const noexcept {
+        return head_.load() == tail_.load();
+    }
+
+    inline std::size_t task_ring::capacity() const noexcept {
+        return slots_.size();
+    }
+
+    inline bool task_ring::try_push(task_ptr& value) noexcept {
+        const std::size_t tail = tail_.load(std::memory_order_relaxed);
+        if ( tail - cached_head_ == slots_.size() ) {
+            cached_head_ = head_.load(std::memory_order_acquire);
+            if ( tail - cached_head_ == slots_.size() ) {
+                return false;
+            }
+        }
+        slots_[tail & mask_] = value.release();
+        tail_.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    inline task_ptr task_ring::try_pop() noexcept {
+        const std::size_t head = head_.load(std::memory_order_relaxed);
+        if ( head == cached_tail_ ) {
+            cached_tail_ = tail_.load(std::memory_order_acquire);
+            if ( head == cached_tail_ ) {
+                return nullptr;
+            }
+        }
+        task_ptr value(std::exchange(slots_[head & mask_], nullptr));
+        head_.store(head + 1, std::memory_order_release);
+        return value;
+    }
+
+    //
+    // revocable_state
+    //
+
+    inline bool revocable_state::claim() noexcept {
+        return !claimed_.exchange(true);
+    }
+
+    inline bool revocable_state::claimed() const noexcept {
+        return claimed_.load();
+    }
+
+    inline bool revocable_state::revoke(std::exception_ptr e) noexcept {
+        if ( !claim() ) {
+            return false;
+        }
+        release(e);
+        return true;
+    }
+
+    //
+    // concrete_revocable_state<R, F, Args...>
+    //
+
+    template < typename R, typename F, typename... Args >
+    template < typename U >
+    concrete_revocable_state<R, F, Args...>::concrete_revocable_state(U&& u, std::tuple<Args...>&& args)
+    : f_(std::forward<U>(u))
+    , args_(std::move(args)) {}
+
+    template < typename R, typename F, typename... Args >
+    void concrete_revocable_state<R, F, Args...>::run() noexcept {
+        try {
+            if constexpr ( std::is_void_v<R> ) {
+                std::apply(std::move(*f_), std::move(*args_));
+                f_.reset();
+                args_.reset();
+                promise_.resolve();
+            } else {
+                R value = std::apply(std::move(*f_), std::move(*args_));
+                f_.reset();
+                args_.reset();
+                promise_.resolve(std::move(value));
+            }
+        } catch (...) {
+            release(std::current_exception());
+        }
+    }
+
+    template < typename R, typename F, typename... Args >
+    promise<R> concrete_revocable_state<R, F, Args...>::future() noexcept {
+        return promise_;
+    }
+
+    template < typename R, typename F, typename... Args >
+    void concrete_revocable_state<R, F, Args...>::release(std::exception_ptr e) noexcept {
+        f_.reset();
+        args_.reset();
+        promise_.reject(e);
+    }
+
+    //
+    // revocable_task
+    //
+
+    inline revocable_task::revocable_task(std::shared_ptr<revocable_state> state) noexcept
+    : state_(std::move(state)) {}
+
+    inline void revocable_task::run() noexcept {
+        if ( state_->claim() ) {
+            state_->run();
+        }
+    }
+
+    inline void revocable_task::cancel(std::exception_ptr e) noexcept {
+        state_->revoke(e);
+    }
+
+    //
+    // concrete_periodic_state<F, Args...>
+    //
+
+    template < typename F, typename... Args >
+    template < typename U >
+    concrete_periodic_state<F, Args...>::concrete_periodic_state(U&& u, std::tuple<Args...>&& args)
+    : f_(std::forward<U>(u))
+    , args_(std::move(args)) {}
+
+    template < typename F, typename... Args >
+    void concrete_periodic_state<F, Args...>::run() noexcept {
+        try {
+            std::apply(f_, args_);
+        } catch (...) {
+            revoke(std::current_exception());
+        }
+    }
+
+    template < typename F, typename... Args >
+    promise<void> concrete_periodic_state<F, Args...>::future() noexcept {
+        return promise_;
+    }
+
+    template < typename F, typename... Args >
+    void concrete_periodic_state<F, Args...>::release(std::exception_ptr e) noexcept {
+        promise_.reject(e);
+    }
+
+    //
+    // periodic_task
+    //
+
+    inline periodic_task::periodic_task(std::shared_ptr<revocable_state> state) noexcept
+    : state_(std::move(state)) {}
+
+    inline void periodic_task::run() noexcept {
+        if ( !state_->claimed() ) {
+            state_->run();
+        }
+    }
+
+    inline void periodic_task::cancel(std::exception_ptr e) noexcept {
+        state_->revoke(e);
+    }
+}
+
+namespace task_queue_hpp
+{
+    //
+    // priority_heap_policy::queue<Priority, Value>
+    //
+
+    template < typename Priority, typename Value >
+    bool priority_heap_policy::queue<Priority, Value>::empty() const noexcept {
+        return values_.empty();
+    }
+
+    template < typename Priority, typename Value >
+    std::size_t priority_heap_policy::queue<Priority, Value>::size() const noexcept {
+        return values_.size();
+    }
+
+    template < typename Priority, typename Value >
+    Priority priority_heap_policy::queue<Priority, Value>::top_priority() const noexcept {
+        assert(!values_.empty());
+        return values_.front().first;
+    }
+
+    template < typename Priority, typename Value >
+    Value& priority_heap_policy::queue<Priority, Value>::top() noexcept {
+        assert(!values_.empty());
+        return values_.front().second;
+    }
+
+    template < typename Priority, typename Value >
+    void priority_heap_policy::queue<Priority, Value>::push(Priority priority, Value value) {
+        values_.emplace_back(priority, std::move(value));
+        std::push_heap(values_.begin(), values_.end(), &queue::less_);
+    }
+
+    template < typename Priority, typename Value >
+    Value priority_heap_policy::queue<Priority, Value>::pop() noexcept {
+        assert(!values_.empty());
+        std::pop_heap(values_.begin(), values_.end(), &queue::less_);
+        Value value = std::move(values_.back().second);
+        values_.pop_back();
+        return value;
+    }
+
+    template < typename Priority, typename Value >
+    void priority_heap_policy::queue<Priority, Value>::swap(queue& other) noexcept {
+        values_.swap(other.values_);
+    }
+
+    template < typename Priority, typename Value >
+    bool priority_heap_policy::queue<Priority, Value>::less_(
+        const std::pair<Priority, Value>& l,
+        const std::pair<Priority, Value>& r) noexcept
+    {
+        return l.first < r.first;
+    }
+
+    //
+    // priority_fifo_policy::queue<Priority, Value>
+    //
+
+    template < typename Priority, typename Value >
+    bool priority_fifo_policy::queue<Priority, Value>::empty() const noexcept {
+        return !size_;
+    }
+
+    template < typename Priority, typename Value >
+    std::size_t priority_fifo_policy::queue<Priority, Value>::size() const noexcept {
+        return size_;
+    }
+
+    template < typename Priority, typename Value >
+    Priority priority_fifo_policy::queue<Priority, Value>::top_priority() const noexcept {
+        assert(size_);
+        std::size_t i = values_.size() - 1;
+        while ( values_[i].empty() ) {
+            --i;
+        }
+        return static_cast<Priority>(i);
+    }
+
+    template < typename Priority, typename Value >
+    Value& priority_fifo_policy::queue<Priority, Value>::top() noexcept {
+        return values_[static_cast<std::size_t>(top_priority())].front();
+    }
+
+    template < typename Priority, typename Value >
+    void priority_fifo_policy::queue<Priority, Value>::push(Priority priority, Value value) {
+        values_[static_cast<std::size_t>(priority)].push_back(std::move(value));
+        ++size_;
+    }
+
+    template < typename Priority, typename Value >
+    Value priority_fifo_policy::queue<Priority, Value>::pop() noexcept {
+        std::deque<Value>& values = values_[static_cast<std::size_t>(top_priority())];
+        Value value = std::move(values.front());
+        values.pop_front();
+        --size_;
+        return value;
+    }
+
+    template < typename Priority, typename Value >
+    void priority_fifo_policy::queue<Priority, Value>::swap(queue& other) noexcept {
+        for ( std::size_t i = 0; i < values_.size(); ++i ) {
+            values_[i].swap(other.values_[i]);
+        }
+        std::swap(size_, other.size_);
+    }
+
+    //
+    // priority_lifo_policy::queue<Priority, Value>
+    //
+
+    template < typename Priority, typename Value >
+    bool priority_lifo_policy::queue<Priority, Value>::empty() const noexcept {
+        return !size_;
+    }
+
+    template < typename Priority, typename Value >
+    std::size_t priority_lifo_policy::queue<Priority, Value>::size() const noexcept {
+        return size_;
+    }
+
+    template < typename Priority, typename Value >
+    Priority priority_lifo_policy::queue<Priority, Value>::top_priority() const noexcept {
+        assert(size_);
+        std::size_t i = values_.size() - 1;
+        while ( values_[i].empty() ) {
+            --i;
+        }
+        return static_cast<Priority>(i);
+    }
+
+    template < typename Priority, typename Value >
+    Value& priority_lifo_policy::queue<Priority, Value>::top() noexcept {
+        return values_[static_cast<std::size_t>(top_priority())].back();
+    }
+
+    template < typename Priority, typename Value >
+    void priority_lifo_policy::queue<Priority, Value>::push(Priority priority, Value value) {
+        values_[static_cast<std::size_t>(priority)].push_back(std::move(value));
+        ++size_;
+    }
+
+    template < typename Priority, typename Value >
+    Value priority_lifo_policy::queue<Priority, Value>::pop() noexcept {
+        std::vector<Value>& values = values_[static_cast<std::size_t>(top_priority())];
+        Value value = std::move(values.back());
+        values.pop_back();
+        --size_;
+        return value;
+    }
+
+    template < typename Priority, typename Value >
+    void priority_lifo_policy::queue<Priority, Value>::swap(queue& other) noexcept {
+        for ( std::size_t i = 0; i < values_.size(); ++i ) {
+            values_[i].swap(other.values_[i]);
+        }
+        std::swap(size_, other.size_);
+    }
+
+    //
+    // earliest_deadline_policy::queue<Priority, Value>
+    //
+
+    template < typename Priority, typename Value >
+    bool earliest_deadline_policy::queue<Priority, Value>::empty() const noexcept {
+        return values_.empty();
+    }
+
+    template < typename Priority, typename Value >
+    std::size_t earliest_deadline_policy::queue<Priority, Value>::size() const noexcept {
+        return values_.size();
+    }
+
+    template < typename Priority, typename Value >
+    Priority earliest_deadline_policy::queue<Priority, Value>::top_priority() const noexcept {
+        assert(!values_.empty());
+        return values_.front().priority;
+    }
+
+    template < typename Priority, typename Value >
+    Value& earliest_deadline_policy::queue<Priority, Value>::top() noexcept {
+        assert(!values_.empty());
+        return values_.front().value;
+    }
+
+    template < typename Priority, typename Value >
+    void earliest_deadline_policy::queue<Priority, Value>::push(Priority priority, Value value) {
+        const std::size_t shift = priority_count_v<Priority> - 1 - static_cast<std::size_t>(priority);
+        const auto deadline = std::chrono::steady_clock::now() + highest_budget * (std::int64_t(1) << shift);
+        values_.push_back(entry{deadline, ++sequence_, priority, std::move(value)});
+        std::push_heap(values_.begin(), values_.end(), &queue::later_);
+    }
+
+    template < typename Priority, typename Value >
+    Value earliest_deadline_policy::queue<Priority, Value>::pop() noexcept {
+        assert(!values_.empty());
+        std::pop_heap(values_.begin(), values_.end(), &queue::later_);
+        Value value = std::move(values_.back().value);
+        values_.pop_back();
+        return value;
+    }
+
+    template < typename Priority, typename Value >
+    void earliest_deadline_policy::queue<Priority, Value>::swap(queue& other) noexcept {
+        values_.swap(other.values_);
+        std::swap(sequence_, other.sequence_);
+    }
+
+    template < typename Priority, typename Value >
+    bool earliest_deadline_policy::queue<Priority, Value>::later_(const entry& l, const entry& r) noexcept {
+        return l.deadline != r.deadline
+            ? l.deadline > r.deadline
+            : l.sequence > r.sequence;
+    }
+
+    //
+    // mpmc_fifo_policy::queue<Priority, Value>
+    //
+
+    template < std::size_t Capacity >
+    template < typename Priority, typename Value >
+    mpmc_fifo_policy<Capacity>::queue<Priority, Value>::ring::ring() noexcept {
+        for ( std::size_t i = 0; i < Capacity; ++i ) {
+            cells[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    template < std::size_t Capacity >
+    template < typename Priority, typename Value >
+    mpmc_fifo_policy<Capacity>::queue<Priority, Value>::~queue() noexcept {
+        for ( std::atomic<ring*>& r : rings_ ) {
+            delete r.load(std::memory_order_relaxed);
+        }
+    }
+
+    template < std::size_t Capacity >
+    template < typename Priority, typename Value >
+    bool mpmc_fifo_policy<Capacity>::queue<Priority, Value>::empty() const noexcept {
+        return !size_.load(std::memory_order_acquire);
+    }
+
+    template < std::size_t Capacity >
+    template < typename Priority, typename Value >
+    std::size_t mpmc_fifo_policy<Capacity>::queue<Priority, Value>::size() const noexcept {
+        return size_.load(std::memory_order_acquire);
+    }
+
+    template < std::size_t Capacity >
+    template < typename Priority, typename Value >
+    Priority mpmc_fifo_policy<Capacity>::queue<Priority, Value>::top_priority() const noexcept {
+        assert(!empty());
+        std::size_t i = rings_.size() - 1;
+        while ( i > 0 ) {
+            const ring* r = rings_[i].load(std::memory_order_acquire);
+            if ( r && r->size.load(std::memory_order_acquire) ) {
+                break;
+            }
+            --i;
+        }
+        return static_cast<Priority>(i);
+    }
+
+    template < std::size_t Capacity >
+    template < typename Priority, typename Value >
+    Value& mpmc_fifo_policy<Capacity>::queue<Priority, Value>::top() noexcept {
+        ring& r = *rings_[static_cast<std::size_t>(top_priority())].load(std::memory_order_acquire);
+        const std::size_t pos = r.dequeue_pos.load(std::memory_order_relaxed);
+        cell& c = r.cells[pos & (Capacity - 1)];
+        if ( c.sequence.load(std::memory_order_acquire) == pos + 1 ) {
+            return c.value;
+        }
+        std::lock_guard<std::mutex> guard(r.overflow_mutex);
+        assert(!r.overflow.empty());
+        return r.overflow.front();
+    }
+
+    template < std::size_t Capacity >
+    template < typename Priority, typename Value >
+    void mpmc_fifo_policy<Capacity>::queue<Priority, Value>::push(Priority priority, Value value) {
+        ring& r = ring_(priority);
+        // once the ring has overflowed, newer values queue up behind the overflow
+        if ( r.overflow_size.load(std::memory_order_acquire) || !try_push_(r, value) ) {
+            std::lock_guard<std::mutex> guard(r.overflow_mutex);
+            r.overflow.push_back(std::move(value));
+            r.overflow_size.fetch_add(1, std::memory_order_release);
+        }
+        r.size.fetch_add(1, std::memory_order_release);
+        size_.fetch_add(1, std::memory_order_release);
+    }
+
+    template < std::size_t Capacity >
+    template < typename Priority, typename Value >
+    Value mpmc_fifo_policy<Capacity>::queue<Priority, Value>::pop() noexcept {
+        Value value{};
+        [[maybe_unused]] const bool popped = try_pop(value);
+        assert(popped);
+        return value;
+    }
+
+    template < std::size_t Capacity >
+    template < typename Priority, typename Value >
+    bool mpmc_fifo_policy<Capacity>::queue<Priority, Value>::try_pop(Value& value) noexcept {
+        for ( std::size_t i = rings_.size(); i > 0; --i ) {
+            ring* r = rings_[i - 1].load(std::memory_order_acquire);
+            if ( !r || !r->size.load(std::memory_order_acquire) ) {
+                continue;
+            }
+            if ( try_pop_(*r, value) || pop_overflow_(*r, value) ) {
+                r->size.fetch_sub(1, std::memory_order_release);
+                size_.fetch_sub(1, std::memory_order_release);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    template < std::size_t Capacity >
+    template < typename Priority, typename Value >
+    void mpmc_fifo_policy<Capacity>::queue<Priority, Value>::swap(queue& other) noexcept {
+        for ( std::size_t i = 0; i < rings_.size(); ++i ) {
+            ring* r = rings_[i].load(std::memory_order_relaxed);
+            rings_[i].store(other.rings_[i].load(std::memory_order_relaxed), std::memory_order_relaxed);
+            other.rings_[i].store(r, std::memory_order_relaxed);
+        }
+        const std::size_t size = size_.load(std::memory_order_relaxed);
+        size_.store(other.size_.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        other.size_.store(size, std::memory_order_relaxed);
+    }
+
+    template < std::size_t Capacity >
+    template < typename Priority, typename Value >
+    typename mpmc_fifo_policy<Capacity>::template queue<Priority, Value>::ring&
+    mpmc_fifo_policy<Capacity>::queue<Priority, Value>::ring_(Priority priority) {
+        std::atomic<ring*>& slot = rings_[static_cast<std::size_t>(priority)];
+        ring* r = slot.load(std::memory_order_acquire);
+        if ( !r ) {
+            // rings are made on first use, so unused priorities cost a pointer
+            auto fresh = std::make_unique<ring>();
+            if ( slot.compare_exchange_strong(r, fresh.get(), std::memory_order_acq_rel) ) {
+                r = fresh.release();
+            }
+        }
+        return *r;
+    }
+
+    template < std::size_t Capacity >
+    template < typename Priority, typename Value >
+    bool mpmc_fifo_policy<Capacity>::queue<Priority, Value>::try_push_(ring& r, Value& value) noexcept {
+        std::size_t pos = r.enqueue_pos.load(std::memory_order_relaxed);
+        for (;;) {
+            cell& c = r.cells[pos & (Capacity - 1)];
+            const auto diff = static_cast<std::ptrdiff_t>(c.sequence.load(std::memory_order_acquire) - pos);
+            if ( diff == 0 ) {
+                if ( r.enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed) ) {
+                    c.value = std::move(value);
+                    c.sequence.store(pos + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if ( diff < 0 ) {
+                return false;
+            } else {
+                pos = r.enqueue_pos.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    template < std::size_t Capacity >
+    template < typename Priority, typename Value >
+    bool mpmc_fifo_policy<Capacity>::queue<Priority, Value>::try_pop_(ring& r, Value& value) noexcept {
+        std::size_t pos = r.dequeue_pos.load(std::memory_order_relaxed);
+        for (;;) {
+            cell& c = r.cells[pos & (Capacity - 1)];
+            const auto diff = static_cast<std::ptrdiff_t>(c.sequence.load(std::memory_order_acquire) - (pos + 1));
+            if ( diff == 0 ) {
+                if ( r.dequeue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed) ) {
+                    value = std::move(c.value);
+                    c.sequence.store(pos + Capacity, std::memory_order_release);
+                    return true;
+                }
+            } else if ( diff < 0 ) {
+                return false;
+            } else {
+                pos = r.dequeue_pos.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    template < std::size_t Capacity >
+    template < typename Priority, typename Value >
+    bool mpmc_fifo_policy<Capacity>::queue<Priority, Value>::pop_overflow_(ring& r, Value& value) noexcept {
+        if ( !r.overflow_size.load(std::memory_order_acquire) ) {
+            return false;
+        }
+        std::lock_guard<std::mutex> guard(r.overflow_mutex);
+        if ( r.overflow.empty() ) {
+            return false;
+        }
+        value = std::move(r.overflow.front());
+        r.overflow.pop_front();
+        r.overflow_size.fetch_sub(1, std::memory_order_release);
+        return true;
+    }
+}
@@ -87,6 +87,70 @@ namespace promise_hpp
         timeout
     };
 
+    //
+    // virtual_clock
+    //
+    // A clock that only moves when told to, for simulations and tests.
+    // Waits until its time points never block: a wait that would time out
+    // moves the clock to its deadline instead. Every Tag has its own time.
+    //
+
+    template < typename Tag = void >
+    class virtual_clock final {
+    public:
+        using rep = std::int64_t;
+        using period = std::nano;
+        using duration = std::chrono::duration<rep, period>;
+        using time_point = std::chrono::time_point<virtual_clock, duration>;
+        static constexpr bool is_steady = true;
+
+        static time_point now() noexcept {
+            return time_point(duration(now_.load()));
+        }
+
+        static void advance(duration d) noexcept {
+            if ( d > duration::zero() ) {
+                now_.fetch_add(d.count());
+            }
+        }
+
+        template < typename Duration >
+        static void advance_to(const std::chrono::time_point<virtual_clock, Duration>& time) noexcept {
+            const rep target = std::chrono::ceil<duration>(time.time_since_epoch()).count();
+            rep current = now_.load();
+            while ( current < target && !now_.compare_exchange_weak(current, target) ) {
+            }
+        }
+
+        static void reset() noexcept {
+            now_.store(0);
+        }
+    private:
+        inline static std::atomic<rep> now_{0};
+    };
+
+    //
+    // is_virtual_clock
+    //
+
+    namespace impl
+    {
+        template < typename Clock >
+        struct is_virtual_clock_impl
+        : std::false_type {};
+
+        template < typename Tag >
+        struct is_virtual_clock_impl<virtual_clock<Tag>>
+        : std::true_type {};
+    }
+
+    template < typename Clock >
+    struct is_virtual_clock
+    : impl::is_virtual_clock_impl<std::remove_cv_t<Clock>> {};
+
+    template < typename Clock >
+    inline constexpr bool is_virtual_clock_v = is_virtual_clock<Clock>::value;
+
     //
     // aggregate_exception
     //
@@ -308,9 +372,9 @@ namespace promise_hpp
             state_->wait();
         }
 
-        template < typename Rep, typename Period >
+        template < typename Clock = std::chrono::steady_clock, typename Rep, typename Period >
         promise_wait_status wait_for(const std::chrono::duration<Rep, Period>& timeout_duration) const {
-            return state_->wait_for(timeout_duration);
+            return state_->template wait_for<Clock>(timeout_duration);
         }
 
         template < typename Clock, typename Duration >
@@ -506,20 +570,32 @@ namespace promise_hpp
                 });
             }
 
-            template < typename Rep, typename Period >
+            template < typename Clock, typename Rep, typename Period >
             promise_wait_status wait_for(const std::chrono::duration<Rep, Period>& timeout_duration) const {
-                std::unique_lock lock(mutex_);
-                return cond_var_.wait_for(lock, timeout_duration, [this](){
-                    return status_ != status::pending;
-                }) ? promise_wait_status::no_timeout : promise_wait_status::timeout;
+                if constexpr ( is_virtual_clock_v<Clock> ) {
+                    return wait_until(Clock::now() + timeout_duration);
+                } else {
+                    std::unique_lock lock(mutex_);
+                    return cond_var_.wait_for(lock, timeout_duration, [this](){
+                        return status_ != status::pending;
+                    }) ? promise_wait_status::no_timeout : promise_wait_status::timeout;
+                }
             }
 
             template < typename Clock, typename Duration >
             promise_wait_status wait_until(const std::chrono::time_point<Clock, Duration>& timeout_time) const {
                 std::unique_lock lock(mutex_);
-                return cond_var_.wait_until(lock, timeout_time, [this](){
-                    return status_ != status::pending;
-                }) ? promise_wait_status::no_timeout : promise_wait_status::timeout;
+                if constexpr ( is_virtual_clock_v<Clock> ) {
+                    if ( status_ != status::pending ) {
+                        return promise_wait_status::no_timeout;
+                    }
+                    Clock::advance_to(timeout_time);
+                    return promise_wait_status::timeout;
+                } else {
+                    return cond_var_.wait_until(lock, timeout_time, [this](){
+                        return status_ != status::pending;
+                    }) ? promise_wait_status::no_timeout : promise_wait_status::timeout;
+                }
             }
 
             template < typename U >
@@ -750,9 +826,9 @@ namespace promise_hpp
             state_->wait();
         }
 
-        template < typename Rep, typename Period >
+        template < typename Clock = std::chrono::steady_clock, typename Rep, typename Period >
         promise_wait_status wait_for(const std::chrono::duration<Rep, Period>& timeout_duration) const {
-            return state_->wait_for(timeout_duration);
+            return state_->template wait_for<Clock>(timeout_duration);
         }
 
         template < typename Clock, typename Duration >
@@ -940,20 +1016,32 @@ namespace promise_hpp
                 });
             }
 
-            template < typename Rep, typename Period >
+            template < typename Clock, typename Rep, typename Period >
             promise_wait_status wait_for(const std::chrono::duration<Rep, Period>& timeout_duration) const {
-                std::unique_lock lock(mutex_);
-                return cond_var_.wait_for(lock, timeout_duration, [this](){
-                    return status_ != status::pending;
-                }) ? promise_wait_status::no_timeout : promise_wait_status::timeout;
+                if constexpr ( is_virtual_clock_v<Clock> ) {
+                    return wait_until(Clock::now() + timeout_duration);
+                } else {
+                    std::unique_lock lock(mutex_);
+                    return cond_var_.wait_for(lock, timeout_duration, [this](){
+                        return status_ != status::pending;
+                    }) ? promise_wait_status::no_timeout : promise_wait_status::timeout;
+                }
             }
 
             template < typename Clock, typename Duration >
             promise_wait_status wait_until(const std::chrono::time_point<Clock, Duration>& timeout_time) const {
                 std::unique_lock lock(mutex_);
-                return cond_var_.wait_until(lock, timeout_time, [this](){
-                    return status_ != status::pending;
-                }) ? promise_wait_status::no_timeout : promise_wait_status::timeout;
+                if constexpr ( is_virtual_clock_v<Clock> ) {
+                    if ( status_ != status::pending ) {
+                        return promise_wait_status::no_timeout;
+                    }
+                    Clock::advance_to(timeout_time);
+                    return promise_wait_status::timeout;
+                } else {
+                    return cond_var_.wait_until(lock, timeout_time, [this](){
+                        return status_ != status::pending;
+                    }) ? promise_wait_status::no_timeout : promise_wait_status::timeout;
+                }
             }
 
             bool resolve() {
@@ -8,8 +8,11 @@
 #include <doctest/doctest.h>
 
 #include <thread>
+#include <random>
 #include <numeric>
+#include <fstream>
 #include <iostream>
+#include <filesystem>
 
 #include <cmath>
 #include <cstring>
@@ -89,6 +92,99 @@ TEST_CASE("jobber") {
         j.resume();
         j.wait_all();
     }
+    {
+        jb::jobber j(1);
+        REQUIRE(jb::jobber::current_priority() == jb::jobber_priority::normal);
+        auto pv0 = j.async(jb::jobber_priority::highest, [&j](){
+            REQUIRE(jb::jobber::current_priority() == jb::jobber_priority::highest);
+            return j.async([](){
+                return jb::jobber::current_priority();
+            });
+        });
+        REQUIRE(pv0.get().get() == jb::jobber_priority::highest);
+        auto pv1 = j.async(jb::jobber_priority::highest, [&j](){
+            return j.async(jb::jobber_priority::lowest, [](){
+                return jb::jobber::current_priority();
+            });
+        });
+        REQUIRE(pv1.get().get() == jb::jobber_priority::lowest);
+        jb::promise<int> pv2;
+        auto pv3 = pv2.then([&j](int){
+            return j.async([](){
+                return jb::jobber::current_priority();
+            });
+        });
+        j.async(jb::jobber_priority::above_normal, [pv2]() mutable {
+            pv2.resolve(42);
+        });
+        REQUIRE(pv3.get() == jb::jobber_priority::above_normal);
+        REQUIRE(jb::jobber::current_priority() == jb::jobber_priority::normal);
+    }
+    {
+        jb::jobber j(2);
+        REQUIRE(j.worker_index() == 2);
+        auto counters = j.make_local<int>(0);
+        REQUIRE(counters.size() == 2);
+        for ( std::size_t i = 0; i < 100; ++i ) {
+            j.async([&j, counters](){
+                REQUIRE(j.worker_index() < 2);
+                ++counters.get();
+            });
+        }
+        REQUIRE(j.wait_all() == jb::jobber_wait_status::no_timeout);
+        int total = 0;
+        counters.for_each([&total](int& v){ total += v; });
+        REQUIRE(total == 100);
+        REQUIRE(counters.size() == 2);
+    }
+    {
+        jb::jobber j(1);
+        auto buffers = j.make_local<std::vector<char>>(std::size_t(16), 'x');
+        j.pause();
+        j.async([buffers](){
+            REQUIRE(buffers.get().size() == 16);
+            buffers.get().push_back('y');
+        });
+        j.active_wait_all();
+        REQUIRE(buffers.size() == 2);
+        REQUIRE(buffers[0].size() == 16);
+        REQUIRE(buffers[1].size() == 17);
+    }
+    {
+        // every helping thread gets a slot of its own
+        jb::jobber j(1);
+        auto counters = j.make_local<int>(0);
+        j.pause();
+        for ( std::size_t i = 0; i < 1000; ++i ) {
+            j.async([counters](){
+                ++counters.get();
+            });
+        }
+        std::thread helper0([&j](){ j.active_wait_all(); });
+        std::thread helper1([&j](){ j.active_wait_all(); });
+        helper0.join();
+        helper1.join();
+        int total = 0;
+        counters.for_each([&total](int& v){ total += v; });
+        REQUIRE(total == 1000);
+        REQUIRE(counters[0] == 0);
+        REQUIRE(counters.size() <= 3);
+    }
+    {
+        // the slots outlive the jobber
+        jb::jobber::local<int> counters;
+        {
+            jb::jobber j(1);
+            counters = j.make_local<int>(0);
+            j.async([counters](){
+                ++counters.get();
+            }).get();
+        }
+        ++counters.get();
+        REQUIRE(counters.size() == 2);
+        REQUIRE(counters[0] == 1);
+        REQUIRE(counters[1] == 1);
+    }
     {
         jb::jobber j(1);
         std::atomic<int> counter = ATOMIC_VAR_INIT(0);
@@ -329,3 +425,1060 @@ TEST_CASE("jobber") {
         REQUIRE(r0 == doctest::Approx(r1 * 50.0).epsilon(0.01));
     }
 }
+
+TEST_CASE("jobber_groups") {
+    {
+        jb::jobber j(1);
+        REQUIRE(j.group_count() == 1);
+        const jb::jobber_group a = j.make_group(3);
+        const jb::jobber_group b = j.make_group(1);
+        REQUIRE(j.group_count() == 3);
+
+        std::string accumulator;
+        j.pause();
+        for ( std::size_t i = 0; i < 8; ++i ) {
+            j.async(a, [&accumulator](){ accumulator.push_back('a'); });
+            j.async(b, [&accumulator](){ accumulator.push_back('b'); });
+        }
+        REQUIRE(j.group_stats(a).queued_tasks == 8);
+        REQUIRE(j.group_stats(b).queued_tasks == 8);
+        j.resume();
+        REQUIRE(j.wait_all() == jb::jobber_wait_status::no_timeout);
+        REQUIRE(accumulator.substr(0, 8) == "aaabaaab");
+
+        const jb::jobber_group_stats stats = j.group_stats(a);
+        REQUIRE(stats.weight == 3);
+        REQUIRE(stats.queued_tasks == 0);
+        REQUIRE(stats.running_tasks == 0);
+        REQUIRE(stats.processed_tasks == 8);
+        REQUIRE(j.group_stats(jb::jobber_group()).processed_tasks == 0);
+    }
+    {
+        jb::jobber_options options;
+        options.cpu_accounting = true;
+        jb::jobber j(4, options);
+        const jb::jobber_group g = j.make_group(1, 1);
+        std::atomic<int> running = ATOMIC_VAR_INIT(0);
+        std::atomic<int> max_running = ATOMIC_VAR_INIT(0);
+        for ( std::size_t i = 0; i < 10; ++i ) {
+            j.async(g, jb::jobber_priority::highest, [&running, &max_running](){
+                const int r = ++running;
+                int m = max_running;
+                while ( r > m && !max_running.compare_exchange_weak(m, r) ) {}
+                std::this_thread::sleep_for(std::chrono::milliseconds(2));
+                --running;
+            });
+        }
+        REQUIRE(j.wait_all() == jb::jobber_wait_status::no_timeout);
+        REQUIRE(max_running == 1);
+        REQUIRE(j.group_stats(g).processed_tasks == 10);
+    #if defined(__linux__) || defined(__APPLE__)
+        // sleeping tasks burn almost no CPU time
+        REQUIRE(j.group_stats(g).busy_time < std::chrono::milliseconds(20));
+    #endif
+    }
+    {
+        jb::jobber j(1);
+        const jb::jobber_group g = j.make_group(1);
+        j.async(g, [](){
+            const auto until = std::chrono::steady_clock::now() + std::chrono::milliseconds(5);
+            volatile std::size_t counter = 0;
+            while ( std::chrono::steady_clock::now() < until ) {
+                counter = counter + 1;
+            }
+        });
+        REQUIRE(j.wait_all() == jb::jobber_wait_status::no_timeout);
+        REQUIRE(j.group_stats(g).busy_time > std::chrono::nanoseconds(0));
+    }
+    {
+        // the tasks a grouped task helps with count for their own groups only
+        jb::jobber j(0);
+        const jb::jobber_group a = j.make_group(1);
+        const jb::jobber_group b = j.make_group(1);
+        j.async(a, [&j, b](){
+            j.async(b, [](){
+                const auto until = std::chrono::steady_clock::now() + std::chrono::milliseconds(20);
+                volatile std::size_t counter = 0;
+                while ( std::chrono::steady_clock::now() < until ) {
+                    counter = counter + 1;
+                }
+            });
+            REQUIRE(j.active_wait_one().second == 1);
+        });
+        REQUIRE(j.active_wait_one().second == 1);
+        REQUIRE(j.group_stats(a).processed_tasks == 1);
+        REQUIRE(j.group_stats(b).processed_tasks == 1);
+        REQUIRE(j.group_stats(b).busy_time > std::chrono::nanoseconds(0));
+        REQUIRE(j.group_stats(a).busy_time < j.group_stats(b).busy_time);
+    }
+    {
+        // the ready counts follow the tasks across groups, caps and lanes
+        jb::jobber_options options;
+        options.reserved_threads = 1;
+        jb::jobber j(2, options);
+        std::vector<jb::jobber_group> groups;
+        for ( std::size_t i = 0; i < 64; ++i ) {
+            groups.push_back(j.make_group(1 + i % 3, i % 2));
+        }
+        std::atomic<std::size_t> counter{0};
+        for ( std::size_t i = 0; i < 1000; ++i ) {
+            j.async(groups[i % groups.size()], static_cast<jb::jobber_priority>(i % 5), [&counter](){
+                ++counter;
+            });
+            if ( i % 100 == 0 ) {
+                j.async_prefer(i % 3, [&counter](){ ++counter; });
+            }
+        }
+        REQUIRE(j.wait_all() == jb::jobber_wait_status::no_timeout);
+        REQUIRE(counter == 1010u);
+        for ( const jb::jobber_group& group : groups ) {
+            REQUIRE(j.group_stats(group).queued_tasks == 0);
+            REQUIRE(j.group_stats(group).running_tasks == 0);
+        }
+        REQUIRE(j.async(groups.back(), [](){ return 42; }).get() == 42);
+    }
+    {
+        // a higher priority wins over the weights of the other groups
+        jb::jobber j(1);
+        const jb::jobber_group a = j.make_group(3);
+        const jb::jobber_group b = j.make_group(1);
+
+        std::string accumulator;
+        j.pause();
+        for ( std::size_t i = 0; i < 4; ++i ) {
+            j.async(a, [&accumulator](){ accumulator.push_back('a'); });
+            j.async(b, jb::jobber_priority::above_normal, [&accumulator](){ accumulator.push_back('b'); });
+        }
+        j.resume();
+        REQUIRE(j.wait_all() == jb::jobber_wait_status::no_timeout);
+        REQUIRE(accumulator == "bbbbaaaa");
+    }
+}
+
+TEST_CASE("jobber_invoke") {
+    {
+        jb::jobber j(0);
+        int a = 0, b = 0, c = 0;
+        j.invoke(
+            [&a](){ a = 1; },
+            [&b](){ b = 2; },
+            [&c](){ c = 3; });
+        REQUIRE(a == 1);
+        REQUIRE(b == 2);
+        REQUIRE(c == 3);
+        REQUIRE(j.wait_all() == jb::jobber_wait_status::no_timeout);
+    }
+    {
+        jb::jobber j(2);
+        REQUIRE_THROWS_AS(j.invoke(
+            [](){},
+            [](){ throw std::logic_error("branch"); }), std::logic_error);
+        REQUIRE_THROWS_AS(j.invoke(
+            [](){ throw std::logic_error("inline"); },
+            [](){}), std::logic_error);
+        REQUIRE(j.wait_all() == jb::jobber_wait_status::no_timeout);
+    }
+    {
+        jb::jobber j(4);
+        std::function<int(int)> fib = [&j, &fib](int n){
+            if ( n < 2 ) {
+                return n;
+            }
+            int l = 0, r = 0;
+            j.invoke(
+                [&l, &fib, n](){ l = fib(n - 1); },
+                [&r, &fib, n](){ r = fib(n - 2); });
+            return l + r;
+        };
+        REQUIRE(fib(20) == 6765);
+        auto pv0 = j.async([&fib](){ return fib(18); });
+        REQUIRE(pv0.get() == 2584);
+    }
+    {
+        jb::jobber j(3);
+        std::vector<int> values(10000);
+        for ( std::size_t i = 0; i < values.size(); ++i ) {
+            values[i] = static_cast<int>((i * 7919) % values.size());
+        }
+        std::function<void(int*, int*)> sort = [&j, &sort](int* b, int* e){
+            if ( e - b < 64 ) {
+                std::sort(b, e);
+                return;
+            }
+            const int pivot = b[(e - b) / 2];
+            int* m1 = std::partition(b, e, [pivot](int v){ return v < pivot; });
+            int* m2 = std::partition(m1, e, [pivot](int v){ return v == pivot; });
+            j.invoke(
+                [&sort, b, m1](){ sort(b, m1); },
+                [&sort, m2, e](){ sort(m2, e); });
+        };
+        std::vector<int> expected = values;
+        std::sort(expected.begin(), expected.end());
+        sort(values.data(), values.data() + values.size());
+        REQUIRE(values == expected);
+    }
+    {
+        // nested async/get would block the only worker, invoke helps instead
+        jb::jobber j(1);
+        std::function<int(int)> fib = [&j, &fib](int n){
+            if ( n < 2 ) {
+                return n;
+            }
+            int l = 0, r = 0;
+            j.invoke(
+                [&l, &fib, n](){ l = fib(n - 1); },
+                [&r, &fib, n](){ r = fib(n - 2); });
+            return l + r;
+        };
+        auto pv0 = j.async([&fib](){ return fib(15); });
+        REQUIRE(pv0.wait_for(std::chrono::seconds(10)) == jb::promise_wait_status::no_timeout);
+        REQUIRE(pv0.get() == 610);
+    }
+    {
+        // a joining worker still runs the tasks pinned to it
+        jb::jobber j(2);
+        auto pv0 = j.async_on(0, [&j](){
+            std::atomic<bool> started{false};
+            int result = 0;
+            j.invoke(
+                [&started](){
+                    while ( !started ) {
+                        std::this_thread::yield();
+                    }
+                },
+                [&j, &started, &result](){
+                    started = true;
+                    result = j.async_on(0, [](){ return 42; }).get();
+                });
+            return result;
+        });
+        REQUIRE(pv0.wait_for(std::chrono::seconds(10)) == jb::promise_wait_status::no_timeout);
+        REQUIRE(pv0.get() == 42);
+    }
+    {
+        // helpers take queued higher priority tasks before the branches
+        jb::jobber j(0);
+        std::string order;
+        j.async(jb::jobber_priority::highest, [&order](){ order.push_back('h'); });
+        j.invoke(
+            [&j](){ j.active_wait_all(); },
+            [&order](){ order.push_back('b'); });
+        REQUIRE(order == "hb");
+    }
+}
+
+TEST_CASE("jobber_resumable") {
+    {
+        jb::jobber j(1);
+        REQUIRE_FALSE(j.should_yield());
+        REQUIRE(j.time_slice() == std::chrono::nanoseconds::zero());
+
+        std::atomic<int> steps = ATOMIC_VAR_INIT(0);
+        auto pv0 = j.async_resumable(jb::jobber_priority::lowest, [&steps]() -> std::optional<int> {
+            std::this_thread::sleep_for(std::chrono::microseconds(100));
+            return ++steps == 1000 ? std::optional<int>(42) : std::nullopt;
+        });
+        while ( steps < 10 ) {
+            std::this_thread::yield();
+        }
+        auto pv1 = j.async(jb::jobber_priority::highest, [&steps](){
+            return steps.load();
+        });
+        REQUIRE(pv1.get() < 1000);
+        REQUIRE(pv0.get() == 42);
+        REQUIRE(steps == 1000);
+    }
+    {
+        jb::jobber j(1);
+        j.set_time_slice(std::chrono::milliseconds(1));
+        REQUIRE(j.time_slice() == std::chrono::milliseconds(1));
+
+        std::string accumulator;
+        std::mutex accumulator_mutex;
+        const auto make_step = [&accumulator, &accumulator_mutex](char c){
+            return [&accumulator, &accumulator_mutex, c, n = 0]() mutable {
+                std::this_thread::sleep_for(std::chrono::microseconds(200));
+                std::lock_guard<std::mutex> guard(accumulator_mutex);
+                if ( accumulator.empty() || accumulator.back() != c ) {
+                    accumulator.push_back(c);
+                }
+                return ++n == 50;
+            };
+        };
+        j.pause();
+        auto pv0 = j.async_resumable(make_step('a'));
+        auto pv1 = j.async_resumable(make_step('b'));
+        j.resume();
+        REQUIRE_NOTHROW(pv0.get());
+        REQUIRE_NOTHROW(pv1.get());
+        REQUIRE(accumulator.size() > 2);
+    }
+    {
+        jb::jobber j(1);
+        auto pv0 = j.async_resumable([]() -> bool {
+            throw std::logic_error("step");
+        });
+        REQUIRE_THROWS_AS(pv0.get(), std::logic_error);
+    }
+    {
+        // shutting down asks running tasks to yield and drops the yielded ones
+        jb::promise<void> pv0;
+        jb::promise<void> pv1;
+        {
+            jb::jobber j(2);
+            std::atomic<bool> stepped{false};
+            std::atomic<bool> started{false};
+            pv0 = j.async_resumable([&stepped]() -> bool {
+                stepped = true;
+                return false;
+            });
+            pv1 = j.async([&j, &started](){
+                started = true;
+                while ( !j.should_yield() ) {
+                    std::this_thread::yield();
+                }
+            });
+            while ( !stepped || !started ) {
+                std::this_thread::yield();
+            }
+        }
+        REQUIRE_THROWS_AS(pv0.get(), jb::jobber_cancelled_exception);
+        REQUIRE_NOTHROW(pv1.get());
+    }
+}
+
+TEST_CASE("jobber_queue_policies") {
+    const auto check_order = [](auto& j, const std::string& expected){
+        std::string accumulator;
+        std::mutex accumulator_mutex;
+        j.pause();
+        const auto append = [&accumulator, &accumulator_mutex](char c){
+            std::lock_guard<std::mutex> guard(accumulator_mutex);
+            accumulator.push_back(c);
+        };
+        j.async(jb::jobber_priority::normal, append, 'a');
+        j.async(jb::jobber_priority::lowest, append, 'b');
+        j.async(jb::jobber_priority::normal, append, 'c');
+        j.async(jb::jobber_priority::highest, append, 'd');
+        j.async(jb::jobber_priority::normal, append, 'e');
+        j.resume();
+        REQUIRE(j.wait_all() == jb::jobber_wait_status::no_timeout);
+        REQUIRE(accumulator == expected);
+    };
+    {
+        jb::basic_jobber<task_queue_hpp::priority_fifo_policy> j(1);
+        check_order(j, "daceb");
+    }
+    {
+        jb::basic_jobber<task_queue_hpp::priority_lifo_policy> j(1);
+        check_order(j, "decab");
+    }
+    {
+        jb::basic_jobber<task_queue_hpp::earliest_deadline_policy> j(1);
+        check_order(j, "daceb");
+    }
+    {
+        jb::basic_jobber<task_queue_hpp::mpmc_fifo_policy<>> j(1);
+        check_order(j, "daceb");
+    }
+}
+
+TEST_CASE("jobber_lanes") {
+    {
+        jb::jobber_options options;
+        options.reserved_threads = 1;
+        options.reserved_thread_priority = jb::jobber_thread_priority::raised;
+        jb::jobber j(1, options);
+        REQUIRE(j.thread_count() == 2);
+
+        std::atomic<bool> started{false};
+        std::atomic<bool> release{false};
+        auto pv0 = j.async(jb::jobber_priority::lowest, [&started, &release](){
+            started = true;
+            while ( !release ) {
+                std::this_thread::yield();
+            }
+        });
+        while ( !started ) {
+            std::this_thread::yield();
+        }
+        auto pv1 = j.async(jb::jobber_priority::normal, [&j](){
+            return j.worker_index();
+        });
+        auto pv2 = j.async(jb::jobber_priority::highest, [&j](){
+            return j.worker_index();
+        });
+        REQUIRE(pv2.get() == 1u);
+        REQUIRE(pv1.wait_for(std::chrono::milliseconds(10)) == jb::promise_wait_status::timeout);
+        release = true;
+        REQUIRE(pv1.get() == 0u);
+        REQUIRE_NOTHROW(pv0.get());
+    }
+    {
+        jb::jobber_options options;
+        options.reserved_threads = 2;
+        options.reserved_priority = jb::jobber_priority::above_normal;
+        jb::jobber j(0, options);
+        auto pv0 = j.async(jb::jobber_priority::above_normal, [](){ return 42; });
+        REQUIRE(pv0.get() == 42);
+        auto pv1 = j.async(jb::jobber_priority::normal, [](){ return 24; });
+        REQUIRE(pv1.wait_for(std::chrono::milliseconds(10)) == jb::promise_wait_status::timeout);
+        REQUIRE(j.active_wait_all().first == jb::jobber_wait_status::no_timeout);
+        REQUIRE(pv1.get() == 24);
+    }
+    {
+        jb::jobber_options options;
+        options.idle_threads = 1;
+        jb::jobber j(1, options);
+        REQUIRE(j.thread_count() == 2);
+        auto pv0 = j.async(jb::jobber_priority::lowest, [&j](){
+            return j.worker_index();
+        });
+        auto pv1 = j.async(jb::jobber_priority::below_normal, [&j](){
+            return j.worker_index();
+        });
+        REQUIRE(pv0.get() == 1u);
+        REQUIRE(pv1.get() == 0u);
+    }
+    {
+        jb::jobber_options options;
+        options.idle_threads = 1;
+        jb::jobber j(0, options);
+        auto pv0 = j.async(jb::jobber_priority::normal, [](){ return 42; });
+        REQUIRE(pv0.wait_for(std::chrono::milliseconds(10)) == jb::promise_wait_status::timeout);
+        REQUIRE(j.active_wait_all().first == jb::jobber_wait_status::no_timeout);
+        REQUIRE(pv0.get() == 42);
+    }
+}
+
+TEST_CASE("jobber_cpu_limits") {
+    namespace fs = std::filesystem;
+    // unique per run, so parallel test processes do not share the fake files
+    const fs::path root = fs::temp_directory_path() / ("jobber_cpu_limits_"
+        + std::to_string(std::random_device()())
+        + "_" + std::to_string(std::chrono::steady_clock::now().time_since_epoch().count()));
+    struct root_guard {
+        const fs::path& path;
+        ~root_guard() noexcept {
+            std::error_code ec;
+            fs::remove_all(path, ec);
+        }
+    } guard{root};
+    fs::remove_all(root);
+
+    const auto write = [&root](const fs::path& path, const std::string& content){
+        fs::create_directories((root / path).parent_path());
+        std::ofstream(root / path) << content;
+    };
+
+    jb::jobber_cpu_sources sources;
+    sources.cgroup_root = (root / "cgroup").string();
+    sources.proc_cgroup = (root / "proc_cgroup").string();
+
+    REQUIRE_FALSE(jb::cgroup_cpu_quota(sources));
+    REQUIRE(jb::affinity_cpu_count() > 0);
+    REQUIRE(jb::available_concurrency(sources) == jb::affinity_cpu_count());
+
+    {
+        write("proc_cgroup", "0::/app/worker\n");
+        write("cgroup/cpu.max", "max 100000\n");
+        write("cgroup/app/cpu.max", "250000 100000\n");
+        write("cgroup/app/worker/cpu.max", "max 100000\n");
+        REQUIRE(jb::cgroup_cpu_quota(sources) == 2.5);
+        REQUIRE(jb::available_concurrency(sources) == std::min(jb::affinity_cpu_count(), std::size_t(3)));
+    }
+    {
+        write("proc_cgroup", "4:memory:/docker/abc\n3:cpu,cpuacct:/docker/abc\n0::/\n");
+        write("cgroup/cpu.max", "max 100000\n");
+        write("cgroup/cpu,cpuacct/docker/abc/cpu.cfs_quota_us", "-1\n");
+        write("cgroup/cpu,cpuacct/docker/abc/cpu.cfs_period_us", "100000\n");
+        write("cgroup/cpu,cpuacct/docker/cpu.cfs_quota_us", "50000\n");
+        write("cgroup/cpu,cpuacct/docker/cpu.cfs_period_us", "100000\n");
+        REQUIRE(jb::cgroup_cpu_quota(sources) == 0.5);
+        REQUIRE(jb::available_concurrency(sources) == 1);
+    }
+    {
+        write("proc_cgroup", "0::/\n");
+        write("cgroup/cpu.max", "100000 100000\n");
+
+        jb::jobber_options options;
+        options.elastic = true;
+        options.elastic_interval = std::chrono::milliseconds(1);
+        options.cpu_sources = sources;
+        jb::jobber j(4, options);
+        REQUIRE(j.thread_count() == 4);
+        REQUIRE(j.active_thread_count() == 1);
+
+        std::atomic<int> counter{0};
+        for ( std::size_t i = 0; i < 16; ++i ) {
+            j.async([&counter](){ ++counter; });
+        }
+        REQUIRE(j.wait_all() == jb::jobber_wait_status::no_timeout);
+        REQUIRE(counter == 16);
+
+        // the preferred tasks of a parked worker go to the active ones
+        auto pv0 = j.async_prefer(3, [&j](){ return j.worker_index(); });
+        REQUIRE(pv0.wait_for(std::chrono::seconds(10)) == jb::promise_wait_status::no_timeout);
+        REQUIRE(pv0.get() == 0);
+
+        write("cgroup/cpu.max", "300000 100000\n");
+        const std::size_t expected = std::min(jb::affinity_cpu_count(), std::size_t(3));
+        while ( j.active_thread_count() != expected ) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    }
+    {
+        jb::jobber_options options;
+        options.reserved_threads = 1;
+        options.cpu_sources = sources;
+        jb::jobber j(options);
+        REQUIRE(j.thread_count() == jb::available_concurrency(sources) + 1);
+        REQUIRE(j.active_thread_count() == j.thread_count());
+        REQUIRE(j.async([](){ return 42; }).get() == 42);
+    }
+}
+
+TEST_CASE("jobber_worker_affinity") {
+    {
+        jb::jobber j(4);
+        std::vector<jb::promise<std::size_t>> pvs;
+        for ( std::size_t i = 0; i < 64; ++i ) {
+            pvs.push_back(j.async_on(i % j.thread_count(), [&j](){
+                return j.worker_index();
+            }));
+        }
+        for ( std::size_t i = 0; i < pvs.size(); ++i ) {
+            REQUIRE(pvs[i].get() == i % j.thread_count());
+        }
+        REQUIRE_THROWS_AS(j.async_on(4, [](){}), std::out_of_range);
+    }
+    {
+        jb::jobber j(2);
+        std::atomic<bool> started{false};
+        std::atomic<bool> release{false};
+        auto pv0 = j.async_on(0, [&started, &release](){
+            started = true;
+            while ( !release ) {
+                std::this_thread::yield();
+            }
+        });
+        while ( !started ) {
+            std::this_thread::yield();
+        }
+        auto pv1 = j.async_on(0, jb::jobber_priority::highest, [&j](){
+            return j.worker_index();
+        });
+        auto pv2 = j.async_prefer(0, [&j](){
+            return j.worker_index();
+        });
+        REQUIRE(pv2.get() == 1u);
+        REQUIRE(pv1.wait_for(std::chrono::milliseconds(10)) == jb::promise_wait_status::timeout);
+        release = true;
+        REQUIRE(pv1.get() == 0u);
+        REQUIRE_NOTHROW(pv0.get());
+    }
+    {
+        jb::jobber j(2);
+        j.pause();
+        auto pv0 = j.async_prefer(1, [&j](){ return j.worker_index(); });
+        auto pv1 = j.async_on(0, [&j](){ return j.worker_index(); });
+        j.resume();
+        REQUIRE(pv0.get() == 1u);
+        REQUIRE(pv1.get() == 0u);
+    }
+    {
+        auto pv0 = jb::promise<int>();
+        {
+            jb::jobber j(1);
+            j.pause();
+            pv0 = j.async_on(0, [](){ return 42; });
+        }
+        REQUIRE_THROWS_AS(pv0.get(), jb::jobber_cancelled_exception);
+    }
+    {
+        // helpers run what they can and leave the pinned tasks to their workers
+        jb::jobber j(1);
+        j.pause();
+        auto pv0 = j.async_on(0, [&j](){ return j.worker_index(); });
+        auto pv1 = j.async([](){ return 42; });
+        REQUIRE(j.active_wait_all() == std::make_pair(
+            jb::jobber_wait_status::pinned_pending,
+            std::size_t(1u)));
+        REQUIRE(pv1.get() == 42);
+        REQUIRE(j.active_wait_all_for(std::chrono::seconds(5)) == std::make_pair(
+            jb::jobber_wait_status::pinned_pending,
+            std::size_t(0u)));
+        j.resume();
+        REQUIRE(pv0.get() == 0u);
+        REQUIRE(j.active_wait_all() == std::make_pair(
+            jb::jobber_wait_status::no_timeout,
+            std::size_t(0u)));
+    }
+}
+
+TEST_CASE("jobber_revocable") {
+    {
+        jb::jobber j(1);
+        auto [pv0, handle] = j.async_revocable([](int v){ return v; }, 42);
+        REQUIRE(handle.valid());
+        REQUIRE(pv0.get() == 42);
+        REQUIRE_FALSE(handle.cancel());
+        REQUIRE_FALSE(jb::jobber_task_handle().valid());
+        REQUIRE_FALSE(jb::jobber_task_handle().cancel());
+    }
+    {
+        jb::jobber j(1);
+        j.pause();
+        auto resource = std::make_shared<int>(42);
+        std::weak_ptr<int> weak = resource;
+        auto [pv0, handle0] = j.async_revocable([resource](){ return *resource; });
+        auto [pv1, handle1] = j.async_revocable(jb::jobber_priority::highest, [](){ return 24; });
+        resource.reset();
+        REQUIRE_FALSE(weak.expired());
+        REQUIRE(handle0.cancel());
+        REQUIRE(weak.expired());
+        REQUIRE_FALSE(handle0.cancel());
+        REQUIRE_THROWS_AS(pv0.get(), jb::jobber_task_cancelled_exception);
+        j.resume();
+        REQUIRE(pv1.get() == 24);
+        REQUIRE(j.wait_all() == jb::jobber_wait_status::no_timeout);
+        REQUIRE_FALSE(handle1.cancel());
+    }
+    {
+        auto pv0 = jb::promise<void>();
+        jb::jobber_task_handle handle;
+        {
+            jb::jobber j(1);
+            j.pause();
+            std::tie(pv0, handle) = j.async_revocable([](){});
+        }
+        REQUIRE_THROWS_AS(pv0.get(), jb::jobber_cancelled_exception);
+        REQUIRE_FALSE(handle.cancel());
+    }
+    {
+        jb::jobber j(2);
+        std::atomic<int> counter{0};
+        std::vector<jb::jobber_task_handle> handles;
+        std::vector<jb::promise<void>> pvs;
+        for ( std::size_t i = 0; i < 1000; ++i ) {
+            auto [pv, handle] = j.async_revocable([&counter](){ ++counter; });
+            pvs.push_back(std::move(pv));
+            handles.push_back(std::move(handle));
+        }
+        std::size_t cancelled = 0;
+        for ( jb::jobber_task_handle& handle : handles ) {
+            cancelled += handle.cancel() ? 1u : 0u;
+        }
+        REQUIRE(j.wait_all() == jb::jobber_wait_status::no_timeout);
+        REQUIRE(static_cast<std::size_t>(counter) + cancelled == 1000u);
+    }
+}
+
+TEST_CASE("jobber_unique") {
+    {
+        jb::jobber j(2);
+        jb::jobber_unique_tasks<std::string, int> loads;
+        std::atomic<int> calls{0};
+        std::atomic<bool> release{false};
+        const auto load = [&calls, &release](const std::string& key){
+            ++calls;
+            while ( !release ) {
+                std::this_thread::yield();
+            }
+            return static_cast<int>(key.size());
+        };
+        auto pv0 = j.async_unique(loads, std::string("hello"), load, "hello");
+        auto pv1 = j.async_unique(loads, std::string("hello"), load, "hello");
+        auto pv2 = j.async_unique(loads, std::string("hi"), load, "hi");
+        REQUIRE(loads.size() == 2);
+        release = true;
+        REQUIRE(pv0.get() == 5);
+        REQUIRE(pv1.get() == 5);
+        REQUIRE(pv2.get() == 2);
+        REQUIRE(j.wait_all() == jb::jobber_wait_status::no_timeout);
+        REQUIRE(calls == 2);
+        REQUIRE(loads.size() == 0);
+
+        auto pv3 = j.async_unique(loads, std::string("hello"), load, "hello");
+        REQUIRE(pv3.get() == 5);
+        REQUIRE(calls == 3);
+    }
+    {
+        jb::jobber j(1);
+        jb::jobber_unique_tasks<int, void> tasks(1);
+        j.pause();
+        auto pv0 = j.async_unique(tasks, 1, [](){ throw std::logic_error("load"); });
+        auto pv1 = j.async_unique(tasks, 1, [](){});
+        j.resume();
+        REQUIRE_THROWS_AS(pv0.get(), std::logic_error);
+        REQUIRE_THROWS_AS(pv1.get(), std::logic_error);
+        REQUIRE(j.wait_all() == jb::jobber_wait_status::no_timeout);
+        REQUIRE(tasks.size() == 0);
+    }
+    {
+        jb::jobber j(4);
+        jb::jobber_unique_tasks<int, int> tasks;
+        std::atomic<int> calls{0};
+        std::vector<jb::promise<int>> pvs;
+        for ( int i = 0; i < 1000; ++i ) {
+            pvs.push_back(j.async_unique(tasks, i % 10, [&calls](int v){
+                ++calls;
+                return v;
+            }, i % 10));
+        }
+        for ( int i = 0; i < 1000; ++i ) {
+            REQUIRE(pvs[static_cast<std::size_t>(i)].get() == i % 10);
+        }
+        REQUIRE(calls >= 10);
+        REQUIRE(calls <= 1000);
+    }
+}
+
+TEST_CASE("jobber_caller_runs") {
+    const auto block_worker = [](jb::jobber& j, std::atomic<bool>& release){
+        std::atomic<bool> started{false};
+        auto pv = j.async([&started, &release](){
+            started = true;
+            while ( !release ) {
+                std::this_thread::yield();
+            }
+        });
+        while ( !started ) {
+            std::this_thread::yield();
+        }
+        return pv;
+    };
+    {
+        jb::jobber_options options;
+        options.caller_runs_depth = 2;
+        jb::jobber j(1, options);
+
+        std::atomic<bool> release{false};
+        auto pv0 = block_worker(j, release);
+        auto pv1 = j.async([](){ return std::this_thread::get_id(); });
+        auto pv2 = j.async([](){ return std::this_thread::get_id(); });
+        REQUIRE(pv2.wait_for(std::chrono::seconds(0)) == jb::promise_wait_status::no_timeout);
+        REQUIRE(pv2.get() == std::this_thread::get_id());
+        REQUIRE_THROWS_AS(j.async([](){ throw std::logic_error("inline"); }).get(), std::logic_error);
+        release = true;
+        REQUIRE(pv1.get() == j.thread_id(0));
+        REQUIRE_NOTHROW(pv0.get());
+
+        const jb::jobber_submit_stats stats = j.submit_stats();
+        REQUIRE(stats.queued_tasks == 2);
+        REQUIRE(stats.caller_runs_tasks == 2);
+    }
+    {
+        jb::jobber_options options;
+        options.caller_runs_wait = std::chrono::milliseconds(1);
+        jb::jobber j(1, options);
+        j.async([](){
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        });
+        REQUIRE(j.wait_all() == jb::jobber_wait_status::no_timeout);
+        REQUIRE(j.submit_stats().average_task_time > std::chrono::milliseconds(1));
+
+        std::atomic<bool> release{false};
+        auto pv0 = block_worker(j, release);
+        auto pv1 = j.async([](){ return std::this_thread::get_id(); });
+        REQUIRE(pv1.get() == std::this_thread::get_id());
+        release = true;
+        REQUIRE_NOTHROW(pv0.get());
+        REQUIRE(j.submit_stats().caller_runs_tasks == 1);
+    }
+    {
+        jb::jobber_options options;
+        options.caller_runs_depth = 1;
+        jb::jobber j(1, options);
+        j.pause();
+        auto pv0 = j.async([](){ return 1; });
+        auto pv1 = j.async([](){ return 2; });
+        REQUIRE(j.submit_stats().caller_runs_tasks == 0);
+        j.resume();
+        REQUIRE(pv0.get() + pv1.get() == 3);
+    }
+    {
+        // inline tasks keep the usual accounting
+        jb::jobber_options options;
+        options.caller_runs_depth = 1;
+        options.cpu_accounting = true;
+        jb::jobber j(1, options);
+        const jb::jobber_group g = j.make_group(1);
+
+        std::atomic<bool> release{false};
+        auto pv0 = block_worker(j, release);
+        jb::promise<std::uint32_t> pv1;
+        {
+            jb::jobber::label_scope label("inline");
+            jb::jobber::tag_scope tag(5);
+            pv1 = j.async(g, [](){
+                REQUIRE(std::string(jb::jobber::current_label()) == "inline");
+                return jb::jobber::current_tag();
+            });
+        }
+        REQUIRE(pv1.wait_for(std::chrono::seconds(0)) == jb::promise_wait_status::no_timeout);
+        REQUIRE(pv1.get() == 5);
+        REQUIRE(j.group_stats(g).processed_tasks == 1);
+        REQUIRE(j.group_stats(g).running_tasks == 0);
+        REQUIRE(j.cpu_times().count(5));
+
+        release = true;
+        REQUIRE_NOTHROW(pv0.get());
+        REQUIRE(j.wait_all() == jb::jobber_wait_status::no_timeout);
+
+        // the worker queues its own submissions instead of running them inline
+        auto pv2 = j.async([&j](){
+            return j.async([](){ return std::this_thread::get_id(); });
+        });
+        REQUIRE(pv2.get().get() == j.thread_id(0));
+        REQUIRE(j.submit_stats().caller_runs_tasks == 1);
+    }
+    {
+        // a full group does not run more tasks inline
+        jb::jobber_options options;
+        options.caller_runs_depth = 1;
+        jb::jobber j(1, options);
+        const jb::jobber_group g = j.make_group(1, 1);
+
+        std::atomic<bool> started{false};
+        std::atomic<bool> release{false};
+        auto pv0 = j.async(g, [&started, &release](){
+            started = true;
+            while ( !release ) {
+                std::this_thread::yield();
+            }
+        });
+        while ( !started ) {
+            std::this_thread::yield();
+        }
+        auto pv1 = j.async(g, [](){ return std::this_thread::get_id(); });
+        REQUIRE(pv1.wait_for(std::chrono::milliseconds(10)) == jb::promise_wait_status::timeout);
+        release = true;
+        REQUIRE(pv1.get() == j.thread_id(0));
+        REQUIRE_NOTHROW(pv0.get());
+        REQUIRE(j.submit_stats().caller_runs_tasks == 0);
+    }
+}
+
+TEST_CASE("jobber_watchdog") {
+    {
+        jb::jobber j(1);
+        REQUIRE(jb::jobber::current_label() == nullptr);
+        jb::jobber::label_scope scope("outer");
+        auto pv0 = j.async([&j](){
+            return j.async([](){
+                return std::string(jb::jobber::current_label());
+            });
+        });
+        REQUIRE(pv0.get().get() == "outer");
+        REQUIRE(std::string(jb::jobber::current_label()) == "outer");
+    }
+    {
+        std::mutex hung_mutex;
+        std::vector<jb::jobber_hung_task> hung_tasks;
+
+        jb::jobber_options options;
+        options.watchdog_threshold = std::chrono::milliseconds(5);
+        options.watchdog_interval = std::chrono::milliseconds(1);
+        options.watchdog_callback = [&hung_mutex, &hung_tasks](const jb::jobber_hung_task& task){
+            std::lock_guard<std::mutex> guard(hung_mutex);
+            hung_tasks.push_back(task);
+        };
+        options.watchdog_replace = true;
+        jb::jobber j(1, options);
+        auto counters = j.make_local<int>(0);
+        REQUIRE(counters.size() == 2);
+
+        std::atomic<bool> release{false};
+        auto pv0 = [&j, &release](){
+            jb::jobber::label_scope scope("spinner");
+            return j.async([&release](){
+                while ( !release ) {
+                    std::this_thread::yield();
+                }
+            });
+        }();
+
+        while ( j.hung_worker_count() != 1 ) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+
+        // the replacement keeps the pool going while the worker is stuck
+        auto pv1 = j.async([&j, counters](){
+            ++counters.get();
+            return j.worker_index();
+        });
+        REQUIRE(pv1.get() == j.thread_count());
+        REQUIRE(counters[0] == 0);
+        REQUIRE(counters[1] == 1);
+
+        release = true;
+        REQUIRE_NOTHROW(pv0.get());
+        REQUIRE(j.wait_all() == jb::jobber_wait_status::no_timeout);
+        while ( j.hung_worker_count() != 0 ) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+
+        const auto reported = [&hung_mutex, &hung_tasks](){
+            std::lock_guard<std::mutex> guard(hung_mutex);
+            return !hung_tasks.empty();
+        };
+        while ( !reported() ) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+
+        std::lock_guard<std::mutex> guard(hung_mutex);
+        REQUIRE(hung_tasks.size() == 1);
+        REQUIRE(hung_tasks[0].worker == 0);
+        REQUIRE(std::string(hung_tasks[0].label) == "spinner");
+        REQUIRE(hung_tasks[0].running_time >= std::chrono::milliseconds(5));
+    }
+}
+
+TEST_CASE("jobber_cpu_times") {
+    const auto burn = [](std::chrono::milliseconds duration){
+        const auto until = std::chrono::steady_clock::now() + duration;
+        volatile std::size_t counter = 0;
+        while ( std::chrono::steady_clock::now() < until ) {
+            counter = counter + 1;
+        }
+    };
+    jb::jobber_options options;
+    options.cpu_accounting = true;
+    {
+        jb::jobber j(2);
+        {
+            jb::jobber::tag_scope scope(1);
+            j.async(burn, std::chrono::milliseconds(5));
+        }
+        REQUIRE(j.wait_all() == jb::jobber_wait_status::no_timeout);
+        REQUIRE(j.cpu_times().empty());
+    }
+    {
+        jb::jobber j(2, options);
+        REQUIRE(jb::jobber::current_tag() == 0);
+        {
+            jb::jobber::tag_scope scope(1);
+            j.async(burn, std::chrono::milliseconds(20));
+            j.async([&j, &burn](){
+                REQUIRE(jb::jobber::current_tag() == 1);
+                j.async(burn, std::chrono::milliseconds(10));
+            });
+        }
+        {
+            jb::jobber::tag_scope scope(2);
+            j.async([](){
+                std::this_thread::sleep_for(std::chrono::milliseconds(20));
+            });
+        }
+        REQUIRE(j.wait_all() == jb::jobber_wait_status::no_timeout);
+
+        const jb::jobber_cpu_times times = j.cpu_times();
+        REQUIRE(times.count(1));
+        REQUIRE(times.count(2));
+        REQUIRE(times.at(1) > std::chrono::nanoseconds(0));
+    #if defined(__linux__) || defined(__APPLE__)
+        REQUIRE(times.at(2) < times.at(1));
+    #endif
+
+        const jb::jobber_cpu_times worker0 = j.cpu_times(0);
+        const jb::jobber_cpu_times worker1 = j.cpu_times(1);
+        const auto time_of = [](const jb::jobber_cpu_times& worker, std::uint32_t tag){
+            const auto iter = worker.find(tag);
+            return iter != worker.end() ? iter->second : std::chrono::nanoseconds(0);
+        };
+        REQUIRE(time_of(worker0, 1) + time_of(worker1, 1) == times.at(1));
+        REQUIRE(j.cpu_times(2).empty());
+        REQUIRE_THROWS_AS(j.cpu_times(3), std::out_of_range);
+    }
+    {
+        jb::jobber j(0, options);
+        {
+            jb::jobber::tag_scope scope(7);
+            j.async(burn, std::chrono::milliseconds(5));
+        }
+        REQUIRE(j.active_wait_all().second == 1);
+        REQUIRE(j.cpu_times(0).at(7) > std::chrono::nanoseconds(0));
+    }
+    {
+        // helping another jobber does not move time between their accounts
+        jb::jobber a(1, options);
+        jb::jobber b(0, options);
+        {
+            jb::jobber::tag_scope scope(2);
+            b.async(burn, std::chrono::milliseconds(5));
+        }
+        {
+            jb::jobber::tag_scope scope(1);
+            a.async([&b, &burn](){
+                burn(std::chrono::milliseconds(5));
+                REQUIRE(b.active_wait_all().second == 1);
+                burn(std::chrono::milliseconds(5));
+            }).get();
+        }
+        REQUIRE(a.wait_all() == jb::jobber_wait_status::no_timeout);
+        const jb::jobber_cpu_times times_a = a.cpu_times();
+        const jb::jobber_cpu_times times_b = b.cpu_times();
+        REQUIRE(times_a.size() == 1);
+        REQUIRE(times_a.count(1));
+        REQUIRE(times_b.size() == 1);
+        REQUIRE(times_b.count(2));
+    }
+    {
+        // invoke branches are charged to the tag of the invoking task
+        jb::jobber j(2, options);
+        {
+            jb::jobber::tag_scope scope(3);
+            std::atomic<bool> started{false};
+            j.invoke(
+                [&started](){
+                    while ( !started ) {
+                        std::this_thread::yield();
+                    }
+                },
+                [&started, &burn](){
+                    started = true;
+                    burn(std::chrono::milliseconds(5));
+                });
+        }
+        REQUIRE(j.wait_all() == jb::jobber_wait_status::no_timeout);
+        const jb::jobber_cpu_times times = j.cpu_times();
+        REQUIRE(times.size() == 1);
+        REQUIRE(times.at(3) > std::chrono::nanoseconds(0));
+    }
+}
+
+TEST_CASE("jobber_virtual_time") {
+    using namespace std::chrono_literals;
+    struct clock_tag;
+    using clock = jb::virtual_clock<clock_tag>;
+    {
+        clock::reset();
+        jb::jobber j(1);
+        int counter = 0;
+        j.pause();
+        j.async([&counter](){ ++counter; });
+        REQUIRE(j.wait_all_until(clock::now() + 1h) == jb::jobber_wait_status::timeout);
+        REQUIRE(clock::now().time_since_epoch() == 1h);
+        REQUIRE(j.active_wait_all_until(clock::now() + 1h) == std::make_pair(
+            jb::jobber_wait_status::no_timeout,
+            std::size_t(1u)));
+        REQUIRE(counter == 1);
+        REQUIRE(j.wait_all_until(clock::now() + 1h) == jb::jobber_wait_status::no_timeout);
+        REQUIRE(clock::now().time_since_epoch() == 1h);
+    }
+    {
+        clock::reset();
+        jb::jobber j(1);
+        int counter = 0;
+        j.pause();
+        j.async([&counter](){ ++counter; });
+        REQUIRE(j.wait_all_for<clock>(1h) == jb::jobber_wait_status::timeout);
+        REQUIRE(clock::now().time_since_epoch() == 1h);
+        REQUIRE(j.active_wait_all_for<clock>(1h) == std::make_pair(
+            jb::jobber_wait_status::no_timeout,
+            std::size_t(1u)));
+        REQUIRE(counter == 1);
+        REQUIRE(clock::now().time_since_epoch() == 1h);
+    }
+}
@@ -213,6 +213,58 @@ TEST_CASE("get_and_wait") {
     }
 }
 
+TEST_CASE("virtual_clock") {
+    using namespace std::chrono_literals;
+    struct clock_tag;
+    using clock = pr::virtual_clock<clock_tag>;
+    static_assert(pr::is_virtual_clock_v<clock>);
+    static_assert(!pr::is_virtual_clock_v<std::chrono::steady_clock>);
+    {
+        clock::reset();
+        REQUIRE(clock::now().time_since_epoch() == 0s);
+        clock::advance(5s);
+        REQUIRE(clock::now().time_since_epoch() == 5s);
+        clock::advance(-1s);
+        clock::advance_to(clock::time_point(2s));
+        REQUIRE(clock::now().time_since_epoch() == 5s);
+        clock::advance_to(clock::time_point(1h));
+        REQUIRE(clock::now().time_since_epoch() == 1h);
+        REQUIRE(pr::virtual_clock<>::now().time_since_epoch() == 0s);
+    }
+    {
+        clock::reset();
+        auto p1 = pr::promise<int>();
+        auto p2 = pr::promise<void>();
+        const auto time_begin = std::chrono::steady_clock::now();
+        REQUIRE(p1.wait_until(clock::now() + 24h) == pr::promise_wait_status::timeout);
+        REQUIRE(clock::now().time_since_epoch() == 24h);
+        REQUIRE(p2.wait_until(clock::now() + 1h) == pr::promise_wait_status::timeout);
+        REQUIRE(clock::now().time_since_epoch() == 25h);
+        REQUIRE(std::chrono::steady_clock::now() - time_begin < 1s);
+        p1.resolve(42);
+        p2.resolve();
+        REQUIRE(p1.wait_until(clock::now() + 1h) == pr::promise_wait_status::no_timeout);
+        REQUIRE(p2.wait_until(clock::now() + 1h) == pr::promise_wait_status::no_timeout);
+        REQUIRE(clock::now().time_since_epoch() == 25h);
+    }
+    {
+        clock::reset();
+        auto p1 = pr::promise<int>();
+        auto p2 = pr::promise<void>();
+        const auto time_begin = std::chrono::steady_clock::now();
+        REQUIRE(p1.wait_for<clock>(24h) == pr::promise_wait_status::timeout);
+        REQUIRE(clock::now().time_since_epoch() == 24h);
+        REQUIRE(p2.wait_for<clock>(1h) == pr::promise_wait_status::timeout);
+        REQUIRE(clock::now().time_since_epoch() == 25h);
+        REQUIRE(std::chrono::steady_clock::now() - time_begin < 1s);
+        p1.resolve(42);
+        p2.resolve();
+        REQUIRE(p1.wait_for<clock>(1h) == pr::promise_wait_status::no_timeout);
+        REQUIRE(p2.wait_for<clock>(1h) == pr::promise_wait_status::no_timeout);
+        REQUIRE(clock::now().time_since_epoch() == 25h);
+    }
+}
+
 TEST_CASE("promise_transformations") {
     {
         auto p_v = pr::promise<int>()
@@ -0,0 +1,221 @@
+/*******************************************************************************
+ * This file is part of the "https://github.com/blackmatov/promise.hpp"
+ * For conditions of distribution and use, see copyright notice in LICENSE.md
+ * Copyright (C) 2018-2023, by Matvey Cherevko (blackmatov@gmail.com)
+ ******************************************************************************/
+
+#include <promise.hpp/bonus/runtime.hpp>
+#include <doctest/doctest.h>
+
+#include <thread>
+#include <ctime>
+#include <numeric>
+
+namespace rt = runtime_hpp;
+namespace tq = task_queue_hpp;
+
+TEST_CASE("task_ring") {
+    {
+        tq::task_ring r(3);
+        REQUIRE(r.empty());
+        REQUIRE(r.capacity() == 4);
+        REQUIRE_FALSE(r.try_pop());
+
+        for ( int i = 0; i < 4; ++i ) {
+            tq::task_ptr t = std::make_unique<tq::concrete_task<int, int(*)(int), int>>(
+                [](int v){ return v; }, std::make_tuple(i));
+            REQUIRE(r.try_push(t));
+            REQUIRE_FALSE(t);
+        }
+        tq::task_ptr extra = std::make_unique<tq::concrete_task<int, int(*)(int), int>>(
+            [](int v){ return v; }, std::make_tuple(4));
+        REQUIRE_FALSE(r.try_push(extra));
+        REQUIRE(extra);
+        REQUIRE_FALSE(r.empty());
+
+        REQUIRE(r.try_pop());
+        REQUIRE(r.try_push(extra));
+        REQUIRE_FALSE(extra);
+    }
+    {
+        tq::task_ring r(16);
+        std::atomic<int> sum{0};
+        std::thread producer([&r, &sum](){
+            for ( int i = 1; i <= 1000; ++i ) {
+                tq::task_ptr t = std::make_unique<tq::concrete_task<void, std::function<void()>>>(
+                    [&sum, i](){ sum += i; }, std::make_tuple());
+                while ( !r.try_push(t) ) {
+                    std::this_thread::yield();
+                }
+            }
+        });
+        int popped = 0;
+        while ( popped < 1000 ) {
+            if ( tq::task_ptr t = r.try_pop() ) {
+                t->run();
+                ++popped;
+            } else {
+                std::this_thread::yield();
+            }
+        }
+        producer.join();
+        REQUIRE(r.empty());
+        REQUIRE(sum == 500500);
+    }
+}
+
+TEST_CASE("runtime") {
+    {
+        rt::runtime r(3);
+        REQUIRE(r.core_count() == 3);
+        REQUIRE(r.current_core() == rt::runtime::npos);
+        for ( std::size_t i = 0; i < r.core_count(); ++i ) {
+            REQUIRE(r.submit_to(i, [&r](){ return r.current_core(); }).get() == i);
+        }
+        REQUIRE_THROWS_AS(r.submit_to(1, [](){ throw std::logic_error("error"); }).get(), std::logic_error);
+    }
+    {
+        // the promise of a cross-core submission settles on the submitter's core
+        rt::runtime r(2);
+        auto pv = r.submit_to(0, [&r](){
+            return r.submit_to(1, [&r](int v){
+                return std::make_pair(r.current_core(), v);
+            }, 40).then([&r](std::pair<std::size_t, int> v){
+                return std::make_tuple(v.first, v.second + 2, r.current_core());
+            });
+        }).get().get();
+        REQUIRE(std::get<0>(pv) == 1);
+        REQUIRE(std::get<1>(pv) == 42);
+        REQUIRE(std::get<2>(pv) == 0);
+
+        std::atomic<bool> done{false};
+        r.submit_to(1, [&r, &done](){
+            return r.submit_to(0, [&done](){
+                done = true;
+            });
+        }).get().get();
+        REQUIRE(done);
+    }
+    {
+        // a full ring spills into the backlog without reordering
+        rt::runtime r(2, rt::runtime_options{2, false});
+        std::vector<int> order;
+        auto pv = r.submit_to(0, [&r, &order](){
+            std::vector<rt::promise<int>> pvs;
+            for ( int i = 0; i < 1000; ++i ) {
+                pvs.push_back(r.submit_to(1, [&order, i](){
+                    order.push_back(i);
+                    return i;
+                }));
+            }
+            return rt::make_all_promise(std::move(pvs));
+        }).get();
+        pv.get();
+        REQUIRE(order.size() == 1000);
+        std::vector<int> expected(1000);
+        std::iota(expected.begin(), expected.end(), 0);
+        REQUIRE(order == expected);
+    }
+    {
+        // a sender with a backlog parks until the target drains its ring
+        rt::runtime r(2, rt::runtime_options{1, false});
+        std::atomic<bool> blocked{false};
+        auto pv0 = r.submit_to(1, [&blocked](){
+            blocked = true;
+            std::this_thread::sleep_for(std::chrono::milliseconds(200));
+        });
+        while ( !blocked ) {
+            std::this_thread::yield();
+        }
+        const std::clock_t clock_begin = std::clock();
+        auto pv1 = r.submit_to(0, [&r](){
+            std::vector<rt::promise<int>> pvs;
+            for ( int i = 0; i < 10; ++i ) {
+                pvs.push_back(r.submit_to(1, [i](){ return i; }));
+            }
+            return rt::make_all_promise(std::move(pvs));
+        }).get();
+        REQUIRE(pv1.get().size() == 10);
+        const std::clock_t clock_end = std::clock();
+        REQUIRE(clock_end - clock_begin < CLOCKS_PER_SEC / 10);
+        pv0.get();
+    }
+    {
+        // submissions from many cores and threads wake the parked cores
+        rt::runtime r(4);
+        std::atomic<int> counter{0};
+        std::vector<rt::promise<std::vector<int>>> pvs;
+        for ( std::size_t i = 0; i < 4; ++i ) {
+            pvs.push_back(r.submit_to(i, [&r, &counter, i](){
+                std::vector<rt::promise<int>> inner;
+                for ( std::size_t j = 0; j < 100; ++j ) {
+                    inner.push_back(r.submit_to((i + j) % 4, [&counter](){
+                        return ++counter;
+                    }));
+                }
+                return rt::make_all_promise(std::move(inner));
+            }).then([](rt::promise<std::vector<int>> inner){
+                return inner;
+            }));
+        }
+        rt::make_all_promise(std::move(pvs)).get();
+        REQUIRE(counter == 400);
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        REQUIRE(r.submit_to(3, [](){ return 42; }).get() == 42);
+    }
+    {
+        // a parked core wakes up for the timers of its scheduler
+        rt::runtime r(2);
+        const auto time_now = std::chrono::steady_clock::now();
+        auto pv = r.submit_to(1, [&r](){
+            return r.scheduler(1).schedule_after(std::chrono::milliseconds(20), [&r](){
+                return r.current_core();
+            }).first;
+        }).get();
+        REQUIRE(pv.get() == 1);
+        REQUIRE(std::chrono::steady_clock::now() - time_now >= std::chrono::milliseconds(20));
+    }
+    {
+        rt::promise<int> pv0;
+        rt::promise<int> pv1;
+        {
+            rt::runtime r(1);
+            std::atomic<bool> started{false};
+            pv0 = r.submit_to(0, [&started](){
+                started = true;
+                std::this_thread::sleep_for(std::chrono::milliseconds(50));
+                return 1;
+            });
+            while ( !started ) {
+                std::this_thread::yield();
+            }
+            pv1 = r.submit_to(0, [](){ return 2; });
+        }
+        REQUIRE(pv0.get() == 1);
+        REQUIRE_THROWS_AS(pv1.get(), rt::runtime_cancelled_exception);
+    }
+    {
+        // a reply still in flight at the shutdown keeps the computed result
+        rt::promise<int> pv0;
+        {
+            rt::runtime r(2);
+            std::atomic<bool> computed{false};
+            std::atomic<bool> sent{false};
+            r.submit_to(0, [&r, &pv0, &computed, &sent](){
+                pv0 = r.submit_to(1, [&computed](){
+                    computed = true;
+                    return 42;
+                });
+                sent = true;
+                while ( !computed ) {
+                    std::this_thread::yield();
+                }
+                std::this_thread::sleep_for(std::chrono::milliseconds(50));
+            });
+            while ( !sent || !computed ) {
+                std::this_thread::yield();
+            }
+        }
+        REQUIRE(pv0.get() == 42);
+    }
+}
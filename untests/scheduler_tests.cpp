@@ -9,11 +9,14 @@
 
 #include <thread>
 #include <numeric>
-#include <iostream>
 
 #include <cmath>
 #include <cstring>
 
+#if defined(__linux__)
+#  include <poll.h>
+#endif
+
 namespace sd = scheduler_hpp;
 
 TEST_CASE("scheduler") {
@@ -175,3 +178,679 @@ TEST_CASE("scheduler") {
         REQUIRE(accumulator == "hello");
     }
 }
+
+TEST_CASE("scheduler_queue_policies") {
+    const auto check_order = [](auto& s, const std::string& expected){
+        std::string accumulator;
+        const auto append = [&accumulator](char c){
+            accumulator.push_back(c);
+        };
+        s.schedule(sd::scheduler_priority::normal, append, 'a');
+        s.schedule(sd::scheduler_priority::lowest, append, 'b');
+        s.schedule(sd::scheduler_priority::normal, append, 'c');
+        s.schedule(sd::scheduler_priority::highest, append, 'd');
+        s.schedule(sd::scheduler_priority::normal, append, 'e');
+        REQUIRE(s.process_all_tasks() == std::make_pair(
+            sd::scheduler_processing_status::done,
+            std::size_t(5u)));
+        REQUIRE(accumulator == expected);
+    };
+    {
+        sd::basic_scheduler<task_queue_hpp::priority_fifo_policy> s;
+        check_order(s, "daceb");
+    }
+    {
+        sd::basic_scheduler<task_queue_hpp::priority_lifo_policy> s;
+        check_order(s, "decab");
+    }
+    {
+        sd::basic_scheduler<task_queue_hpp::earliest_deadline_policy> s;
+        check_order(s, "daceb");
+    }
+    {
+        sd::basic_scheduler<task_queue_hpp::mpmc_fifo_policy<4>> s;
+        check_order(s, "daceb");
+    }
+}
+
+TEST_CASE("scheduler_producers") {
+    for ( std::size_t producers : {1u, 2u, 4u, 8u, 16u} ) {
+        sd::basic_scheduler<task_queue_hpp::priority_fifo_policy> s;
+        const std::size_t tasks_per_producer = 2000;
+        std::vector<std::size_t> last_values(producers, 0);
+        std::atomic<std::size_t> finished_producers{0};
+        bool ordered = true;
+
+        std::vector<std::thread> threads;
+        for ( std::size_t p = 0; p < producers; ++p ) {
+            threads.emplace_back([&s, &last_values, &finished_producers, &ordered, p, tasks_per_producer](){
+                for ( std::size_t i = 1; i <= tasks_per_producer; ++i ) {
+                    s.schedule([&last_values, &ordered, p, i](){
+                        ordered = ordered && last_values[p] + 1 == i;
+                        last_values[p] = i;
+                    });
+                }
+                ++finished_producers;
+            });
+        }
+
+        std::size_t processed = 0;
+        while ( processed < producers * tasks_per_producer ) {
+            processed += s.process_all_tasks().second;
+            if ( finished_producers < producers ) {
+                std::this_thread::yield();
+            }
+        }
+
+        for ( std::thread& thread : threads ) {
+            thread.join();
+        }
+
+        REQUIRE(ordered);
+        REQUIRE(processed == producers * tasks_per_producer);
+        for ( std::size_t value : last_values ) {
+            REQUIRE(value == tasks_per_producer);
+        }
+    }
+}
+
+TEST_CASE("scheduler_local_tasks") {
+    {
+        sd::basic_scheduler<task_queue_hpp::priority_fifo_policy> s;
+        std::string accumulator;
+        s.schedule([&s, &accumulator](){
+            accumulator.push_back('a');
+            s.schedule([&accumulator](){ accumulator.push_back('c'); });
+            s.schedule(sd::scheduler_priority::highest, [&s, &accumulator](){
+                accumulator.push_back('b');
+                s.schedule([&accumulator](){ accumulator.push_back('e'); });
+            });
+        });
+        s.schedule([&accumulator](){ accumulator.push_back('d'); });
+        REQUIRE(s.process_one_task().second == 1);
+        REQUIRE(accumulator == "a");
+        REQUIRE(s.process_all_tasks() == std::make_pair(
+            sd::scheduler_processing_status::done,
+            std::size_t(4u)));
+        REQUIRE(accumulator == "abdce");
+    }
+    {
+        sd::scheduler s1;
+        sd::scheduler s2;
+        int counter = 0;
+        s1.schedule([&s1, &s2, &counter](){
+            s2.schedule([&s1, &counter](){
+                s1.schedule([&counter](){ ++counter; });
+            });
+            REQUIRE(s2.process_all_tasks().second == 1);
+        });
+        REQUIRE(s1.process_all_tasks().second == 2);
+        REQUIRE(counter == 1);
+    }
+    {
+        auto pv0 = sd::promise<int>();
+        {
+            sd::scheduler s;
+            s.schedule([&s, &pv0](){
+                pv0 = s.schedule([](){ return 42; });
+            });
+            REQUIRE(s.process_one_task().second == 1);
+        }
+        REQUIRE_THROWS_AS(pv0.get(), sd::scheduler_cancelled_exception);
+    }
+    {
+        // a task can wait for the work it schedules while another thread processes
+        sd::scheduler s;
+        std::atomic<bool> outer_started{false};
+        std::atomic<bool> other_started{false};
+        auto pv0 = s.schedule([&s, &outer_started, &other_started](){
+            outer_started = true;
+            while ( !other_started ) {
+                std::this_thread::yield();
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(20));
+            auto pv1 = s.schedule([](){ return 42; });
+            return pv1.wait_for(std::chrono::seconds(5)) == sd::promise_wait_status::no_timeout
+                ? pv1.get()
+                : 0;
+        });
+        std::thread t([&s](){
+            s.process_one_task();
+        });
+        while ( !outer_started ) {
+            std::this_thread::yield();
+        }
+        other_started = true;
+        REQUIRE(s.process_all_tasks() == std::make_pair(
+            sd::scheduler_processing_status::done,
+            std::size_t(1u)));
+        t.join();
+        REQUIRE(pv0.get() == 42);
+    }
+}
+
+TEST_CASE("scheduler_wakeup_fd") {
+#if defined(__linux__)
+    const auto is_readable = [](int fd, int timeout_ms){
+        pollfd pfd{fd, POLLIN, 0};
+        return ::poll(&pfd, 1, timeout_ms) == 1 && (pfd.revents & POLLIN);
+    };
+    {
+        sd::scheduler s;
+        const int fd = s.wakeup_fd();
+        REQUIRE(fd != -1);
+        REQUIRE(s.wakeup_fd() == fd);
+        REQUIRE_FALSE(is_readable(fd, 0));
+
+        int counter = 0;
+        std::thread([&s, &counter](){
+            for ( int i = 0; i < 3; ++i ) {
+                s.schedule([&counter](){ ++counter; });
+            }
+        }).join();
+        REQUIRE(is_readable(fd, 1000));
+
+        REQUIRE(s.process_pending_tasks() == std::make_pair(
+            sd::scheduler_processing_status::done,
+            std::size_t(3u)));
+        REQUIRE(counter == 3);
+
+        s.schedule([&counter](){ ++counter; });
+        REQUIRE(is_readable(fd, 0));
+        REQUIRE(s.process_pending_tasks().second == 1u);
+        REQUIRE_FALSE(is_readable(fd, 0));
+        REQUIRE(counter == 4);
+        REQUIRE(s.process_pending_tasks().second == 0u);
+    }
+    {
+        sd::scheduler s;
+        s.schedule([](){});
+        const int fd = s.wakeup_fd();
+        REQUIRE(is_readable(fd, 0));
+        REQUIRE(s.process_pending_tasks().second == 1u);
+        REQUIRE_FALSE(is_readable(fd, 0));
+    }
+    {
+        // a due timer makes the descriptor readable
+        sd::scheduler s;
+        const int fd = s.wakeup_fd();
+        int counter = 0;
+        s.schedule_after(std::chrono::milliseconds(20), [&counter](){ ++counter; });
+        REQUIRE_FALSE(is_readable(fd, 0));
+        REQUIRE(s.process_pending_tasks().second == 0u);
+        REQUIRE(is_readable(fd, 1000));
+        REQUIRE(s.process_pending_tasks().second == 1u);
+        REQUIRE(counter == 1);
+        REQUIRE_FALSE(is_readable(fd, 0));
+    }
+    {
+        // a task rescheduling itself runs once per call and keeps the readiness
+        sd::scheduler s;
+        const int fd = s.wakeup_fd();
+        int counter = 0;
+        std::function<void()> again;
+        again = [&s, &counter, &again](){
+            ++counter;
+            s.schedule(again);
+        };
+        s.schedule(again);
+        for ( int i = 1; i <= 3; ++i ) {
+            REQUIRE(s.process_pending_tasks().second == 1u);
+            REQUIRE(counter == i);
+            REQUIRE(is_readable(fd, 0));
+        }
+    }
+    {
+        // work left behind by the other processing calls is signalled too
+        sd::scheduler s;
+        const int fd = s.wakeup_fd();
+        s.schedule([](){});
+        s.schedule([](){});
+        REQUIRE(s.process_pending_tasks().second == 2u);
+        REQUIRE_FALSE(is_readable(fd, 0));
+        s.schedule([](){});
+        s.schedule([](){});
+        REQUIRE(s.process_one_task().second == 1u);
+        REQUIRE(is_readable(fd, 0));
+        REQUIRE(s.process_pending_tasks().second == 1u);
+        REQUIRE_FALSE(is_readable(fd, 0));
+    }
+    {
+        // and the other processing calls clear the readiness they drain
+        sd::scheduler s;
+        const int fd = s.wakeup_fd();
+        s.schedule([](){});
+        REQUIRE(is_readable(fd, 0));
+        REQUIRE(s.process_one_task().second == 1u);
+        REQUIRE_FALSE(is_readable(fd, 0));
+        s.schedule([](){});
+        REQUIRE(is_readable(fd, 0));
+        REQUIRE(s.process_all_tasks().second == 1u);
+        REQUIRE_FALSE(is_readable(fd, 0));
+        s.schedule([](){});
+        REQUIRE(is_readable(fd, 0));
+        REQUIRE(s.process_tasks_for(std::chrono::milliseconds(100)).second == 1u);
+        REQUIRE_FALSE(is_readable(fd, 0));
+    }
+#endif
+}
+
+TEST_CASE("scheduler_timers") {
+    using namespace std::chrono_literals;
+    using clock = std::chrono::steady_clock;
+    {
+        sd::scheduler s;
+        std::string accumulator;
+        const auto start = clock::now();
+        s.schedule_after(30ms, [&accumulator](){ accumulator.push_back('c'); });
+        s.schedule_after(10ms, [&accumulator](){ accumulator.push_back('a'); });
+        s.schedule_at(start + 20ms, [&accumulator](){ accumulator.push_back('b'); });
+        REQUIRE(s.process_one_task().second == 0u);
+        REQUIRE(s.process_tasks_for(5s) == std::make_pair(
+            sd::scheduler_processing_status::done,
+            std::size_t(3u)));
+        REQUIRE(accumulator == "abc");
+        REQUIRE(clock::now() - start >= 30ms);
+        REQUIRE(clock::now() - start < 5s);
+    }
+    {
+        sd::scheduler s;
+        auto [pv0, handle] = s.schedule_after(0ms, [](){ return 42; });
+        REQUIRE(handle.valid());
+        REQUIRE(s.process_one_task().second == 1u);
+        REQUIRE(pv0.get() == 42);
+        REQUIRE_FALSE(handle.cancel());
+    }
+    {
+        sd::scheduler s;
+        auto [pv0, handle] = s.schedule_after(1h, [](){ return 42; });
+        REQUIRE(handle.cancel());
+        REQUIRE_FALSE(handle.cancel());
+        REQUIRE_THROWS_AS(pv0.get(), sd::scheduler_task_cancelled_exception);
+        const auto start = clock::now();
+        REQUIRE(s.process_tasks_for(5s) == std::make_pair(
+            sd::scheduler_processing_status::done,
+            std::size_t(0u)));
+        REQUIRE(clock::now() - start < 1s);
+    }
+    {
+        // a cancelled timer behind a live one is dropped once it reaches the front
+        sd::scheduler s;
+        auto [pv0, handle] = s.schedule_after(1h, [](){ return 42; });
+        auto [pv1, handle1] = s.schedule_after(10ms, [](){ return 24; });
+        REQUIRE(handle.cancel());
+        const auto start = clock::now();
+        REQUIRE(s.process_tasks_for(5s) == std::make_pair(
+            sd::scheduler_processing_status::done,
+            std::size_t(1u)));
+        REQUIRE(clock::now() - start < 1s);
+        REQUIRE(pv1.get() == 24);
+    }
+    {
+        sd::scheduler s;
+        int counter = 0;
+        auto [pv0, handle] = s.schedule_every(5ms, [&counter](){ ++counter; });
+        const auto start = clock::now();
+        while ( counter < 3 && clock::now() - start < 5s ) {
+            s.process_tasks_for(10ms);
+        }
+        REQUIRE(counter >= 3);
+        REQUIRE(handle.cancel());
+        REQUIRE_THROWS_AS(pv0.get(), sd::scheduler_task_cancelled_exception);
+        const int last_counter = counter;
+        REQUIRE(s.process_tasks_for(20ms).second <= 1u);
+        REQUIRE(counter == last_counter);
+    }
+    {
+        sd::scheduler s;
+        int counter = 0;
+        auto [pv0, handle] = s.schedule_every(1ms, [&counter](){
+            if ( ++counter == 2 ) {
+                throw std::logic_error("stop");
+            }
+        });
+        REQUIRE(s.process_tasks_for(5s) == std::make_pair(
+            sd::scheduler_processing_status::done,
+            std::size_t(2u)));
+        REQUIRE(counter == 2);
+        REQUIRE_THROWS_AS(pv0.get(), std::logic_error);
+        REQUIRE_FALSE(handle.cancel());
+    }
+    {
+        sd::scheduler s;
+        s.schedule_after(1h, [](){});
+        clock::time_point run_time;
+        std::thread t([&s, &run_time](){
+            std::this_thread::sleep_for(20ms);
+            s.schedule_after(10ms, [&run_time](){ run_time = clock::now(); });
+        });
+        const auto start = clock::now();
+        REQUIRE(s.process_tasks_for(2s) == std::make_pair(
+            sd::scheduler_processing_status::timeout,
+            std::size_t(1u)));
+        t.join();
+        REQUIRE(run_time - start >= 30ms);
+        REQUIRE(run_time - start < 1s);
+    }
+    {
+        auto pv0 = sd::promise<int>();
+        auto pv1 = sd::promise<void>();
+        {
+            sd::scheduler s;
+            pv0 = s.schedule_after(1h, [](){ return 42; }).first;
+            pv1 = s.schedule_every(1h, [](){}).first;
+        }
+        REQUIRE_THROWS_AS(pv0.get(), sd::scheduler_cancelled_exception);
+        REQUIRE_THROWS_AS(pv1.get(), sd::scheduler_cancelled_exception);
+    }
+}
+
+TEST_CASE("scheduler_batches") {
+    using namespace std::chrono_literals;
+    {
+        sd::basic_scheduler<task_queue_hpp::priority_fifo_policy> s;
+        std::string accumulator;
+        for ( char c : std::string("abcd") ) {
+            s.schedule([&accumulator, c](){
+                accumulator.push_back(c);
+                std::this_thread::sleep_for(20ms);
+            });
+        }
+        const auto result = s.process_tasks_for(30ms);
+        REQUIRE(result.first == sd::scheduler_processing_status::timeout);
+        REQUIRE(result.second >= 1u);
+        REQUIRE(result.second <= 3u);
+        s.schedule([&accumulator](){ accumulator.push_back('e'); });
+        REQUIRE(s.process_all_tasks().second == 5u - result.second);
+        REQUIRE(accumulator == "abcde");
+    }
+    {
+        sd::scheduler s;
+        const std::size_t task_count = 100000;
+        std::size_t counter = 0;
+        for ( std::size_t i = 0; i < task_count; ++i ) {
+            s.schedule([&counter](){ ++counter; });
+        }
+        REQUIRE(s.process_all_tasks().second == task_count);
+        REQUIRE(counter == task_count);
+    }
+}
+
+TEST_CASE("scheduler_frame_budget") {
+    using namespace std::chrono_literals;
+    using scheduler_t = sd::basic_scheduler<task_queue_hpp::priority_fifo_policy>;
+    {
+        REQUIRE(scheduler_t::current_category() == 0u);
+        scheduler_t::category_scope scope1(1);
+        REQUIRE(scheduler_t::current_category() == 1u);
+        {
+            scheduler_t::category_scope scope2(2);
+            REQUIRE(scheduler_t::current_category() == 2u);
+        }
+        REQUIRE(scheduler_t::current_category() == 1u);
+    }
+    {
+        scheduler_t s;
+        std::string accumulator;
+        {
+            scheduler_t::category_scope scope(1);
+            s.schedule([](){ std::this_thread::sleep_for(100ms); });
+        }
+        REQUIRE(s.process_all_tasks().second == 1u);
+        REQUIRE(s.category_cost(1) >= 100ms);
+        REQUIRE(s.category_cost(2) == 0ms);
+
+        s.schedule([&accumulator](){ accumulator.push_back('a'); });
+        {
+            scheduler_t::category_scope scope(1);
+            s.schedule([&accumulator](){ accumulator.push_back('b'); });
+        }
+        s.schedule([&accumulator](){ accumulator.push_back('c'); });
+
+        REQUIRE(s.process_tasks_for(50ms) == std::make_pair(
+            sd::scheduler_processing_status::timeout,
+            std::size_t(1u)));
+        REQUIRE(accumulator == "a");
+        REQUIRE(s.frame_stats().processed_tasks == 1u);
+        REQUIRE(s.frame_stats().deferred_tasks == 1u);
+        REQUIRE(s.frame_stats().budget > 0ms);
+        REQUIRE(s.frame_stats().budget <= 50ms);
+
+        REQUIRE(s.process_tasks_for(1s) == std::make_pair(
+            sd::scheduler_processing_status::done,
+            std::size_t(2u)));
+        REQUIRE(accumulator == "abc");
+        REQUIRE(s.frame_stats().deferred_tasks == 0u);
+    }
+    {
+        // a task arriving mid-frame is budgeted against the time left after the wait
+        scheduler_t s;
+        std::string accumulator;
+        {
+            scheduler_t::category_scope scope(4);
+            s.schedule([](){ std::this_thread::sleep_for(30ms); });
+        }
+        REQUIRE(s.process_all_tasks().second == 1u);
+        REQUIRE(s.category_cost(4) >= 30ms);
+
+        s.schedule([&accumulator](){ accumulator.push_back('a'); });
+        {
+            scheduler_t::category_scope scope(4);
+            s.schedule_after(40ms, [&accumulator](){ accumulator.push_back('b'); });
+        }
+        REQUIRE(s.process_tasks_for(60ms) == std::make_pair(
+            sd::scheduler_processing_status::timeout,
+            std::size_t(1u)));
+        REQUIRE(accumulator == "a");
+        REQUIRE(s.frame_stats().deferred_tasks == 1u);
+        REQUIRE(s.frame_stats().clock_reads >= 3u);
+
+        REQUIRE(s.process_tasks_for(1s).second == 1u);
+        REQUIRE(accumulator == "ab");
+    }
+    {
+        scheduler_t s;
+        const std::size_t task_count = 1000;
+        std::size_t counter = 0;
+        scheduler_t::category_scope scope(3);
+        for ( std::size_t i = 0; i < task_count; ++i ) {
+            s.schedule([&counter](){ ++counter; });
+        }
+        REQUIRE(s.process_tasks_for(10s) == std::make_pair(
+            sd::scheduler_processing_status::done,
+            task_count));
+        REQUIRE(counter == task_count);
+        REQUIRE(s.frame_stats().processed_tasks == task_count);
+        REQUIRE(s.frame_stats().clock_reads < task_count / 2);
+    }
+}
+
+TEST_CASE("scheduler_coalesced") {
+    {
+        sd::scheduler s;
+        sd::scheduler_coalesced_tasks<std::string, int> tasks;
+        int runs = 0;
+        std::vector<sd::promise<int>> promises;
+        for ( int i = 0; i < 100; ++i ) {
+            promises.push_back(s.schedule_coalesced(tasks, std::string("refresh"), [&runs](int v){
+                ++runs;
+                return v;
+            }, i));
+        }
+        promises.push_back(s.schedule_coalesced(tasks, std::string("other"), [&runs](){
+            ++runs;
+            return -1;
+        }));
+        REQUIRE(tasks.size() == 2u);
+        REQUIRE(s.process_all_tasks().second == 2u);
+        REQUIRE(runs == 2);
+        REQUIRE(tasks.size() == 0u);
+        for ( std::size_t i = 0; i < 100; ++i ) {
+            REQUIRE(promises[i].get() == 99);
+        }
+        REQUIRE(promises.back().get() == -1);
+    }
+    {
+        sd::scheduler s;
+        sd::scheduler_coalesced_tasks<int, int> tasks(sd::scheduler_coalesce_policy::first);
+        auto pv0 = s.schedule_coalesced(tasks, 1, [](){ return 1; });
+        auto pv1 = s.schedule_coalesced(tasks, 1, [](){ return 2; });
+        REQUIRE(s.process_all_tasks().second == 1u);
+        REQUIRE(pv0.get() == 1);
+        REQUIRE(pv1.get() == 1);
+    }
+    {
+        // a pending key keeps the priority of its first call
+        sd::scheduler s;
+        sd::scheduler_coalesced_tasks<int, void> tasks;
+        std::string accumulator;
+        s.schedule([&accumulator](){ accumulator.push_back('a'); });
+        s.schedule_coalesced(sd::scheduler_priority::highest, tasks, 1, [&accumulator](){
+            accumulator.push_back('b');
+        });
+        s.schedule_coalesced(sd::scheduler_priority::lowest, tasks, 1, [&accumulator](){
+            accumulator.push_back('c');
+        });
+        REQUIRE(s.process_all_tasks().second == 2u);
+        REQUIRE(accumulator == "ca");
+    }
+    {
+        sd::scheduler s;
+        sd::scheduler_coalesced_tasks<int, void> tasks;
+        int runs = 0;
+        s.schedule_coalesced(tasks, 1, [&](){
+            ++runs;
+            s.schedule_coalesced(tasks, 1, [&runs](){ ++runs; });
+        });
+        auto pv0 = s.schedule_coalesced(tasks, 2, [](){
+            throw std::logic_error("refresh");
+        });
+        REQUIRE(s.process_all_tasks().second == 3u);
+        REQUIRE(runs == 2);
+        REQUIRE_THROWS_AS(pv0.get(), std::logic_error);
+    }
+    {
+        sd::scheduler_coalesced_tasks<int, int> tasks;
+        auto pv0 = sd::promise<int>();
+        {
+            sd::scheduler s;
+            pv0 = s.schedule_coalesced(tasks, 1, [](){ return 1; });
+        }
+        REQUIRE_THROWS_AS(pv0.get(), sd::scheduler_cancelled_exception);
+        REQUIRE(tasks.size() == 0u);
+    }
+}
+
+TEST_CASE("scheduler_virtual_time") {
+    using namespace std::chrono_literals;
+    struct clock_tag;
+    using clock = sd::virtual_clock<clock_tag>;
+    {
+        clock::reset();
+        sd::virtual_scheduler<clock_tag> s;
+        std::vector<clock::duration> fired;
+        std::size_t ticks = 0;
+        s.schedule_after(1h, [&fired](){
+            fired.push_back(clock::now().time_since_epoch());
+        });
+        s.schedule_at(clock::time_point(30min), [&fired](){
+            fired.push_back(clock::now().time_since_epoch());
+        });
+        auto [pv0, handle] = s.schedule_every(10min, [&ticks](){ ++ticks; });
+
+        const auto time_begin = std::chrono::steady_clock::now();
+        REQUIRE(s.process_tasks_until(clock::time_point(24h + 5min)).first
+            == sd::scheduler_processing_status::timeout);
+        REQUIRE(std::chrono::steady_clock::now() - time_begin < 5s);
+
+        REQUIRE(clock::now().time_since_epoch() == 24h + 5min);
+        REQUIRE(fired == std::vector<clock::duration>{30min, 1h});
+        REQUIRE(ticks == 144u);
+
+        REQUIRE(handle.cancel());
+        REQUIRE(s.process_tasks_for(1h) == std::make_pair(
+            sd::scheduler_processing_status::done,
+            std::size_t(0u)));
+        REQUIRE(clock::now().time_since_epoch() == 24h + 5min);
+        REQUIRE(ticks == 144u);
+    }
+    {
+        clock::reset();
+        sd::virtual_scheduler<clock_tag> s;
+        std::string accumulator;
+        s.schedule_after(2s, [&accumulator](){ accumulator.push_back('c'); });
+        s.schedule_after(1s, [&accumulator](){ accumulator.push_back('a'); });
+        s.schedule_after(1s, [&accumulator](){ accumulator.push_back('b'); });
+        s.schedule([&accumulator](){ accumulator.push_back('0'); });
+        REQUIRE(s.process_tasks_for(1h) == std::make_pair(
+            sd::scheduler_processing_status::done,
+            std::size_t(4u)));
+        REQUIRE(accumulator == "0abc");
+        REQUIRE(clock::now().time_since_epoch() == 2s);
+    }
+}
+
+TEST_CASE("scheduler_instrumentation") {
+    using namespace std::chrono_literals;
+    struct clock_tag;
+    using clock = sd::virtual_clock<clock_tag>;
+    using instrumented_scheduler = sd::basic_scheduler<
+        task_queue_hpp::priority_fifo_policy,
+        clock,
+        true>;
+    REQUIRE(sizeof(sd::scheduler) < sizeof(sd::instrumented_scheduler));
+    {
+        clock::reset();
+        instrumented_scheduler s;
+        const auto step = [](){ clock::advance(5ms); };
+        s.schedule(step);
+        s.schedule(step);
+        s.schedule(step);
+        s.schedule(sd::scheduler_priority::highest, step);
+
+        const auto normal = static_cast<std::size_t>(sd::scheduler_priority::normal);
+        const auto highest = static_cast<std::size_t>(sd::scheduler_priority::highest);
+        sd::scheduler_stats stats = s.stats();
+        REQUIRE(stats.priorities[normal].backlog == 3u);
+        REQUIRE(stats.priorities[highest].backlog == 1u);
+        REQUIRE(stats.calls == 0u);
+
+        REQUIRE(s.process_all_tasks().second == 4u);
+        stats = s.stats();
+        REQUIRE(stats.priorities[normal].backlog == 0u);
+        REQUIRE(stats.priorities[highest].backlog == 0u);
+
+        // the highest task ran at once, the normal ones waited 5, 10 and 15ms
+        REQUIRE(stats.priorities[highest].wait_time.count() == 1u);
+        REQUIRE(stats.priorities[highest].wait_time.percentile(1.0) == 1ns);
+        REQUIRE(stats.priorities[normal].wait_time.count() == 3u);
+        REQUIRE(stats.priorities[normal].wait_time.percentile(0.3) == std::chrono::nanoseconds(1 << 23));
+        REQUIRE(stats.priorities[normal].wait_time.percentile(1.0) == std::chrono::nanoseconds(1 << 24));
+        REQUIRE(stats.priorities[normal].run_time.count() == 3u);
+        REQUIRE(stats.priorities[normal].run_time.percentile(1.0) == std::chrono::nanoseconds(1 << 23));
+
+        REQUIRE(stats.calls == 1u);
+        REQUIRE(stats.over_budget_calls == 0u);
+        REQUIRE(stats.last_call.processed_tasks == 4u);
+        REQUIRE(stats.last_call.busy_time == 20ms);
+        REQUIRE(stats.call_time.percentile(0.5) == std::chrono::nanoseconds(1 << 25));
+
+        s.schedule([](){ clock::advance(10ms); });
+        s.process_tasks_for(7ms);
+        stats = s.stats();
+        REQUIRE(stats.calls == 2u);
+        REQUIRE(stats.over_budget_calls == 1u);
+        REQUIRE(stats.last_call.budget == 7ms);
+        REQUIRE(stats.last_call.busy_time == 10ms);
+    }
+    {
+        sd::scheduler_histogram histogram;
+        REQUIRE(histogram.count() == 0u);
+        REQUIRE(histogram.percentile(0.5) == 0ns);
+        histogram.buckets[3] = 2;
+        histogram.buckets[10] = 2;
+        REQUIRE(histogram.count() == 4u);
+        REQUIRE(histogram.percentile(0.5) == 8ns);
+        REQUIRE(histogram.percentile(0.75) == 1024ns);
+    }
+}
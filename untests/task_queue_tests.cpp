@@ -0,0 +1,104 @@
+/*******************************************************************************
+ * This file is part of the "https://github.com/blackmatov/promise.hpp"
+ * For conditions of distribution and use, see copyright notice in LICENSE.md
+ * Copyright (C) 2018-2023, by Matvey Cherevko (blackmatov@gmail.com)
+ ******************************************************************************/
+
+#include <promise.hpp/bonus/task_queue.hpp>
+#include <doctest/doctest.h>
+
+#include <thread>
+#include <vector>
+
+namespace tq = task_queue_hpp;
+
+namespace
+{
+    enum class test_priority {
+        lowest,
+        normal,
+        highest
+    };
+}
+
+TEST_CASE("earliest_deadline_policy") {
+    {
+        tq::earliest_deadline_policy::queue<test_priority, int> q;
+        q.push(test_priority::lowest, 1);
+        q.push(test_priority::highest, 2);
+        q.push(test_priority::normal, 3);
+        q.push(test_priority::highest, 4);
+        REQUIRE(q.size() == 4);
+        REQUIRE(q.top_priority() == test_priority::highest);
+        REQUIRE(q.top() == 2);
+        REQUIRE(q.pop() == 2);
+        REQUIRE(q.pop() == 4);
+        REQUIRE(q.pop() == 3);
+        REQUIRE(q.pop() == 1);
+        REQUIRE(q.empty());
+    }
+    {
+        // a waiting lower priority passes the fresh higher ones
+        tq::earliest_deadline_policy::queue<test_priority, int> q;
+        q.push(test_priority::lowest, 1);
+        std::this_thread::sleep_for(tq::earliest_deadline_policy::highest_budget * 4);
+        q.push(test_priority::highest, 2);
+        REQUIRE(q.top_priority() == test_priority::lowest);
+        REQUIRE(q.pop() == 1);
+        REQUIRE(q.pop() == 2);
+    }
+}
+
+TEST_CASE("mpmc_fifo_policy") {
+    {
+        // the overflow keeps the order after the ring fills up
+        tq::mpmc_fifo_policy<4>::queue<test_priority, int> q;
+        for ( int i = 0; i < 10; ++i ) {
+            q.push(test_priority::normal, i);
+        }
+        q.push(test_priority::highest, 42);
+        REQUIRE(q.size() == 11);
+        REQUIRE(q.top_priority() == test_priority::highest);
+        REQUIRE(q.pop() == 42);
+        for ( int i = 0; i < 10; ++i ) {
+            REQUIRE(q.top() == i);
+            REQUIRE(q.pop() == i);
+        }
+        REQUIRE(q.empty());
+        q.push(test_priority::lowest, 1);
+        tq::mpmc_fifo_policy<4>::queue<test_priority, int> other;
+        q.swap(other);
+        REQUIRE(q.empty());
+        REQUIRE(other.pop() == 1);
+    }
+    {
+        tq::mpmc_fifo_policy<16>::queue<test_priority, int> q;
+        const int values_per_producer = 5000;
+        std::atomic<int> popped{0};
+        std::atomic<long long> sum{0};
+        std::vector<std::thread> threads;
+        for ( int p = 0; p < 2; ++p ) {
+            threads.emplace_back([&q](){
+                for ( int i = 1; i <= values_per_producer; ++i ) {
+                    q.push(static_cast<test_priority>(i % 3), i);
+                }
+            });
+            threads.emplace_back([&q, &popped, &sum](){
+                while ( popped < 2 * values_per_producer ) {
+                    int value = 0;
+                    if ( q.try_pop(value) ) {
+                        sum += value;
+                        ++popped;
+                    } else {
+                        std::this_thread::yield();
+                    }
+                }
+            });
+        }
+        for ( std::thread& thread : threads ) {
+            thread.join();
+        }
+        REQUIRE(q.empty());
+        REQUIRE(sum == 2LL * values_per_producer * (values_per_producer + 1) / 2);
+    }
+}